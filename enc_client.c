@@ -4,7 +4,11 @@
 #include <string.h>
 #include <sys/types.h>    // ssize_t
 #include <sys/socket.h> // send(),recv()
-#include <netdb.h>            // gethostbyname()
+#include <netdb.h>            // getaddrinfo()
+
+#include "otp_client.h"
+#include "otp_pack.h"
+#include "otp_socket.h"
 
 /**
 * Client code
@@ -15,9 +19,12 @@
 
 #define BUFFERSIZE 512
 #define CHUNKSIZE 512
-#define PERMISSION "enc_client"
-#define PERM_GRANTED "PERMISSION GRANTED"
-#define PERM_NOT_GRANTED "PERMISSION NOT GRANTED"
+#define UNIX_SOCKET_ENV "ENC_UNIX_SOCKET" // unix socket of a server on this host, tried before TCP
+#define SHM_ENV "OTP_SHM" // set to use a shared memory ring over the unix socket
+#define PACKED_ENV "OTP_PACKED" // set to 0 to always send the files as text
+#define COMPRESS_ENV "OTP_COMPRESS" // set to compress the plaintext where the network is the bottleneck
+#define DIRECT_ENV "OTP_DIRECT" // set to write the -o file with O_DIRECT
+#define PROFILE_ENV "OTP_SOCKET_PROFILE" // latency (the default) or throughput, see otp_socket.h
 
 // Error function used for reporting issues
 void error(const char *msg) { 
@@ -25,27 +32,6 @@ void error(const char *msg) {
     exit(0); 
 } 
 
-// Set up the address struct
-void setupAddressStruct(struct sockaddr_in* address, int portNumber, char* hostname){
- 
-    // Clear out the address struct
-    memset((char*) address, '\0', sizeof(*address)); 
-
-    // The address should be network capable
-    address->sin_family = AF_INET;
-    // Store the port number
-    address->sin_port = htons(portNumber);
-
-    // Get the DNS entry for this host name
-    struct hostent* hostInfo = gethostbyname(hostname); 
-    if (hostInfo == NULL) { 
-        fprintf(stderr, "CLIENT: ERROR, no such host\n"); 
-        exit(0); 
-    }
-    // Copy the first IP address from the DNS entry to sin_addr.s_addr
-    memcpy((char*) &address->sin_addr.s_addr, hostInfo->h_addr_list[0], hostInfo->h_length);
-}
-
 char* fts (char* filename) {
 	FILE *file = fopen(filename, "r");
     char *content;
@@ -75,6 +61,17 @@ char* fts (char* filename) {
 	fread(content, sizeof(char), file_size, file);
     content[file_size] = '\0';
 
+    // a packed file (keygen -p) is turned back into text
+    if (is_packed_file(content, file_size)) {
+        char* text = unpack_file(content, file_size);
+        if (text == NULL) {
+            printf("Packed file is cut short\n");
+        }
+        free(content);
+        fclose(file);
+        return text;
+    }
+
     // make sure there is a termination char
     if (content[file_size - 1] == '\n') {
         content[file_size - 1] = '\0';
@@ -86,68 +83,49 @@ char* fts (char* filename) {
 }
 
 
-void create_socket (int* socketFD) {
-    *socketFD = socket(AF_INET, SOCK_STREAM, 0); // create socket
-    if (*socketFD < 0){
-        error("CLIENT: ERROR opening socket");
-    }
-}
-
-void connect_to_server(int socketFD, struct sockaddr_in serverAddress) {
-    if (connect(socketFD, (struct sockaddr*)&serverAddress, sizeof(serverAddress)) < 0) { // create connection 
-        error("CLIENT: ERROR connecting");
-    }
-}
-
-int send_to_server (int socketFD, char *to_send, int length) {
+int send_to_server (int socketFD, const char *to_send, int length) {
     // Send message to server
     // Write to the server
 
-    int len_sent = send(socketFD, &length, sizeof(length), 0); // send the length of the message first
-    if (len_sent < 0) {
-        error("ERROR writing length to socket");
+    // the length and data in one write, a chunk isn't held back waiting on its length's ack
+    if (send_frame_all(socketFD, to_send, length) < 0) {
+        error("ERROR writing to socket");
     }
 
-    int data_sent = send(socketFD, to_send, length, 0); // send the message content
-    if (data_sent < 0) {
-        error("ERROR writing data to socket");
-    }
-
-    return data_sent; // return the number of chars sent
+    return length; // return the number of chars sent
 }
 
 char* recieve_from_server (int socketFD) {
     int length;
-    char buffer[CHUNKSIZE+1] = {0}; // initialize
+    char buffer[CHUNKSIZE+2];
 
     // Read the length of the data
-    int lengthRead = recv(socketFD, &length, sizeof(length), 0);
+    int lengthRead = recv(socketFD, &length, sizeof(length), MSG_WAITALL);
     if (lengthRead < 0) {
         error("ERROR reading length from socket");
         return NULL;
     }
 
-    // if we got nothing return nothing
-    if (lengthRead == 0) {
-        return strdup("");
-    }
-
-    if (buffer == NULL) {
-        error("ERROR allocating memory for buffer");
+    // the server hung up before finishing the response
+    if (lengthRead < (int) sizeof(length) || length < 0 || length > CHUNKSIZE+1) {
         return NULL;
     }
 
-    // Read the data
-    int dataRead = recv(socketFD, buffer, length, 0);
+    // Read the data, all of the chunk even when it arrives in pieces
+    int dataRead = recv(socketFD, buffer, length, MSG_WAITALL);
     if (dataRead < 0) {
         error("ERROR reading data from socket");
         return NULL;
     }
+    if (dataRead < length) {
+        return NULL;
+    }
+    buffer[length] = '\0';
 
     return strdup(buffer);
 }
 
-void send_in_chunks(int socketFD, char* content) {
+void send_in_chunks(int socketFD, const char* content) {
     int content_len = strlen(content);
 
     char chunk[CHUNKSIZE + 1];
@@ -170,102 +148,287 @@ void send_in_chunks(int socketFD, char* content) {
     send_to_server(socketFD, "\r", 1);
 }
 
-char* recieve_chunked_encryption (int socketFD) {
+// write each chunk of the response out as it arrives, the chunks are one piece of
+// text so the only newline is the one after the last
+void recieve_chunked_encryption (int socketFD, struct otp_output* out) {
     char* to_recieve;
 
-    char* total_content = NULL;
-    int total_len = 0;
-
     do {
-        to_recieve = recieve_from_server(socketFD); // recieve chunks
+        // recieve chunks
+        to_recieve = recieve_from_server(socketFD);
 
         if (to_recieve == NULL) {
-            error("ERROR receiving from client");
+            error("ERROR receiving from server");
         }
 
-        if (to_recieve[0] == '\r') { // termination char to stop the loop
+        // if the server told you to stop reading, stop the loop
+        if (to_recieve[0] == '\r') {
             free(to_recieve);
             break;
         }
 
-        // alloc memory and append to new content
-        char* new_content = (char*) realloc(total_content, total_len + strlen(to_recieve) + 1);
-        if (new_content == NULL) {
-            free(total_content); // Free previously allocated memory on realloc failure
-            error("ERROR reallocating memory for file_content");
-        }
-        total_content = new_content;
-
-        // append chunk to memory
-        memcpy(total_content + total_len, to_recieve, strlen(to_recieve)+1);
-        total_len += strlen(to_recieve)+1;
-        total_content[total_len-1] = '\n';
-        total_content[total_len] = '\0';
-
+        output_puts(out, to_recieve);
         free(to_recieve);
     } while (1);
 
-    return total_content;
+    output_puts(out, "\n");
+}
+
+// write out whatever is still buffered, returns 1 if the result didn't all make it
+int finish_output (struct otp_output* out) {
+    if (output_close(out) < 0) {
+        fprintf(stderr, "CLIENT: ERROR writing the output\n");
+        return 1;
+    }
+    return 0;
+}
+
+// a refusal is left for main to report, anything else is reported here
+int request_failed (int status, const char* what) {
+    if (status == POOL_ERR_PERMISSION) {
+        return status;
+    }
+    fprintf(stderr, "CLIENT: ERROR %s\n", what);
+    return -1;
+}
+
+// send one plaintext with the part of the key it uses as a request of its own
+// returns 0 if the connection can take another request, -1 once it has failed or
+// POOL_ERR_PERMISSION if the server turned out to refuse the client
+int send_request (int socketFD, struct grant* grant, int options, const char* text, const char* key, struct otp_output* out) {
+    // the server can turn down a short key before any of the files are sent
+    int go = announce_request(socketFD, grant, options, strlen(text), key, out);
+    if (go < 0) {
+        return request_failed(go, "sending request header");
+    }
+    if (go == 0) {
+        return 0;
+    }
+
+    if (options & CAP_COMPRESS) {
+        // only the plaintext is worth compressing, the key is random
+        int status = compressed_request(socketFD, grant, text, key, go != ANNOUNCE_KEY_HELD, 1, out);
+        return status < 0 ? request_failed(status, "sending compressed request") : 0;
+    }
+
+    if (options & CAP_PACKED) {
+        int status = packed_request(socketFD, grant, &text, 1, key, go != ANNOUNCE_KEY_HELD, out);
+        return status < 0 ? request_failed(status, "sending packed request") : 0;
+    }
+
+    // throughput connections send the chunks as full segments, then let go of the last one
+    cork_socket(socketFD);
+    send_in_chunks(socketFD, text);
+    send_in_chunks(socketFD, key);
+    uncork_socket(socketFD);
+
+    // the reply to the hello comes ahead of the first response on a new connection
+    int granted = await_grant(socketFD, grant);
+    if (granted < 0) {
+        return request_failed(granted, "receiving from server");
+    }
+
+    recieve_chunked_encryption(socketFD, out);
+    return 0;
+}
+
+// send every plaintext in one request on a connection granted multi, the server
+// ciphers each with the part of the key after the one before it
+int send_multi_request (int socketFD, struct grant* grant, int options, const char** texts, int num_texts, const char* key, struct otp_output* out) {
+    char num_files[16];
+    uint32_t total = 0;
+
+    for (int i = 0; i < num_texts; i++) {
+        total += strlen(texts[i]);
+    }
+
+    // the amount of files goes first, the plaintexts and then the key
+    snprintf(num_files, sizeof(num_files), "%d", num_texts + 1);
+    send_to_server(socketFD, num_files, strlen(num_files));
+
+    int go = announce_request(socketFD, grant, options, total, key, out);
+    if (go < 0) {
+        return request_failed(go, "sending request header");
+    }
+    if (go == 0) {
+        return 0;
+    }
+
+    int status = packed_request(socketFD, grant, texts, num_texts, key, go != ANNOUNCE_KEY_HELD, out);
+    return status < 0 ? request_failed(status, "sending packed request") : 0;
 }
 
-// argv[1] = plaintext
-// argv[2] = key
-// argv[3] = port
+// send the files over the connection, as one request or one for each plaintext
+// returns 0 if the connection can take another request, -1 once it has failed or
+// POOL_ERR_PERMISSION if the server turned out to refuse the client
+int send_files (struct conn_pool* pool, int endpoint, int socketFD, struct grant* grant, char** text_files, int num_texts, const char* key_file, struct otp_output* out) {
+    int options = pool->endpoints[endpoint].options;
+    int status = 0;
+
+    if (pool->shared_memory && pool->endpoints[endpoint].local) {
+        status = ring_request(socketFD, text_files[0], key_file, out);
+        if (status < 0) {
+            fprintf(stderr, "CLIENT: ERROR sending request through shared memory\n");
+        }
+    } else if (options & CAP_MULTI) {
+        status = send_multi_request(socketFD, grant, options, (const char**) text_files, num_texts, key_file, out);
+    } else {
+        // otherwise each plaintext is a request of its own on the same connection
+        size_t key_len = strlen(key_file);
+        size_t offset = 0;
+
+        for (int i = 0; i < num_texts && status == 0; i++) {
+            status = send_request(socketFD, grant, options, text_files[i], key_file + (offset < key_len ? offset : key_len), out);
+            offset += strlen(text_files[i]);
+        }
+    }
+
+    return status;
+}
+
+void free_files (char** text_files, int num_texts, char* key_file) {
+    for (int i = 0; i < num_texts; i++) {
+        free(text_files[i]);
+    }
+    free(text_files);
+    free(key_file);
+}
+
+// -o file = write the results to file instead of stdout
+// argv[1] ... = one or more plaintexts, each ciphered with the part of the key after the one before
+// second to last = key
+// last = port, or a comma separated list of host:port (or unix:path) endpoints to balance over
 int main(int argc, char *argv[]) {
     int socketFD;
-    struct sockaddr_in serverAddress;
+    int endpoint;
+    struct grant grant;
+    struct conn_pool pool;
+    struct otp_output output;
+    char* output_path = NULL;
+    int opt;
 
     // Check usage & args
-    if (argc < 4) { 
-        fprintf(stderr,"USAGE: %s plaintext key port\n", argv[0]); 
+    while ((opt = getopt(argc, argv, "o:")) != -1) {
+        if (opt != 'o') {
+            fprintf(stderr,"USAGE: %s [-o file] plaintext... key port\n", argv[0]);
+            exit(0);
+        }
+        output_path = optarg;
+    }
+    if (argc - optind < 3) { 
+        fprintf(stderr,"USAGE: %s [-o file] plaintext... key port\n", argv[0]); 
         exit(0); 
     }
 
-	char* text_file = fts(argv[1]);
-	char* key_file = fts(argv[2]);
-
-    // Create a socket
-    create_socket(&socketFD);
+    // the files and port follow the options
+    argv += optind - 1;
+    argc -= optind - 1;
 
-     // Set up the server address struct
-    setupAddressStruct(&serverAddress, atoi(argv[3]), "localhost");
+    int num_texts = argc - 3;
+    char** text_files = (char**) malloc(sizeof(char*) * num_texts);
+    if (text_files == NULL) {
+        error("ERROR allocating memory for the files");
+    }
+    for (int i = 0; i < num_texts; i++) {
+        text_files[i] = fts(argv[i + 1]);
+    }
+	char* key_file = fts(argv[argc - 2]);
+    char* port = argv[argc - 1];
+
+    // Resolve the servers once, the pool keeps the addresses for the rest of the run
+    pool_init(&pool, ROLE_ENC);
+    if (pool_add_endpoints(&pool, port, "localhost") <= 0) {
+        fprintf(stderr, "CLIENT: ERROR, no such host\n");
+        exit(2);
+    }
 
-    // Connect to server
-    connect_to_server(socketFD, serverAddress);
+    // same-host servers can also be reached without going through TCP
+    char* local_socket = getenv(UNIX_SOCKET_ENV);
+    if (local_socket != NULL && pool_add_local_endpoint(&pool, local_socket) < 0) {
+        fprintf(stderr, "CLIENT: ERROR, bad unix socket path %s\n", local_socket);
+        exit(2);
+    }
 
-    // ask server for permission
-    send_to_server(socketFD, PERMISSION, strlen(PERMISSION));
-    
-    // if server does not give permission, end program!
-    if (strcmp(recieve_from_server(socketFD), PERM_GRANTED) != 0) {
-        // Close the socket
-        close(socketFD);
+    // over the unix socket the request can go through shared memory instead,
+    // a ring carries a single request
+    pool.shared_memory = getenv(SHM_ENV) != NULL && num_texts == 1;
 
-        //free(to_send);
-        free(text_file);
-        free(key_file);
+    // files of only the 27 symbols can go over packed, anything else is left for the server to reject
+    pool.packed = getenv(PACKED_ENV) == NULL || strcmp(getenv(PACKED_ENV), "0") != 0;
+    for (int i = 0; i < num_texts && pool.packed; i++) {
+        pool.packed = pack_text(text_files[i], strlen(text_files[i]), NULL) == 0;
+    }
+    if (pool.packed && pack_text(key_file, strlen(key_file), NULL) < 0) {
+        pool.packed = 0;
+    }
+    pool.compress = getenv(COMPRESS_ENV) != NULL;
 
-        printf("ENC_CLIENT does not have permission to run on this server!\n");
+    // several plaintexts can share one request and one upload of the key
+    pool.multi = num_texts > 1;
 
-        return 1; // bad return val
+    // big requests over a slow link do better corked with bigger buffers than sent right away
+    char* profile = getenv(PROFILE_ENV);
+    if (profile != NULL) {
+        if (socket_profile_named(profile) < 0) {
+            fprintf(stderr, "CLIENT: ERROR, unknown socket profile %s\n", profile);
+            exit(2);
+        }
+        set_socket_profile(socket_profile_named(profile));
     }
 
-    for (int i = 1; i < argc - 1; i++) {
+    // Connect and ask server for permission, retrying if the server is not up or busy.
+    // a server that only refuses us once the request is sent is ejected, and the request
+    // goes to the next endpoint, nothing has been written out by then
+    int opened = 0;
+    int status = POOL_ERR_PERMISSION;
+    while (status == POOL_ERR_PERMISSION) {
+        socketFD = pool_acquire(&pool, &endpoint, &grant);
+        if (socketFD < 0) {
+            break;
+        }
+
+        // the result goes out a block at a time as it arrives, to the file or to stdout
+        if (!opened && (output_path != NULL ? output_open(&output, output_path, getenv(DIRECT_ENV) != NULL) : output_stdout(&output)) < 0) {
+            pool_release(&pool, endpoint, socketFD, 0);
+            pool_destroy(&pool);
+            free_files(text_files, num_texts, key_file);
+
+            fprintf(stderr, "CLIENT: ERROR opening %s\n", output_path != NULL ? output_path : "stdout");
+            return 1;
+        }
+        opened = 1;
 
-        char* file_content = fts(argv[i]);
+        status = send_files(&pool, endpoint, socketFD, &grant, text_files, num_texts, key_file, &output);
 
-        send_in_chunks(socketFD, file_content);
-        
+        // a request that finished cleanly leaves the connection ready for another one
+        pool_release(&pool, endpoint, socketFD, status == 0);
     }
+    pool_destroy(&pool);
+    free_files(text_files, num_texts, key_file);
 
-    printf("%s\n", recieve_chunked_encryption(socketFD));
+    // if server does not give permission, end program!
+    if (socketFD == POOL_ERR_PERMISSION) {
+        if (opened) {
+            output_close(&output);
+        }
+        printf("ENC_CLIENT does not have permission to run on this server!\n");
 
-    // Close the socket
-    close(socketFD);
+        return 1; // bad return val
+    }
 
-    //free(to_send);
-	free(text_file);
-	free(key_file);
+    if (socketFD < 0) {
+        if (opened) {
+            output_close(&output);
+        }
+        fprintf(stderr, "CLIENT: ERROR connecting to port %s\n", port);
+        return 2;
+    }
 
-    return 0;
-}
\ No newline at end of file
+    // the error text went out with the results, where the server found the error goes to stderr
+    if (output.error_at >= 0) {
+        fprintf(stderr, "CLIENT: the server reported the error at offset %ld\n", output.error_at);
+    }
+
+    int written = finish_output(&output);
+    return status < 0 ? 1 : written;
+}
@@ -2,18 +2,25 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <signal.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 
-#define CHUNKSIZE 512
-#define NUM_FILES_RECIEVE 2
+#include "otp_server.h"
+#include "otp_ring.h"
+#include "otp_pack.h"
+#include "otp_lz4.h"
+#include "otp_cache.h"
+#include "otp_buffer.h"
+#include "otp_capture.h"
+#include "otp_socket.h"
 
+#define CHUNKSIZE 512
 #define LEN_ERROR "Invalid key! The key must be longer in length than the file content!\n"
 #define CHAR_ERROR "invalid character, not sending!\n"
-#define PERMISSION "enc_client"
-#define PERM_GRANTED "PERMISSION GRANTED"
-#define PERM_NOT_GRANTED "PERMISSION NOT GRANTED"
+#define SIZE_ERROR "The request is bigger than this server takes!\n"
 
 
 // Error function used for reporting issues
@@ -40,25 +47,28 @@ int respond_to_client (int socketFD, const char* response, int length) {
     // Send message to server
     // Write to the server
 
-    int len_sent = send(socketFD, &length, sizeof(length), 0);
-    if (len_sent < 0) {
-        error("ERROR writing length to socket");
+    // a client that went away only ends its own connection, not the server
+    // the length and data go out in one write, so Nagle never holds the data back
+    if (send_frame_all(socketFD, response, length) < 0) {
+        perror("ERROR writing to socket");
+        return -1;
     }
 
-    int data_sent = send(socketFD, response, length, 0);
-    if (data_sent < 0) {
-        error("ERROR writing data to socket");
-    }
-
-    return data_sent;
+    return length;
 }
 
-int create_socket (int port, struct sockaddr_in serverAddress) {
+int create_socket (int port, struct sockaddr_in serverAddress, int reuseport) {
     int listenSocket = socket(AF_INET, SOCK_STREAM, 0);
     if (listenSocket < 0) {
         error("ERROR opening socket");
     }
 
+    // shards each bind their own socket to the same port and the kernel balances between them
+    int on = 1;
+    if (reuseport && setsockopt(listenSocket, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+        error("ERROR setting SO_REUSEPORT");
+    }
+
     // Set up the address struct for the server socket
     setupAddressStruct(&serverAddress, port);
 
@@ -67,54 +77,76 @@ int create_socket (int port, struct sockaddr_in serverAddress) {
         error("ERROR on binding");
     }
 
-    // Start listening for connetions. Allow up to 5 connections to queue up
-    listen(listenSocket, 5); 
+    // Start listening for connetions. A shard serves one at a time, so everything a burst of
+    // clients opens has to queue here, past the backlog the kernel drops SYNs and the
+    // client waits out a 1 second retransmit
+    listen(listenSocket, SOMAXCONN);
     
     return listenSocket;
 }
 
+// Read exactly length bytes, returns 0 if the client closed or the read failed
+int recv_all (int connectionSocket, void* buffer, int length) {
+    int total = 0;
+
+    while (total < length) {
+        int got = recv(connectionSocket, (char*) buffer + total, length - total, 0);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got < 0) {
+            perror("ERROR reading from socket");
+            return 0;
+        }
+        if (got == 0) {
+            return 0;
+        }
+        capture_received(connectionSocket, (char*) buffer + total, got);
+        total += got;
+    }
+
+    return 1;
+}
+
+// returns NULL once the client has closed the connection
 char* recieve_from_client (int connectionSocket) {
     int length;
     char buffer[CHUNKSIZE+1];
 
     // Read the length of the data
-    int lengthRead = recv(connectionSocket, &length, sizeof(length), 0);
-    
-    if (lengthRead < 0) {
-        error("ERROR reading length from socket");
+    if (!recv_all(connectionSocket, &length, sizeof(length))) {
         return NULL;
     }
 
-    // if therese nothing return nothing
-    if (lengthRead == 0) {
-        return strdup("");
+    // a bad length means we lost track of the frames, give up on this client
+    if (length < 0 || length > CHUNKSIZE + 1) {
+        fprintf(stderr, "ERROR bad frame length %d from client\n", length);
+        return NULL;
     }
 
     // Read the data
-    int dataRead = recv(connectionSocket, buffer, length, 0);
-    if (dataRead < 0) {
-        error("ERROR reading data from socket");
+    if (!recv_all(connectionSocket, buffer, length)) {
         return NULL;
     }
 
     // put this at the end to ensure there is a termiantion
-    buffer[dataRead] = '\0';
+    buffer[length < CHUNKSIZE + 1 ? length : CHUNKSIZE] = '\0';
 
     return strdup(buffer);
 }
 
-char* recieve_chunked_file (int connectionSocket) {
+// read one file sent in chunks, handing each chunk to consume as it arrives
+// returns 0 if the client hung up partway through the file
+int recieve_chunked_file (int connectionSocket, void (*consume)(char* chunk, int length, void* arg), void* arg) {
     char* to_recieve;
-    char* total_content = NULL;
-    int total_len = 0;
 
     do {
         // get the chunk from the client
         to_recieve = recieve_from_client(connectionSocket);
 
-        // if it didnt print error
+        // the client hung up partway through the file
         if (to_recieve == NULL) {
-            error("ERROR receiving from client");
+            return 0;
         }
 
         // this specific character tells the program when to end reading for a file
@@ -123,36 +155,13 @@ char* recieve_chunked_file (int connectionSocket) {
             break;
         }
 
-        // append to new_content's memory
-        char* new_content = (char*) realloc(total_content, total_len + strlen(to_recieve) + 1);
-        if (new_content == NULL) {
-            free(total_content); // Free previously allocated memory on realloc failure
-            error("ERROR reallocating memory for file_content");
-        }
-        total_content = new_content;
-
-        // append to new_content's memory
-        memcpy(total_content + total_len, to_recieve, strlen(to_recieve));
-        total_len += strlen(to_recieve);
-        total_content[total_len] = '\0'; // make sure that there is a termination symbol
+        consume(to_recieve, strlen(to_recieve), arg);
 
         // clear memory
         free(to_recieve);
     } while (1);
 
-    // allocate memory for the whole file not just in chunks and ensure there is extra space for any needed chars
-    char* final_content = (char*) realloc(total_content, total_len + 2);
-    if (final_content == NULL) {
-        free(total_content);
-        error("ERROR reallocating memory for final content");
-    }
-    total_content = final_content;
-
-    // needed chars
-    total_content[total_len] = '\n';
-    total_content[total_len + 1] = '\0';
-
-    return total_content;
+    return 1;
 }
 
 void send_in_chunks(int connectionSocket, char* content) {
@@ -181,146 +190,509 @@ void send_in_chunks(int connectionSocket, char* content) {
     respond_to_client(connectionSocket, "\r", 1);
 }
 
-void encrypt_message (int connectionSocket, char* content, char* key) {
-    int valid_content_chars = 1; // check to see if there are any bad characters in the file
+// 0-25 for A-Z, 26 for space, -1 for anything else
+int symbol_value (char c) {
+    if (c == ' ') {
+        return 26;
+    }
+    if (c >= 'A' && c <= 'Z') {
+        return c - 'A';
+    }
+    return -1;
+}
 
-    // go through all the content
-    for (int j = 0; j < strlen(content); j++) {
-
-        // 10 is the Line Feed character
-        if (content[j] != 10 && content[j] != ' ' 
-        && (content[j] < 'A' || content[j] > 'Z')) {
-            printf("Invalid character %d detected at position %d\n", content[j], j);
-            valid_content_chars = 0;
-            break;
-        }
+// encrypt length chars of content in place, checking the content and the key in the same pass
+// returns 0 with error set at the first bad char, the content is then only partly encrypted
+int encrypt_text (char* content, long length, const char* key, struct cipher_error* error) {
+    for (long j = 0; j < length; j++) {
 
         // dont count the newlines
         if (content[j] == '\n') {
             continue;
         }
 
-        // handle spaces in the content
-        int content_c = 0;
-        if (content[j] == ' ') {
-            content_c = 26;
-        } else {
-            content_c = content[j] - 'A';
-        }
-        
-        // handle spaces in the key
-        int key_c = 0;
-        if (key[j] == ' ') {
-            key_c = 26;
-        } else {
-            key_c = key[j] - 'A';
+        int content_c = symbol_value(content[j]);
+        int key_c = symbol_value(key[j]);
+        if (content_c < 0 || key_c < 0) {
+            error->code = CIPHER_CHAR_ERROR;
+            error->offset = j;
+            return 0;
         }
 
         // encrypt the content and handle spaces
-        int encrypted_c = (content_c + key_c) % 27;
-        if (encrypted_c == 26) {
+        int result_c = (content_c + key_c) % 27;
+        if (result_c == 26) {
             content[j] = ' ';
         } else {
-            content[j] = encrypted_c + 'A';
+            content[j] = result_c + 'A';
+        }
+    }
+
+    return 1;
+}
+
+// tell the client what was wrong with its request and log where it went wrong
+void report_error (int connectionSocket, struct cipher_error* error) {
+    if (error->code == CIPHER_LEN_ERROR) {
+        printf("Key too short, it ends at position %ld\n", error->offset);
+        send_in_chunks(connectionSocket, LEN_ERROR);
+    } else if (error->code == CIPHER_SIZE_ERROR) {
+        printf("Request too big, over the %ld byte limit\n", error->offset);
+        send_in_chunks(connectionSocket, SIZE_ERROR);
+    } else {
+        printf("Invalid character detected at position %ld\n", error->offset);
+        send_in_chunks(connectionSocket, CHAR_ERROR);
+    }
+}
+
+// one request on the chunked protocol, built up as the chunks come in
+struct request {
+    char* text;
+    long text_len;
+    long text_size; // bytes allocated for the text
+    long ciphered;  // how much of the text the key has covered so far
+    struct cipher_error error;
+};
+
+// check each chunk of the text as it arrives, once it is bad the rest is only read past
+void append_text (char* chunk, int length, void* arg) {
+    struct request* request = arg;
+
+    if (request->error.code != CIPHER_OK) {
+        return;
+    }
+
+    for (int j = 0; j < length; j++) {
+        if (chunk[j] != '\n' && symbol_value(chunk[j]) < 0) {
+            request->error.code = CIPHER_CHAR_ERROR;
+            request->error.offset = request->text_len + j;
+            return;
+        }
+    }
+
+    // past the request limit the rest is only read past, the client hears why at the end
+    if (over_request_limit(request->text_len + length, &request->error)) {
+        return;
+    }
+
+    // append to the text, leaving room for the chars added at the end
+    // the buffer at least doubles, so a text bigger than its preallocation isn't copied chunk by chunk
+    if (request->text_len + length + 2 > request->text_size) {
+        long size = request->text_len + length + 2;
+        if (size < request->text_size * 2) {
+            size = request->text_size * 2;
+        }
+        char* new_text = buffer_realloc(request->text, size);
+        if (new_text == NULL) {
+            error("ERROR reallocating memory for file_content");
+        }
+        request->text = new_text;
+        request->text_size = size;
+    }
+    memcpy(request->text + request->text_len, chunk, length);
+    request->text_len += length;
+}
+
+// encrypt the text with each chunk of the key as it arrives
+void apply_key (char* chunk, int length, void* arg) {
+    struct request* request = arg;
+    long left = request->text_len - request->ciphered;
+
+    if (request->error.code != CIPHER_OK || left == 0) {
+        return;
+    }
+
+    long count = length < left ? length : left;
+    if (!encrypt_text(request->text + request->ciphered, count, chunk, &request->error)) {
+        request->error.offset += request->ciphered;
+        return;
+    }
+    request->ciphered += count;
+}
+
+// serve one request, returns 0 once the client has no more requests to send
+int handle_request (int connectionSocket, int sized) {
+    struct request request = { NULL, 0, 0, 0, { CIPHER_OK, 0 } };
+    struct request_header header;
+    struct offered_key offered = { -1, 0, NULL }; // the key streams straight into the cipher, so none are kept
+
+    // a short key announced upfront is turned down without reading the files
+    int start = start_request(connectionSocket, sized, &header, &request.error, &offered);
+    if (start < 0) {
+        return 0;
+    }
+    if (start == 0) {
+        report_error(connectionSocket, &request.error);
+        return 1;
+    }
+
+    // with the size known the text buffer is allocated once, up to a bound, since the
+    // client can announce far more than it goes on to send
+    if (sized && request.error.code == CIPHER_OK) {
+        long size = header.text_len < PREALLOC_MAX_BYTES ? (long) header.text_len + 2 : PREALLOC_MAX_BYTES;
+        request.text = buffer_alloc(size);
+        if (request.text == NULL) {
+            error("ERROR allocating memory for file_content");
+        }
+        request.text_size = size;
+    }
+
+    // the text is checked as it streams in and encrypted as the key streams in after it,
+    // so a bad text is rejected before the key has even arrived
+    if (!recieve_chunked_file(connectionSocket, append_text, &request)
+    || !recieve_chunked_file(connectionSocket, apply_key, &request)) {
+        buffer_free(request.text);
+        return 0;
+    }
+
+    // the key ran out before the text did
+    if (request.error.code == CIPHER_OK && request.ciphered < request.text_len) {
+        request.error.code = CIPHER_LEN_ERROR;
+        request.error.offset = request.ciphered;
+    }
+
+    if (request.error.code != CIPHER_OK) {
+        report_error(connectionSocket, &request.error);
+        buffer_free(request.text);
+        return 1;
+    }
+
+    // needed chars
+    if (request.text == NULL) {
+        request.text = buffer_alloc(2);
+        if (request.text == NULL) {
+            error("ERROR allocating memory for file_content");
         }
     }
+    request.text[request.text_len] = '\n';
+    request.text[request.text_len + 1] = '\0';
 
-    // if the entire content has only valid chars then send in the correct message
-    if (valid_content_chars == 1) {
-        send_in_chunks(connectionSocket, content);
-    } else { // if not then send an error message
-        respond_to_client(connectionSocket, CHAR_ERROR, strlen(CHAR_ERROR));
+    send_in_chunks(connectionSocket, request.text);
+    buffer_free(request.text);
+
+    return 1;
+}
+
+// cipher one document of a packed request with the part of the key from offset on, and send
+// back its status and result. the cipher runs straight on the packed symbols, so a bad char
+// can only be a corrupt file, and a text and key seen before get their earlier result back
+void cipher_document (int connectionSocket, uint8_t* text, uint32_t text_count, const uint8_t* key, uint32_t key_count, uint32_t offset) {
+    struct cipher_error outcome = { CIPHER_OK, 0 };
+    struct cache_key lookup;
+    const uint8_t* cached = NULL;
+    uint8_t* slice = NULL;
+
+    if ((uint64_t) offset + text_count > key_count) {
+        outcome.code = CIPHER_LEN_ERROR;
+        outcome.offset = key_count > offset ? key_count - offset : 0;
+    } else {
+        // a document after the first starts part way into a packed block of the key
+        if (offset > 0) {
+            slice = buffer_alloc(PACKED_BYTES(text_count) + 1);
+            if (slice == NULL) {
+                error("ERROR allocating memory for the key");
+            }
+            slice_packed(key, key_count, offset, text_count, slice);
+            key = slice;
+        }
+
+        if ((cached = cache_lookup(CACHE_PACKED, text, key, PACKED_BYTES(text_count), text_count, &lookup)) == NULL) {
+            long bad = cipher_packed(text, key, text_count, 0);
+            if (bad >= 0) {
+                outcome.code = CIPHER_CHAR_ERROR;
+                outcome.offset = bad;
+            } else {
+                cache_store(&lookup, text, PACKED_BYTES(text_count));
+            }
+        }
+    }
+
+    if (outcome.code == CIPHER_OK) {
+        send_status(connectionSocket, PACK_STATUS_OK);
+        send_packed(connectionSocket, cached != NULL ? cached : text, text_count);
+    } else {
+        send_error_status(connectionSocket, &outcome);
+        report_error(connectionSocket, &outcome);
+    }
+
+    buffer_free(slice);
+}
+
+// serve one request from a client that agreed to packed transfers
+// returns 0 once the client has no more requests to send
+int handle_packed_request (int connectionSocket, int sized, int multi) {
+    // a client that agreed to several documents a request first sends the amount of
+    // files, the documents and then the key
+    int num_texts = 1;
+    if (multi) {
+        char* num_files = recieve_from_client(connectionSocket);
+        if (num_files == NULL) {
+            return 0;
+        }
+        num_texts = atoi(num_files) - 1;
+        free(num_files);
+    }
+    if (num_texts < 1 || num_texts > MULTI_MAX_DOCUMENTS) {
+        return 0;
+    }
+
+    struct cipher_error error = { CIPHER_OK, 0 };
+    struct request_header header;
+    struct offered_key offered = { CACHE_PACKED, 0, NULL };
+    uint32_t key_count = 0;
+
+    int start = start_request(connectionSocket, sized, &header, &error, &offered);
+    if (start < 0) {
+        return 0;
+    }
+    if (start == 0) {
+        report_error(connectionSocket, &error);
+        return 1;
+    }
+
+    // every document has to be in before the key that follows them
+    uint8_t** texts = calloc(num_texts, sizeof(*texts));
+    uint32_t* text_counts = calloc(num_texts, sizeof(*text_counts));
+    uint64_t total = 0;
+    int got = 0;
+    if (texts == NULL || text_counts == NULL) {
+        free(texts);
+        free(text_counts);
+        return 0;
+    }
+    // nothing past the announced sizes or the -m limit is allocated, a request over
+    // the limit is read to its end and every document hears that it was too big
+    int status = 1;
+    while (got < num_texts) {
+        uint32_t most = !sized ? UINT32_MAX : total < header.text_len ? header.text_len - total : 0;
+        status = recv_request_packed(connectionSocket, &texts[got], &text_counts[got], total, most, &error);
+        if (status < 0) {
+            break;
+        }
+        total += text_counts[got++];
+    }
+
+    // a key the client offered by its hash and we still hold is not sent again
+    uint8_t* sent_key = NULL;
+    const uint8_t* key = offered.cached;
+    if (key != NULL) {
+        key_count = header.key_len;
+    } else if (status >= 0) {
+        status = recv_request_packed(connectionSocket, &sent_key, &key_count, total, sized ? header.key_len : UINT32_MAX, &error);
+        key = sent_key;
+        if (sent_key != NULL && (header.flags & HEADER_KEY_HASH)) {
+            keep_offered_key(&header, &offered, hash_packed_key(sent_key, key_count), key_count, sent_key, PACKED_BYTES(key_count));
+        }
+    }
+
+    // the counts have to be the sizes that were announced
+    int too_big = error.code == CIPHER_SIZE_ERROR;
+    int ok = status >= 0 && (too_big || (key != NULL && (!sized || (total == header.text_len && key_count == header.key_len))));
+
+    // each document takes up the part of the key after the one before it
+    uint32_t offset = 0;
+    for (int i = 0; ok && i < num_texts; i++) {
+        if (too_big) {
+            send_error_status(connectionSocket, &error);
+            report_error(connectionSocket, &error);
+            continue;
+        }
+        cipher_document(connectionSocket, texts[i], text_counts[i], key, key_count, offset);
+        offset = offset + text_counts[i] < offset ? UINT32_MAX : offset + text_counts[i];
+    }
+
+    for (int i = 0; i < got; i++) {
+        buffer_free(texts[i]);
+    }
+    free(texts);
+    free(text_counts);
+    buffer_free(sent_key);
+
+    return ok;
+}
+
+// the key of a compressed request and how far the text has got
+struct stream_cipher {
+    const char* key;
+    uint32_t key_len;
+    struct cipher_error error;
+};
+
+// encrypt each block of text as soon as it has been decompressed
+int encrypt_block (char* block, int length, uint32_t offset, void* arg) {
+    struct stream_cipher* stream = arg;
+
+    if (offset + length > stream->key_len) {
+        stream->error.code = CIPHER_LEN_ERROR;
+        stream->error.offset = stream->key_len;
+    } else if (!encrypt_text(block, length, stream->key + offset, &stream->error)) {
+        stream->error.offset += offset;
     }
+
+    return stream->error.code == CIPHER_OK;
+}
+
+// serve one request from a client that agreed to compressed transfers
+// returns 0 once the client has no more requests to send
+int handle_compressed_request (int connectionSocket, int sized) {
+    struct stream_cipher stream = { NULL, 0, { CIPHER_OK, 0 } };
+    struct request_header header;
+    struct offered_key offered = { CACHE_TEXT, 0, NULL };
+    uint32_t text_len = 0;
+    int status = 1;
+
+    int start = start_request(connectionSocket, sized, &header, &stream.error, &offered);
+    if (start < 0) {
+        return 0;
+    }
+    if (start == 0) {
+        report_error(connectionSocket, &stream.error);
+        return 1;
+    }
+
+    // the key comes first so the text can be ciphered while it streams in,
+    // unless the client offered it by its hash and we still hold it
+    char* key = NULL;
+    if (offered.cached != NULL) {
+        stream.key = offered.cached;
+        stream.key_len = header.key_len;
+    } else {
+        int check = header.flags & HEADER_KEY_HASH;
+        struct xxhash_state hash;
+        xxhash64_init(&hash, 0);
+        status = recv_request_blocks(connectionSocket, &key, &stream.key_len, 0, sized ? header.key_len : UINT32_MAX, &stream.error, check ? hash_key_block : NULL, &hash);
+        stream.key = key;
+        if (key != NULL && check) {
+            keep_offered_key(&header, &offered, xxhash64_digest(&hash), stream.key_len, key, stream.key_len);
+        }
+    }
+
+    // nothing past the announced sizes or the -m limit is allocated, a request over the
+    // limit is read to its end and hears that it was too big. a key read past leaves the
+    // text with no room, so it is read past too and never reaches encrypt_block
+    char* text = NULL;
+    if (status >= 0) {
+        status = recv_request_blocks(connectionSocket, &text, &text_len, stream.key_len, sized ? header.text_len : UINT32_MAX, &stream.error, encrypt_block, &stream);
+    }
+
+    // the lengths have to be the sizes that were announced
+    int too_big = stream.error.code == CIPHER_SIZE_ERROR;
+    if (status < 0 || (!too_big && sized && (text_len != header.text_len || stream.key_len != header.key_len))) {
+        buffer_free(text);
+        buffer_free(key);
+        return 0;
+    }
+
+    if (stream.error.code == CIPHER_OK) {
+        send_status(connectionSocket, PACK_STATUS_OK);
+        send_blocks(connectionSocket, text, text_len, 0);
+    } else {
+        send_error_status(connectionSocket, &stream.error);
+        report_error(connectionSocket, &stream.error);
+    }
+
+    buffer_free(text);
+    buffer_free(key);
+
+    return 1;
 }
 
 int main(int argc, char *argv[]){
     int connectionSocket = -1;
     struct sockaddr_in serverAddress, clientAddress;
-    socklen_t sizeOfClientInfo = sizeof(clientAddress);
+
+    struct server_config config;
+    int listenSockets[MAX_SHARDS];
 
     // Check usage & args
-    if (argc < 2) { 
-        fprintf(stderr,"USAGE: %s port\n", argv[0]); 
-        exit(1);
-    } 
+    parse_server_args(argc, argv, &config);
     
-    // Create the socket that will listen for connections
-    int listenSocket = create_socket(atoi(argv[1]), serverAddress);    
+    // a client hanging up mid-response must not take the server down with it
+    signal(SIGPIPE, SIG_IGN);
+
+    // a restarted server picks up the sockets it was handed instead of binding again
+    if (!inherit_listeners(&config, listenSockets)) {
+        // Create the sockets that will listen for connections, one per shard
+        for (int i = 0; i < config.num_shards; i++) {
+            listenSockets[i] = create_socket(config.port, serverAddress, config.num_shards > 1);
+
+            // port 0 binds one the kernel picks, the other shards bind that same one
+            config.port = listening_port(listenSockets[i]);
+        }
+    }
+
+    // same-host clients can skip TCP and connect here
+    open_unix_listener(&config);
+
+    // record what clients send for otp_replay, opened before any shards are forked
+    if (config.capture_path != NULL && capture_start(config.capture_path, ROLE_ENC) < 0) {
+        error("ERROR opening the capture");
+    }
+
+    // the connections queue from here, so whoever started us can stop waiting
+    announce_listening(&config, listenSockets[0]);
+
+    // from here on each shard process serves connections from its own socket
+    int listenSocket = listenSockets[run_shards(&config, listenSockets)];
 
     // Accept a connection, blocking if one is not available until one connects
-    while(1) {
+    while (keep_serving()) {
 
         // wait for connection and accept
-        while (connectionSocket < 0) {
-            connectionSocket = accept(listenSocket, (struct sockaddr *)&clientAddress, &sizeOfClientInfo);
-            if (connectionSocket < 0) {
-                error("ERROR on accept");
+        connectionSocket = accept_client(listenSocket, &config, &clientAddress);
+        if (connectionSocket < 0) {
+            // a signal woke us up, go see if it was asking us to stop
+            if (errno == EINTR) {
+                continue;
             }
+            error("ERROR on accept");
         }
 
         // print that the client connected and accepted
         printf("SERVER: Connected to client running at host %d port %d\n", ntohs(clientAddress.sin_addr.s_addr), ntohs(clientAddress.sin_port));
 
-        if (strcmp(recieve_from_client(connectionSocket), PERMISSION) == 0) {
-            // give permission and carry on.
-            respond_to_client(connectionSocket, PERM_GRANTED, strlen(PERM_GRANTED));
-        } else {
-
-            // do not give permission
-            respond_to_client(connectionSocket, PERM_NOT_GRANTED, strlen(PERM_NOT_GRANTED));
-
-            // Close the connection socket for this client
-            close(connectionSocket);
+        // the client's first request follows its hello without waiting for the reply
+        struct hello hello;
+        capture_open(connectionSocket);
+        set_deadline(connectionSocket, DEADLINE_HELLO);
+        int options = recv_hello(connectionSocket, &hello) < 0 ? -1 : check_hello(&hello, ROLE_ENC);
+        if (options < 0) {
+            // do not give permission, the request is never served
+            clear_deadline();
+            capture_close(connectionSocket);
+            refuse_client(connectionSocket);
 
             // reset
             connectionSocket = -1;
             continue;
         }
 
-        // based on the number of file contents being sent over, allocate memory
-        char** file_content = (char**) malloc (sizeof(char*) * NUM_FILES_RECIEVE);
-        if (file_content == NULL) {
-            error("ERROR allocating memory for file_content");
-        }
+        // give permission and carry on, naming the options agreed to
+        send_hello_reply(connectionSocket, HELLO_GRANTED, options);
 
-        int valid_key_len = 1;
-
-        // recieve the data in chunks and print
-        for (int i = 0; i < NUM_FILES_RECIEVE; i++) {
-            file_content[i] = NULL;
-            file_content[i] = recieve_chunked_file(connectionSocket);
-        }
-
-        if (NUM_FILES_RECIEVE >= 2) {
-            // check if the file content is > the key length
-            if (strlen(file_content[0]) > strlen(file_content[1])) {
-                send_in_chunks(connectionSocket, LEN_ERROR);
-                valid_key_len = 0;
-            }
-        
+        if (options & CAP_SHM) {
+            // requests go through the client's shared memory ring, not the socket
+            serve_ring(connectionSocket, encrypt_text);
         } else {
-            printf("There should be at least two files...");
-        }      
-
-        // if the key length is bigger than the content length encrypt
-        if (valid_key_len == 1) {
-            encrypt_message(connectionSocket, file_content[0], file_content[1]);
-        }     
-
-        // free the data here
-        for (int i = 0; i < NUM_FILES_RECIEVE; i++) {
-            free(file_content[i]);
+            // pooled clients keep the connection open and send one request after another,
+            // a request that has started is always finished even when we are stopping
+            while (wait_for_request(connectionSocket)
+            && (options & CAP_COMPRESS ? handle_compressed_request(connectionSocket, options & CAP_SIZED)
+            : options & CAP_PACKED ? handle_packed_request(connectionSocket, options & CAP_SIZED, options & CAP_MULTI)
+            : handle_request(connectionSocket, options & CAP_SIZED)));
         }
-        
 
         // Close the connection socket for this client
+        clear_deadline();
+        capture_close(connectionSocket);
         close(connectionSocket);
 
         // reset
         connectionSocket = -1;
     }
 
-    // Close the listening socket
+    // Close the listening sockets
     close(listenSocket); 
+    finish_serving(&config);
     return 0;
 }
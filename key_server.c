@@ -0,0 +1,522 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+
+#include "otp_keys.h"
+
+#define MAX_POOLS 16
+#define DEFAULT_POOL_LENGTH 70000
+#define DEFAULT_POOL_SEGMENTS 8
+#define CLIENT_TIMEOUT_SECONDS 5 // a client stuck mid-request gives up its thread after this
+#define MAX_CLIENTS 32 // served at once, each on a thread of its own, the rest wait to be accepted
+
+// the segments of one length kept ready
+struct pad_pool {
+    uint32_t length;  // symbols in each segment
+    int target;       // segments to keep ready
+    int ready;
+    char** segments;  // the pads, or with a pool directory the files they are in
+    unsigned long next_file;
+    unsigned long served;    // keys cut from this pool's segments
+    unsigned long on_demand; // keys it should have served but was empty for
+};
+
+static struct pad_pool pools[MAX_POOLS];
+static int num_pools = 0;
+static unsigned long unpooled = 0; // keys longer than every pool
+static const char* pool_dir = NULL;
+
+// the refill thread waits on pool_wanted until a segment is taken
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_wanted = PTHREAD_COND_INITIALIZER;
+
+// how many clients have a thread, main waits on client_done before going over MAX_CLIENTS
+static pthread_mutex_t client_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t client_done = PTHREAD_COND_INITIALIZER;
+static int clients = 0;
+
+static volatile sig_atomic_t stop_requested = 0;
+static volatile sig_atomic_t report_requested = 0;
+
+static void usage(const char* name) {
+    fprintf(stderr, "USAGE: %s [-s length[:segments]]... [-D directory] path\n", name);
+    fprintf(stderr, "  -s length[:segments]  keep this many keys of length ready (default %d:%d), may be repeated\n", DEFAULT_POOL_LENGTH, DEFAULT_POOL_SEGMENTS);
+    fprintf(stderr, "  -D directory          keep the pools in files here, so they outlast a restart\n");
+    fprintf(stderr, "  path                  the unix socket to serve on, @name for the abstract namespace\n");
+    exit(1);
+}
+
+static void add_pool(const char* spec, const char* name) {
+    char* end;
+    long length = strtol(spec, &end, 10);
+    long segments = DEFAULT_POOL_SEGMENTS;
+
+    if (*end == ':') {
+        segments = strtol(end + 1, &end, 10);
+    }
+    if (*end != '\0' || length < 1 || length > KEY_MAX_LENGTH || segments < 1) {
+        fprintf(stderr, "bad pool '%s'\n", spec);
+        usage(name);
+    }
+    for (int i = 0; i < num_pools; i++) {
+        if (pools[i].length == length) {
+            fprintf(stderr, "two pools of %ld\n", length);
+            exit(1);
+        }
+    }
+    if (num_pools == MAX_POOLS) {
+        fprintf(stderr, "at most %d pools\n", MAX_POOLS);
+        exit(1);
+    }
+
+    // kept in order of length, so the first long enough is the smallest
+    int i = num_pools++;
+    while (i > 0 && pools[i - 1].length > length) {
+        pools[i] = pools[i - 1];
+        i--;
+    }
+    memset(&pools[i], 0, sizeof(pools[i]));
+    pools[i].length = length;
+    pools[i].target = segments;
+    pools[i].segments = calloc(segments, sizeof(char*));
+    if (pools[i].segments == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+}
+
+static char* segment_path(uint32_t length, unsigned long file, const char* suffix) {
+    char* path = malloc(strlen(pool_dir) + 48);
+    if (path != NULL) {
+        sprintf(path, "%s/%u-%lu.%s", pool_dir, length, file, suffix);
+    }
+    return path;
+}
+
+// segments a server before this one left in the pool directory go back in their pools
+static void load_pool_dir() {
+    DIR* dir = opendir(pool_dir);
+    struct dirent* entry;
+
+    if (dir == NULL) {
+        perror("ERROR opening the pool directory");
+        exit(1);
+    }
+
+    while ((entry = readdir(dir)) != NULL) {
+        uint32_t length;
+        unsigned long file;
+        char suffix[8];
+
+        if (sscanf(entry->d_name, "%u-%lu.%7s", &length, &file, suffix) != 3) {
+            continue;
+        }
+        for (int i = 0; i < num_pools; i++) {
+            if (pools[i].length != length) {
+                continue;
+            }
+            if (file >= pools[i].next_file) {
+                pools[i].next_file = file + 1;
+            }
+
+            // a segment the last server was still writing is never handed out
+            char* path = segment_path(length, file, suffix);
+            if (strcmp(suffix, "pad") != 0) {
+                unlink(path);
+                free(path);
+            } else if (pools[i].ready < pools[i].target) {
+                pools[i].segments[pools[i].ready++] = path;
+            } else {
+                free(path);
+            }
+        }
+    }
+
+    closedir(dir);
+}
+
+// a new segment, in memory or written out to the pool directory, NULL if it couldn't be made
+static char* make_segment(uint32_t length, unsigned long file) {
+    char* pad = malloc(length);
+    if (pad == NULL) {
+        return NULL;
+    }
+    if (generate_key(pad, length) < 0) {
+        free(pad);
+        return NULL;
+    }
+    if (pool_dir == NULL) {
+        return pad;
+    }
+
+    // written under another name first, so a crash never leaves half a pad that looks whole
+    char* writing = segment_path(length, file, "new");
+    char* path = segment_path(length, file, "pad");
+    int fd = writing == NULL || path == NULL ? -1 : open(writing, O_WRONLY | O_CREAT | O_EXCL, 0600);
+    ssize_t written = fd < 0 ? -1 : write(fd, pad, length);
+    if (fd >= 0) {
+        close(fd);
+    }
+    free(pad);
+
+    if (written != (ssize_t) length || rename(writing, path) < 0) {
+        if (fd >= 0) {
+            unlink(writing);
+        }
+        free(writing);
+        free(path);
+        return NULL;
+    }
+    free(writing);
+    return path;
+}
+
+// the start of a segment in the pool directory, the file is gone once it has been read
+static char* read_segment(const char* path, uint32_t length) {
+    char* key = malloc(length > 0 ? length : 1);
+    int fd = open(path, O_RDONLY);
+    uint32_t got = 0;
+
+    while (key != NULL && fd >= 0 && got < length) {
+        ssize_t n = read(fd, key + got, length - got);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        got += n;
+    }
+
+    if (fd >= 0) {
+        close(fd);
+    }
+    unlink(path);
+
+    if (got < length) {
+        free(key);
+        return NULL;
+    }
+    return key;
+}
+
+// idle priority, so keeping the pools full never slows down the servers on the same host
+static void lower_priority() {
+    struct sched_param param = { 0 };
+
+    if (pthread_setschedparam(pthread_self(), SCHED_IDLE, &param) != 0) {
+        setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+    }
+}
+
+// the pool furthest from its target, NULL when they are all full
+static struct pad_pool* emptiest_pool() {
+    struct pad_pool* emptiest = NULL;
+
+    for (int i = 0; i < num_pools; i++) {
+        if (pools[i].ready < pools[i].target
+        && (emptiest == NULL || (long) pools[i].ready * emptiest->target < (long) emptiest->ready * pools[i].target)) {
+            emptiest = &pools[i];
+        }
+    }
+    return emptiest;
+}
+
+// keep every pool topped up, waking whenever a segment is taken
+static void* refill_pools(void* arg) {
+    lower_priority();
+
+    pthread_mutex_lock(&pool_lock);
+    while (1) {
+        struct pad_pool* pool = emptiest_pool();
+        if (pool == NULL) {
+            pthread_cond_wait(&pool_wanted, &pool_lock);
+            continue;
+        }
+
+        uint32_t length = pool->length;
+        unsigned long file = pool->next_file++;
+        pthread_mutex_unlock(&pool_lock);
+
+        char* segment = make_segment(length, file);
+
+        pthread_mutex_lock(&pool_lock);
+        if (segment == NULL) {
+            // out of memory or disk, try again later instead of spinning
+            pthread_mutex_unlock(&pool_lock);
+            sleep(1);
+            pthread_mutex_lock(&pool_lock);
+        } else {
+            // only this thread adds segments, so there is still room for it
+            pool->segments[pool->ready++] = segment;
+        }
+    }
+
+    return NULL;
+}
+
+// a key of length symbols, cut from the smallest pool long enough or made here when
+// that pool is empty. NULL if it couldn't be made
+static char* take_key(uint32_t length) {
+    struct pad_pool* pool = NULL;
+    char* segment = NULL;
+
+    pthread_mutex_lock(&pool_lock);
+    for (int i = 0; i < num_pools && pool == NULL; i++) {
+        if (pools[i].length >= length) {
+            pool = &pools[i];
+        }
+    }
+    if (pool == NULL) {
+        unpooled++;
+    } else if (pool->ready > 0) {
+        segment = pool->segments[--pool->ready];
+        pool->served++;
+        pthread_cond_signal(&pool_wanted);
+    } else {
+        pool->on_demand++;
+    }
+    pthread_mutex_unlock(&pool_lock);
+
+    // the rest of the segment is never used, a pad only goes out once
+    char* key = NULL;
+    if (segment != NULL && pool_dir != NULL) {
+        key = read_segment(segment, length);
+        free(segment);
+    } else if (segment != NULL) {
+        key = segment;
+    }
+
+    if (key == NULL) {
+        key = malloc(length > 0 ? length : 1);
+        if (key != NULL && generate_key(key, length) < 0) {
+            free(key);
+            key = NULL;
+        }
+    }
+    return key;
+}
+
+static void report_pools(FILE* out) {
+    pthread_mutex_lock(&pool_lock);
+    for (int i = 0; i < num_pools; i++) {
+        fprintf(out, "KEY SERVER: pool of %u: %d of %d ready, %lu served from the pool, %lu made on demand\n",
+        pools[i].length, pools[i].ready, pools[i].target, pools[i].served, pools[i].on_demand);
+    }
+    if (unpooled > 0) {
+        fprintf(out, "KEY SERVER: %lu longer than every pool, made on demand\n", unpooled);
+    }
+    pthread_mutex_unlock(&pool_lock);
+    fflush(out);
+}
+
+// answer requests until the client hangs up
+static void serve_client(int connectionSocket) {
+    struct key_request request;
+
+    while (recv_key_request(connectionSocket, &request) == 0) {
+        if (request.length > KEY_MAX_LENGTH) {
+            if (send_key_reply(connectionSocket, KEY_TOO_LONG, NULL, 0) < 0) {
+                return;
+            }
+            continue;
+        }
+
+        char* key = take_key(request.length);
+        int sent = send_key_reply(connectionSocket, key != NULL ? KEY_OK : KEY_FAILED, key, request.length);
+        free(key);
+        if (sent < 0) {
+            return;
+        }
+    }
+}
+
+// one client's thread, so a slow or busy client only ever holds up itself
+static void* client_thread(void* arg) {
+    int connectionSocket = (int) (intptr_t) arg;
+
+    serve_client(connectionSocket);
+    close(connectionSocket);
+
+    pthread_mutex_lock(&client_lock);
+    clients--;
+    pthread_cond_signal(&client_done);
+    pthread_mutex_unlock(&client_lock);
+    return NULL;
+}
+
+// serve a client on a thread of its own, started with the signals blocked so they stay with main
+static void start_client(int connectionSocket, const sigset_t* signals) {
+    pthread_attr_t attr;
+    pthread_t thread;
+    sigset_t old;
+
+    pthread_mutex_lock(&client_lock);
+    clients++;
+    pthread_mutex_unlock(&client_lock);
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_sigmask(SIG_BLOCK, signals, &old);
+    int started = pthread_create(&thread, &attr, client_thread, (void*) (intptr_t) connectionSocket) == 0;
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    pthread_attr_destroy(&attr);
+
+    if (!started) {
+        perror("ERROR starting a client thread");
+        close(connectionSocket);
+        pthread_mutex_lock(&client_lock);
+        clients--;
+        pthread_mutex_unlock(&client_lock);
+    }
+}
+
+static int open_listener(const char* path) {
+    struct sockaddr_un address;
+    socklen_t address_len;
+
+    if (key_address(path, &address, &address_len) < 0) {
+        fprintf(stderr, "ERROR unix socket path is too long\n");
+        exit(1);
+    }
+
+    // a socket file left behind by a server that didn't shut down cleanly
+    struct stat st;
+    if (path[0] != '@' && stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(path);
+    }
+
+    int listenSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listenSocket < 0) {
+        perror("ERROR opening socket");
+        exit(1);
+    }
+    if (bind(listenSocket, (struct sockaddr*) &address, address_len) < 0) {
+        perror("ERROR on binding");
+        exit(1);
+    }
+    listen(listenSocket, SOMAXCONN);
+
+    return listenSocket;
+}
+
+static void handle_stop(int sig) {
+    stop_requested = 1;
+}
+
+static void handle_report(int sig) {
+    report_requested = 1;
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:D:")) != -1) {
+        switch (opt) {
+            case 's':
+                add_pool(optarg, argv[0]);
+                break;
+            case 'D':
+                pool_dir = optarg;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (argc - optind != 1) {
+        usage(argv[0]);
+    }
+    const char* path = argv[optind];
+
+    if (num_pools == 0) {
+        char spec[32];
+        sprintf(spec, "%d:%d", DEFAULT_POOL_LENGTH, DEFAULT_POOL_SEGMENTS);
+        add_pool(spec, argv[0]);
+    }
+    if (pool_dir != NULL) {
+        load_pool_dir();
+    }
+
+    int listenSocket = open_listener(path);
+
+    // no SA_RESTART, so a signal gets us out of accept
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    sigemptyset(&action.sa_mask);
+    action.sa_handler = handle_stop;
+    sigaction(SIGTERM, &action, NULL);
+    sigaction(SIGINT, &action, NULL);
+    action.sa_handler = handle_report;
+    sigaction(SIGUSR1, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    // the signals are left to this thread, the refill thread starts with them blocked
+    sigset_t signals, old;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &signals, &old);
+
+    pthread_t refill;
+    if (pthread_create(&refill, NULL, refill_pools, NULL) != 0) {
+        fprintf(stderr, "ERROR starting the refill thread\n");
+        exit(1);
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    struct timeval timeout = { CLIENT_TIMEOUT_SECONDS, 0 };
+
+    while (!stop_requested) {
+        if (report_requested) {
+            report_requested = 0;
+            report_pools(stdout);
+        }
+
+        // past MAX_CLIENTS new ones wait in the backlog until a thread is free
+        pthread_mutex_lock(&client_lock);
+        while (clients >= MAX_CLIENTS) {
+            pthread_cond_wait(&client_done, &client_lock);
+        }
+        pthread_mutex_unlock(&client_lock);
+
+        int connectionSocket = accept(listenSocket, NULL, NULL);
+        if (connectionSocket < 0) {
+            // a signal woke us up, go see what it wanted
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("ERROR on accept");
+            break;
+        }
+
+        setsockopt(connectionSocket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(connectionSocket, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        start_client(connectionSocket, &signals);
+    }
+
+    close(listenSocket);
+    if (path[0] != '@') {
+        unlink(path);
+    }
+    report_pools(stdout);
+
+    // pads in memory go with the process, the ones in the pool directory are kept for next time
+    return 0;
+}
@@ -1,21 +1,38 @@
 #include <stdio.h>
-#include <time.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
 
-#define NUM_ALPHABET 27 // 26 + space char
+#include "otp_pack.h"
+#include "otp_keys.h"
 
 int main(int argc, char *argv[]) {
 
-    srand(time(NULL));
-
     int key_size = 0;
+    int packed = 0;
+    const char* service = NULL;
+
+    // -p writes the key in the packed format (see otp_pack.h) instead of text
+    // -s takes the key from a key_server (see otp_keys.h) instead of generating it
+    int opt;
+    while ((opt = getopt(argc, argv, "ps:")) != -1) {
+        if (opt == 'p') {
+            packed = 1;
+        } else if (opt == 's') {
+            service = optarg;
+        } else {
+            fprintf(stderr, "Usage: %s [-p] [-s path] keylength\n", argv[0]);
+            return 1;
+        }
+    }
 
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s keylength\n", argv[0]);
+    if (argc - optind != 1) {
+        fprintf(stderr, "Usage: %s [-p] [-s path] keylength\n", argv[0]);
         return 1;
     }
 
-    if (!(key_size = atoi(argv[1]))) {
+    if (!(key_size = atoi(argv[optind]))) {
         printf("Invalid Input!\nUsage: %s (int)keylength\n", argv[0]);
         return 0;
     }
@@ -25,15 +42,46 @@ int main(int argc, char *argv[]) {
         return 0;
     }
 
-    char alphabet[NUM_ALPHABET] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ ";
+    char* key = malloc(key_size + 1);
+    if (key == NULL) {
+        fprintf(stderr, "keygen: out of memory\n");
+        return 1;
+    }
 
-    for (int i = 0; i < key_size; i++) {
-        int rand_c = rand() % NUM_ALPHABET;
+    if (service != NULL) {
+        int status = fetch_key(service, key_size, key);
+        if (status != KEY_OK) {
+            fprintf(stderr, "keygen: %s\n", status < 0 ? "can't reach the key server"
+            : status == KEY_TOO_LONG ? "the key server doesn't make keys that long" : "the key server couldn't make the key");
+            return 1;
+        }
+    } else if (generate_key(key, key_size) < 0) {
+        perror("keygen: reading random bytes");
+        return 1;
+    }
+
+    if (packed) {
+        uint8_t* packed_key = malloc(PACKED_BYTES(key_size));
+        if (packed_key == NULL) {
+            fprintf(stderr, "keygen: out of memory\n");
+            return 1;
+        }
+
+        pack_text(key, key_size, packed_key);
+        if (write_packed_file(stdout, packed_key, key_size) < 0) {
+            perror("keygen: writing key");
+            return 1;
+        }
 
-        printf("%c", alphabet[rand_c]);
+        free(key);
+        free(packed_key);
+        return 0;
     }
-    printf("\n");
+
+    key[key_size] = '\n';
+    fwrite(key, 1, key_size + 1, stdout);
+    free(key);
 
     return 0;
 
-}   
\ No newline at end of file
+}
@@ -0,0 +1,648 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netdb.h>
+
+#include "otp_async.h"
+#include "otp_client.h"
+#include "otp_pack.h"
+#include "otp_lz4.h"
+#include "otp_header.h"
+#include "otp_socket.h"
+
+#define MAX_FRAME (4 + LZ4_BOUND(LZ4_BLOCKSIZE))
+
+// connection states
+#define CONN_CLOSED 0
+#define CONN_CONNECTING 1 // non-blocking connect in progress
+#define CONN_HANDSHAKE 2  // hello sent, waiting for the grant
+#define CONN_READY 3
+
+// what the oldest request on a connection is waiting for next
+#define WAIT_STATUS 0
+#define WAIT_LENGTH 1
+#define WAIT_BLOCKS 2
+#define WAIT_ERROR_TEXT 3
+
+struct buffer {
+    char* data;
+    size_t start; // bytes before this have been used up
+    size_t len;
+    size_t cap;
+};
+
+struct async_request {
+    async_callback callback;
+    void* arg;
+    struct buffer wire; // the request as sent, kept until a connection takes it
+    int stage;
+    int status;
+    long offset; // where the server found the error, from its status
+    char* result;
+    uint32_t length;
+    uint32_t got;
+    struct async_request* next;
+};
+
+struct async_conn {
+    int fd;
+    int state;
+    uint32_t events;   // what the fd is registered for
+    struct buffer out; // still to be written, requests queue here even before the grant
+    struct buffer in;  // read but not yet a whole frame
+    struct async_request* head; // sent and waiting for replies, oldest first
+    struct async_request* tail;
+    int outstanding;
+};
+
+struct otp_async {
+    int role;
+    int decrypt;
+    int epfd;
+    struct addrinfo* addrs;
+    struct async_conn conns[ASYNC_MAX_CONNECTIONS];
+    int num_conns;
+    struct async_request* pending; // waiting for a granted connection, oldest first
+    struct async_request* pending_tail;
+    int outstanding;
+    int completed; // counts completions so poll can say how many it ran
+    char* block;   // scratch for compressing one block
+};
+
+static int buffer_append (struct buffer* b, const void* data, size_t length) {
+    if (b->len + length > b->cap) {
+        // make room by dropping what has been used up before growing
+        if (b->start > 0) {
+            memmove(b->data, b->data + b->start, b->len - b->start);
+            b->len -= b->start;
+            b->start = 0;
+        }
+        if (b->len + length > b->cap) {
+            size_t cap = b->cap ? b->cap : 4096;
+            while (cap < b->len + length) {
+                cap *= 2;
+            }
+            char* data = realloc(b->data, cap);
+            if (data == NULL) {
+                return -1;
+            }
+            b->data = data;
+            b->cap = cap;
+        }
+    }
+
+    memcpy(b->data + b->len, data, length);
+    b->len += length;
+    return 0;
+}
+
+static int append_frame (struct buffer* b, const void* data, int length) {
+    if (buffer_append(b, &length, sizeof(length)) < 0) {
+        return -1;
+    }
+    return buffer_append(b, data, length);
+}
+
+// the same stream send_blocks writes, into the connection's output
+static int append_blocks (struct otp_async* async, struct buffer* b, const char* data, uint32_t length, int compress) {
+    if (append_frame(b, &length, sizeof(length)) < 0) {
+        return -1;
+    }
+
+    for (uint32_t done = 0; done < length; done += LZ4_BLOCKSIZE) {
+        int size = length - done < LZ4_BLOCKSIZE ? length - done : LZ4_BLOCKSIZE;
+        uint32_t header = size;
+        int packed = compress ? lz4_compress(data + done, size, async->block + 4, size) : 0;
+
+        if (packed == 0) {
+            header |= LZ4_STORED;
+            memcpy(async->block + 4, data + done, size);
+            packed = size;
+        }
+        memcpy(async->block, &header, sizeof(header));
+
+        if (append_frame(b, async->block, 4 + packed) < 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static void finish (struct otp_async* async, struct async_request* request, int status) {
+    async->outstanding--;
+    async->completed++;
+
+    request->callback(request->arg, status, status == ASYNC_OK ? request->result : NULL, status == ASYNC_OK ? request->length : 0,
+    status > 0 ? request->offset : -1);
+
+    free(request->wire.data);
+    free(request->result);
+    free(request);
+}
+
+// the oldest request on the connection has its reply
+static void complete (struct otp_async* async, struct async_conn* conn, int status) {
+    struct async_request* request = conn->head;
+
+    conn->head = request->next;
+    if (conn->head == NULL) {
+        conn->tail = NULL;
+    }
+    conn->outstanding--;
+
+    finish(async, request, status);
+}
+
+// close the connection and fail everything that was waiting on it
+static void close_conn (struct otp_async* async, struct async_conn* conn, int status) {
+    if (conn->state == CONN_CLOSED) {
+        return;
+    }
+
+    epoll_ctl(async->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    conn->fd = -1;
+    conn->state = CONN_CLOSED;
+    conn->out.start = conn->out.len = 0;
+    conn->in.start = conn->in.len = 0;
+
+    // a callback may submit again and reopen this connection, so take the list off it first
+    struct async_request* request = conn->head;
+    conn->head = conn->tail = NULL;
+    conn->outstanding = 0;
+
+    while (request != NULL) {
+        struct async_request* next = request->next;
+        finish(async, request, status);
+        request = next;
+    }
+
+    // with nothing left that could take them the queued requests fail too
+    for (int i = 0; i < async->num_conns; i++) {
+        if (async->conns[i].state != CONN_CLOSED) {
+            return;
+        }
+    }
+    while (async->pending != NULL) {
+        request = async->pending;
+        async->pending = request->next;
+        finish(async, request, status);
+    }
+    async->pending_tail = NULL;
+}
+
+static int open_conn (struct otp_async* async, struct async_conn* conn) {
+    int socketFD = -1;
+
+    for (struct addrinfo* ai = async->addrs; ai != NULL; ai = ai->ai_next) {
+        socketFD = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, ai->ai_protocol);
+        if (socketFD < 0) {
+            continue;
+        }
+        if (connect(socketFD, ai->ai_addr, ai->ai_addrlen) == 0 || errno == EINPROGRESS) {
+            break;
+        }
+        close(socketFD);
+        socketFD = -1;
+    }
+
+    if (socketFD < 0) {
+        return -1;
+    }
+    tune_socket(socketFD);
+
+    conn->fd = socketFD;
+    conn->state = CONN_CONNECTING;
+    conn->out.start = conn->out.len = 0;
+    conn->in.start = conn->in.len = 0;
+
+    struct hello hello = { HELLO_MAGIC, HELLO_VERSION, async->role, CAP_COMPRESS };
+    struct epoll_event event = { EPOLLIN | EPOLLOUT, { .ptr = conn } };
+    conn->events = event.events;
+    if (epoll_ctl(async->epfd, EPOLL_CTL_ADD, socketFD, &event) < 0
+    || append_frame(&conn->out, &hello, sizeof(hello)) < 0) {
+        close(socketFD);
+        conn->fd = -1;
+        conn->state = CONN_CLOSED;
+        return -1;
+    }
+
+    return 0;
+}
+
+// write what can be written without blocking, -1 if the connection failed
+static int flush_out (struct async_conn* conn) {
+    while (conn->out.start < conn->out.len) {
+        ssize_t sent = send(conn->fd, conn->out.data + conn->out.start, conn->out.len - conn->out.start, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        conn->out.start += sent;
+    }
+
+    conn->out.start = conn->out.len = 0;
+    return 0;
+}
+
+// only ask to hear about writability while there is something to write
+static void update_events (struct otp_async* async, struct async_conn* conn) {
+    if (conn->state == CONN_CLOSED) {
+        return;
+    }
+
+    uint32_t events = EPOLLIN;
+    if (conn->state == CONN_CONNECTING || conn->out.start < conn->out.len) {
+        events |= EPOLLOUT;
+    }
+
+    if (events != conn->events) {
+        struct epoll_event event = { events, { .ptr = conn } };
+        epoll_ctl(async->epfd, EPOLL_CTL_MOD, conn->fd, &event);
+        conn->events = events;
+    }
+}
+
+// hand queued requests to the granted connections with the fewest outstanding
+// a connection is only given requests once the server has taken it, so one still
+// waiting in a busy server's backlog doesn't hold any up
+static void dispatch (struct otp_async* async) {
+    while (async->pending != NULL) {
+        struct async_conn* conn = NULL;
+
+        for (int i = 0; i < async->num_conns; i++) {
+            struct async_conn* c = &async->conns[i];
+            if (c->state == CONN_READY && (conn == NULL || c->outstanding < conn->outstanding)) {
+                conn = c;
+            }
+        }
+        if (conn == NULL) {
+            return;
+        }
+
+        struct async_request* request = async->pending;
+        if (buffer_append(&conn->out, request->wire.data, request->wire.len) < 0) {
+            return;
+        }
+        async->pending = request->next;
+        if (async->pending == NULL) {
+            async->pending_tail = NULL;
+        }
+        free(request->wire.data);
+        memset(&request->wire, 0, sizeof(request->wire));
+
+        request->next = NULL;
+        if (conn->tail != NULL) {
+            conn->tail->next = request;
+        } else {
+            conn->head = request;
+        }
+        conn->tail = request;
+        conn->outstanding++;
+
+        // start writing now rather than waiting for the next poll
+        if (flush_out(conn) < 0) {
+            // the failure is reported through the callbacks on the next poll
+            shutdown(conn->fd, SHUT_RDWR);
+        }
+        update_events(async, conn);
+    }
+}
+
+// one whole frame from the server, returns ASYNC_OK or the status to close the connection with
+static int handle_frame (struct otp_async* async, struct async_conn* conn, const char* frame, int length) {
+    if (conn->state != CONN_READY) {
+        struct hello_reply reply;
+
+        if (length != sizeof(reply)) {
+            return ASYNC_FAILED;
+        }
+        memcpy(&reply, frame, sizeof(reply));
+
+        if (reply.magic == HELLO_MAGIC && reply.status == HELLO_GRANTED) {
+            conn->state = CONN_READY;
+            dispatch(async);
+            return ASYNC_OK;
+        }
+        // a busy server might take us later, a refusal will not
+        if (reply.magic == HELLO_MAGIC && reply.status == HELLO_BUSY) {
+            return ASYNC_FAILED;
+        }
+        return ASYNC_DENIED;
+    }
+
+    struct async_request* request = conn->head;
+    if (request == NULL) {
+        return ASYNC_FAILED;
+    }
+
+    if (request->stage == WAIT_STATUS) {
+        int32_t status;
+        int64_t offset = -1;
+        if (length != sizeof(status) && length != STATUS_AT_SIZE) {
+            return ASYNC_FAILED;
+        }
+        memcpy(&status, frame, sizeof(status));
+        if (length == STATUS_AT_SIZE) {
+            memcpy(&offset, frame + sizeof(status), sizeof(offset));
+        }
+        request->offset = offset;
+
+        if (status == PACK_STATUS_OK) {
+            request->stage = WAIT_LENGTH;
+        } else {
+            request->status = status == PACK_STATUS_LEN_ERROR ? ASYNC_LEN_ERROR
+            : status == PACK_STATUS_TOO_BIG ? ASYNC_SIZE_ERROR : ASYNC_CHAR_ERROR;
+            request->stage = WAIT_ERROR_TEXT;
+        }
+        return ASYNC_OK;
+    }
+
+    if (request->stage == WAIT_LENGTH) {
+        if (length != sizeof(request->length)) {
+            return ASYNC_FAILED;
+        }
+        memcpy(&request->length, frame, sizeof(request->length));
+        if (request->length > LZ4_MAX_LENGTH) {
+            return ASYNC_FAILED;
+        }
+
+        request->result = malloc(request->length + 1);
+        if (request->result == NULL) {
+            return ASYNC_FAILED;
+        }
+        request->result[0] = '\0';
+        request->stage = WAIT_BLOCKS;
+
+        if (request->length == 0) {
+            complete(async, conn, ASYNC_OK);
+        }
+        return ASYNC_OK;
+    }
+
+    if (request->stage == WAIT_BLOCKS) {
+        uint32_t header;
+        uint32_t expected = request->length - request->got < LZ4_BLOCKSIZE ? request->length - request->got : LZ4_BLOCKSIZE;
+        int size;
+
+        if (length < 4) {
+            return ASYNC_FAILED;
+        }
+        memcpy(&header, frame, sizeof(header));
+        if ((header & ~LZ4_STORED) != expected) {
+            return ASYNC_FAILED;
+        }
+
+        if (header & LZ4_STORED) {
+            size = length - 4 == (int) expected ? (int) expected : -1;
+            if (size > 0) {
+                memcpy(request->result + request->got, frame + 4, size);
+            }
+        } else {
+            size = lz4_decompress(frame + 4, length - 4, request->result + request->got, expected);
+        }
+        if (size != (int) expected) {
+            return ASYNC_FAILED;
+        }
+
+        request->got += size;
+        if (request->got == request->length) {
+            request->result[request->length] = '\0';
+            complete(async, conn, ASYNC_OK);
+        }
+        return ASYNC_OK;
+    }
+
+    // the error text itself is not needed, the status already said what it was
+    if (length > 0 && frame[0] == '\r') {
+        complete(async, conn, request->status);
+    }
+    return ASYNC_OK;
+}
+
+// read what has arrived and handle every whole frame in it
+static void read_in (struct otp_async* async, struct async_conn* conn) {
+    char chunk[65536];
+    int closed = 0;
+
+    while (!closed) {
+        ssize_t got = recv(conn->fd, chunk, sizeof(chunk), MSG_DONTWAIT);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        if (got <= 0) {
+            closed = 1;
+            break;
+        }
+        if (buffer_append(&conn->in, chunk, got) < 0) {
+            close_conn(async, conn, ASYNC_FAILED);
+            return;
+        }
+    }
+
+    // a refusal comes just before the server hangs up, so handle what came first
+    while (conn->in.len - conn->in.start >= sizeof(int)) {
+        int length;
+        memcpy(&length, conn->in.data + conn->in.start, sizeof(length));
+        if (length < 0 || length > MAX_FRAME) {
+            close_conn(async, conn, ASYNC_FAILED);
+            return;
+        }
+        if (conn->in.len - conn->in.start < sizeof(length) + length) {
+            break;
+        }
+
+        const char* frame = conn->in.data + conn->in.start + sizeof(length);
+        conn->in.start += sizeof(length) + length;
+
+        int status = handle_frame(async, conn, frame, length);
+        if (status != ASYNC_OK) {
+            close_conn(async, conn, status);
+            return;
+        }
+    }
+
+    if (closed) {
+        close_conn(async, conn, ASYNC_FAILED);
+    }
+}
+
+struct otp_async* otp_async_create(int role) {
+    struct otp_async* async = calloc(1, sizeof(*async));
+    if (async == NULL) {
+        return NULL;
+    }
+
+    async->role = role;
+    async->decrypt = role == ROLE_DEC;
+    async->block = malloc(MAX_FRAME);
+    async->epfd = epoll_create1(EPOLL_CLOEXEC);
+
+    if (async->block == NULL || async->epfd < 0) {
+        otp_async_destroy(async);
+        return NULL;
+    }
+    for (int i = 0; i < ASYNC_MAX_CONNECTIONS; i++) {
+        async->conns[i].fd = -1;
+    }
+
+    return async;
+}
+
+// resolve the server (this can block) and start connecting, returns the connections started
+int otp_async_connect(struct otp_async* async, const char* host, const char* port, int connections) {
+    struct addrinfo hints;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    if (async->addrs != NULL || getaddrinfo(host, port, &hints, &async->addrs) != 0) {
+        return -1;
+    }
+
+    if (connections > ASYNC_MAX_CONNECTIONS) {
+        connections = ASYNC_MAX_CONNECTIONS;
+    }
+    async->num_conns = connections;
+
+    int opened = 0;
+    for (int i = 0; i < connections; i++) {
+        if (open_conn(async, &async->conns[i]) == 0) {
+            opened++;
+        }
+    }
+
+    return opened;
+}
+
+int otp_async_fd(struct otp_async* async) {
+    return async->epfd;
+}
+
+int otp_async_outstanding(struct otp_async* async) {
+    return async->outstanding;
+}
+
+// queue a request, it goes out as soon as a connection has been granted
+// returns -1 if it can't be sent, the callback runs later from otp_async_poll, never from here
+int otp_async_submit(struct otp_async* async, const char* text, const char* key, async_callback callback, void* arg) {
+    int open = 0;
+
+    for (int i = 0; i < async->num_conns; i++) {
+        struct async_conn* conn = &async->conns[i];
+
+        // a connection that failed earlier gets another go
+        if (conn->state != CONN_CLOSED || open_conn(async, conn) == 0) {
+            open++;
+        }
+    }
+    if (open == 0) {
+        return -1;
+    }
+
+    struct async_request* request = calloc(1, sizeof(*request));
+    if (request == NULL) {
+        return -1;
+    }
+    request->callback = callback;
+    request->arg = arg;
+    request->stage = WAIT_STATUS;
+    request->offset = -1;
+
+    // the key goes first so the server can cipher the text as it arrives
+    if ((async->decrypt && append_frame(&request->wire, "2", 1) < 0)
+    || append_blocks(async, &request->wire, key, strlen(key), 0) < 0
+    || append_blocks(async, &request->wire, text, strlen(text), !async->decrypt) < 0) {
+        free(request->wire.data);
+        free(request);
+        return -1;
+    }
+
+    if (async->pending_tail != NULL) {
+        async->pending_tail->next = request;
+    } else {
+        async->pending = request;
+    }
+    async->pending_tail = request;
+    async->outstanding++;
+
+    dispatch(async);
+
+    return 0;
+}
+
+// move whatever can move without blocking, waiting up to timeout_ms for something to
+// happen, and run the callbacks of completed requests; returns how many completed
+int otp_async_poll(struct otp_async* async, int timeout_ms) {
+    struct epoll_event events[ASYNC_MAX_CONNECTIONS];
+    int start = async->completed;
+
+    int ready = epoll_wait(async->epfd, events, ASYNC_MAX_CONNECTIONS, timeout_ms);
+    if (ready < 0) {
+        return errno == EINTR ? 0 : -1;
+    }
+
+    for (int i = 0; i < ready; i++) {
+        struct async_conn* conn = events[i].data.ptr;
+
+        if (conn->state == CONN_CONNECTING) {
+            int err = 0;
+            socklen_t len = sizeof(err);
+            if (getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+                close_conn(async, conn, ASYNC_FAILED);
+                continue;
+            }
+            conn->state = CONN_HANDSHAKE;
+        }
+
+        if ((events[i].events & EPOLLOUT) && flush_out(conn) < 0) {
+            close_conn(async, conn, ASYNC_FAILED);
+            continue;
+        }
+
+        if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+            read_in(async, conn);
+        }
+
+        update_events(async, conn);
+    }
+
+    return async->completed - start;
+}
+
+// fails whatever is still outstanding
+void otp_async_destroy(struct otp_async* async) {
+    for (int i = 0; i < ASYNC_MAX_CONNECTIONS; i++) {
+        struct async_conn* conn = &async->conns[i];
+
+        close_conn(async, conn, ASYNC_FAILED);
+        free(conn->out.data);
+        free(conn->in.data);
+    }
+    while (async->pending != NULL) {
+        struct async_request* request = async->pending;
+        async->pending = request->next;
+        finish(async, request, ASYNC_FAILED);
+    }
+
+    if (async->addrs != NULL) {
+        freeaddrinfo(async->addrs);
+    }
+    if (async->epfd >= 0) {
+        close(async->epfd);
+    }
+    free(async->block);
+    free(async);
+}
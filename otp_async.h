@@ -0,0 +1,58 @@
+#ifndef OTP_ASYNC_H
+#define OTP_ASYNC_H
+
+#include <stdint.h>
+
+#include "otp_header.h"
+
+/**
+* Asynchronous client
+* For programs that run their own event loop and can't block a thread on
+* every request. Requests are submitted with a callback and pipelined over
+* a few non-blocking connections (the server answers the requests on a
+* connection in order), so many can be outstanding at once.
+*
+* otp_async_fd gives one descriptor to register with the caller's loop
+* (epoll, poll or select) for reading. Whenever it is readable, call
+* otp_async_poll with a timeout of 0: it moves the bytes that can move
+* without blocking and runs the callbacks of the requests that completed.
+* Programs without a loop of their own can call otp_async_poll with a
+* timeout instead.
+*
+* A server process serves one connection at a time until it is closed.
+* Requests wait in a queue until a connection has been granted (the reply
+* to its hello, see otp_header.h), so a connection stuck in the backlog of
+* a busy server holds none of them up. The role, ROLE_ENC or ROLE_DEC,
+* picks the server the requests are for.
+*
+* The requests use the compressed transfer format (see otp_lz4.h); the
+* plaintext is compressed, the ciphertext and key are not. Resolving the
+* server in otp_async_connect is the only call that can block.
+*/
+
+#define ASYNC_MAX_CONNECTIONS 16
+
+// status passed to the callback
+#define ASYNC_OK 0
+#define ASYNC_LEN_ERROR 1     // the key is shorter than the text
+#define ASYNC_CHAR_ERROR 2    // the text or key has a char other than A-Z or space
+#define ASYNC_SIZE_ERROR 3    // the request is bigger than the server takes
+#define ASYNC_FAILED -1       // the connection failed before the request completed
+#define ASYNC_DENIED -2       // the server does not accept this client
+
+// result is only valid during the call, length is 0 unless status is ASYNC_OK. offset is
+// where the server found an ASYNC_LEN_ERROR or ASYNC_CHAR_ERROR (the first bad char, or
+// where the key ran out) and the byte limit with ASYNC_SIZE_ERROR, -1 otherwise
+typedef void (*async_callback)(void* arg, int status, const char* result, uint32_t length, long offset);
+
+struct otp_async;
+
+struct otp_async* otp_async_create(int role);
+int otp_async_connect(struct otp_async* async, const char* host, const char* port, int connections);
+int otp_async_fd(struct otp_async* async);
+int otp_async_submit(struct otp_async* async, const char* text, const char* key, async_callback callback, void* arg);
+int otp_async_outstanding(struct otp_async* async);
+int otp_async_poll(struct otp_async* async, int timeout_ms);
+void otp_async_destroy(struct otp_async* async);
+
+#endif
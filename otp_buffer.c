@@ -0,0 +1,229 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "otp_buffer.h"
+
+// in front of every buffer, 32 bytes so the buffer keeps malloc's alignment
+struct buffer_head {
+    size_t mapped;  // length of the mapping the buffer is in, 0 when it came from malloc
+    size_t size;    // what was asked for
+    size_t charged; // counted against the budget, 0 when it spilled to a file
+    size_t unused;
+};
+
+// what every process holds, shared once buffer_init has run
+struct buffer_totals {
+    size_t in_use;
+    size_t peak;
+};
+
+static size_t huge_threshold = 0;
+static size_t budget = 0;
+static struct buffer_stats stats;
+static struct buffer_totals own_totals;
+static struct buffer_totals* totals = &own_totals;
+static size_t connection_base = 0; // what was held when the connection started
+
+void buffer_init(size_t threshold, size_t total_budget) {
+    huge_threshold = threshold;
+    budget = total_budget;
+
+    // every shard forked from here adds to the same totals
+    struct buffer_totals* shared = mmap(NULL, sizeof(*shared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared != MAP_FAILED) {
+        *shared = *totals;
+        totals = shared;
+    }
+}
+
+static void raise_peak(size_t* peak, size_t value) {
+    size_t seen = __atomic_load_n(peak, __ATOMIC_RELAXED);
+    while (value > seen && !__atomic_compare_exchange_n(peak, &seen, value, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+// count bytes as held, 0 if that would take the total over the budget
+static int charge(size_t bytes) {
+    size_t total = __atomic_add_fetch(&totals->in_use, bytes, __ATOMIC_RELAXED);
+    if (budget > 0 && total > budget) {
+        __atomic_sub_fetch(&totals->in_use, bytes, __ATOMIC_RELAXED);
+        return 0;
+    }
+    raise_peak(&totals->peak, total);
+
+    stats.in_use += bytes;
+    if (stats.in_use > stats.peak) {
+        stats.peak = stats.in_use;
+    }
+    if (stats.in_use > connection_base && stats.in_use - connection_base > stats.connection_peak) {
+        stats.connection_peak = stats.in_use - connection_base;
+    }
+    return 1;
+}
+
+static void uncharge(size_t bytes) {
+    __atomic_sub_fetch(&totals->in_use, bytes, __ATOMIC_RELAXED);
+    stats.in_use -= bytes;
+}
+
+static size_t round_to_huge(size_t size) {
+    return (size + HUGE_PAGE_SIZE - 1) & ~((size_t) HUGE_PAGE_SIZE - 1);
+}
+
+// map length bytes starting on a huge page boundary, NULL if even normal pages can't be had
+static void* map_huge(size_t length) {
+    void* p = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (p != MAP_FAILED) {
+        stats.hugetlb++;
+        return p;
+    }
+
+    // mmap only promises page alignment, so map a huge page extra and trim both ends
+    char* area = mmap(NULL, length + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (area == MAP_FAILED) {
+        return NULL;
+    }
+    char* start = (char*) (((uintptr_t) area + HUGE_PAGE_SIZE - 1) & ~((uintptr_t) HUGE_PAGE_SIZE - 1));
+    if (start > area) {
+        munmap(area, start - area);
+    }
+    munmap(start + length, area + HUGE_PAGE_SIZE - start);
+
+    // without transparent huge pages this fails and the buffer stays on normal pages
+    madvise(start, length, MADV_HUGEPAGE);
+    stats.advised++;
+    return start;
+}
+
+// a buffer over the budget, mapped from a file that is gone once it is unmapped
+static void* spill(size_t size) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t length = (sizeof(struct buffer_head) + size + page - 1) & ~(page - 1);
+    const char* dir = getenv("TMPDIR");
+    struct buffer_head* head = MAP_FAILED;
+
+    int fd = open(dir != NULL ? dir : "/tmp", O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        return NULL;
+    }
+    if (ftruncate(fd, length) == 0) {
+        head = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (head == MAP_FAILED) {
+        return NULL;
+    }
+
+    stats.spilled++;
+    head->mapped = length;
+    head->size = size;
+    head->charged = 0;
+    return head + 1;
+}
+
+void* buffer_alloc(size_t size) {
+    struct buffer_head* head;
+
+    if (size > SIZE_MAX - sizeof(*head) - HUGE_PAGE_SIZE) {
+        return NULL;
+    }
+
+    int huge = huge_threshold > 0 && size >= huge_threshold;
+    size_t length = huge ? round_to_huge(sizeof(*head) + size) : sizeof(*head) + size;
+
+    // past the budget the buffer goes to a file rather than taking more memory
+    if (!charge(length)) {
+        return spill(size);
+    }
+
+    if (huge && (head = map_huge(length)) != NULL) {
+        head->mapped = length;
+        head->size = size;
+        head->charged = length;
+        return head + 1;
+    }
+
+    if ((head = malloc(sizeof(*head) + size)) == NULL) {
+        uncharge(length);
+        return NULL;
+    }
+    uncharge(length - (sizeof(*head) + size)); // what a huge mapping that failed would have rounded up
+    stats.small++;
+    head->mapped = 0;
+    head->size = size;
+    head->charged = sizeof(*head) + size;
+    return head + 1;
+}
+
+// grow or shrink a buffer, moving it between malloc and a mapping when it crosses the threshold
+void* buffer_realloc(void* buffer, size_t size) {
+    if (buffer == NULL) {
+        return buffer_alloc(size);
+    }
+
+    struct buffer_head* head = (struct buffer_head*) buffer - 1;
+    int huge = huge_threshold > 0 && size >= huge_threshold;
+
+    // small stays small, unless growing takes it over the budget, and a mapping (or a spilled
+    // buffer) with room left is kept
+    if (head->mapped == 0 && !huge && (size <= head->size || charge(size - head->size))) {
+        size_t old_size = head->size;
+        struct buffer_head* grown = realloc(head, sizeof(*head) + size);
+        if (grown == NULL) {
+            if (size > old_size) {
+                uncharge(size - old_size);
+            }
+            return NULL;
+        }
+        if (size < old_size) {
+            uncharge(old_size - size);
+        }
+        grown->size = size;
+        grown->charged = sizeof(*grown) + size;
+        return grown + 1;
+    }
+    int spilled = head->mapped > 0 && head->charged == 0;
+    if (head->mapped > 0 && (huge || spilled) && sizeof(*head) + size <= head->mapped) {
+        head->size = size;
+        return buffer;
+    }
+
+    // a buffer growing a bit at a time gets room to grow into, so it isn't copied every time
+    void* moved = buffer_alloc((huge && head->mapped > 0) || spilled ? size + size / 2 : size);
+    if (moved == NULL) {
+        return NULL;
+    }
+    memcpy(moved, buffer, head->size < size ? head->size : size);
+    buffer_free(buffer);
+    return moved;
+}
+
+void buffer_free(void* buffer) {
+    if (buffer == NULL) {
+        return;
+    }
+
+    struct buffer_head* head = (struct buffer_head*) buffer - 1;
+    uncharge(head->charged);
+    if (head->mapped > 0) {
+        munmap(head, head->mapped);
+    } else {
+        free(head);
+    }
+}
+
+// what the process holds from here on is counted to the connection it is starting on
+void buffer_start_connection() {
+    connection_base = stats.in_use;
+}
+
+void buffer_get_stats(struct buffer_stats* result) {
+    *result = stats;
+    result->total_in_use = __atomic_load_n(&totals->in_use, __ATOMIC_RELAXED);
+    result->total_peak = __atomic_load_n(&totals->peak, __ATOMIC_RELAXED);
+    result->budget = budget;
+}
@@ -0,0 +1,57 @@
+#ifndef OTP_BUFFER_H
+#define OTP_BUFFER_H
+
+#include <stddef.h>
+
+/**
+* Payload buffers
+* The buffers a whole text or key is read into. Below the threshold given
+* to buffer_init they come from malloc. At or above it they are mapped on
+* their own, aligned to HUGE_PAGE_SIZE, so a multi-megabyte payload sits
+* on a few 2 MB pages instead of hundreds of 4 KB ones and the cipher's
+* pass over it doesn't keep missing the TLB.
+*
+* A big buffer is first asked for with MAP_HUGETLB, which only works when
+* the system has huge pages reserved (vm.nr_hugepages). Failing that it is
+* mapped normally and advised with MADV_HUGEPAGE, which transparent huge
+* pages honour when they are set to madvise or always. Failing both it is
+* still a working buffer of normal pages. A threshold of 0 turns huge
+* pages off and keeps everything on malloc; the servers default to 2 MB
+* (DEFAULT_HUGE_PAGE_MEGABYTES, -G).
+*
+* Every buffer is counted, in the process that holds it and against a
+* total shared by every process forked after buffer_init, with the peaks
+* of both. Once the total would go over the budget given to buffer_init,
+* new buffers spill to an unlinked file in $TMPDIR (or /tmp) instead, so
+* their pages can be written back under pressure rather than pushing the
+* host into swap. A budget of 0 never spills. buffer_start_connection
+* starts counting what one connection holds, so the largest can be
+* reported.
+*
+* Buffers from buffer_alloc have to go back through buffer_free.
+*/
+
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+struct buffer_stats {
+    unsigned long hugetlb; // big buffers on reserved huge pages
+    unsigned long advised; // on pages advised to become huge pages
+    unsigned long small;   // from malloc
+    unsigned long spilled; // to a temp file, over the budget
+
+    size_t in_use;             // bytes this process holds, not counting spilled buffers
+    size_t peak;               // the most it has held
+    size_t connection_peak;    // the most any one connection added to what was held before it
+    size_t total_in_use;       // what every process holds together
+    size_t total_peak;
+    size_t budget;             // for the total, 0 for none
+};
+
+void buffer_init(size_t huge_threshold, size_t budget);
+void* buffer_alloc(size_t size);
+void* buffer_realloc(void* buffer, size_t size);
+void buffer_free(void* buffer);
+void buffer_start_connection();
+void buffer_get_stats(struct buffer_stats* stats);
+
+#endif
@@ -0,0 +1,378 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "otp_cache.h"
+#include "otp_buffer.h"
+
+#define PRIME1 0x9E3779B185EBCA87ULL
+#define PRIME2 0xC2B2AE3D27D4EB4FULL
+#define PRIME3 0x165667B19E3779F9ULL
+#define PRIME4 0x85EBCA77C2B2AE63ULL
+#define PRIME5 0x27D4EB2F165667C5ULL
+
+#define MIN_BUCKETS 256
+#define MAX_BUCKETS (1 << 20)
+
+struct cache_entry {
+    struct cache_key key;
+    struct cache_entry* chain; // next entry in the same bucket
+    struct cache_entry* prev;  // towards the most recently used
+    struct cache_entry* next;  // towards the least recently used
+    size_t length;
+    uint8_t result[];
+};
+
+// results and keys are kept apart, so one kind of traffic can't push out the other
+struct lru_cache {
+    struct cache_entry** buckets;
+    size_t num_buckets;
+    struct cache_entry* newest;
+    struct cache_entry* oldest;
+    size_t budget;
+    struct cache_stats stats;
+};
+
+static struct lru_cache results;
+static struct lru_cache keys;
+
+static uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t read64(const uint8_t* p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t read32(const uint8_t* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint64_t hash_round(uint64_t acc, uint64_t input) {
+    acc += input * PRIME2;
+    acc = rotl64(acc, 31);
+    return acc * PRIME1;
+}
+
+static uint64_t merge_round(uint64_t acc, uint64_t val) {
+    acc ^= hash_round(0, val);
+    return acc * PRIME1 + PRIME4;
+}
+
+static uint64_t hash_tail(uint64_t h, const uint8_t* p, size_t left);
+
+// XXH64, the reads are little endian like every host this runs on
+uint64_t xxhash64(const void* data, size_t length, uint64_t seed) {
+    const uint8_t* p = data;
+    const uint8_t* end = p + length;
+    uint64_t h;
+
+    if (length >= 32) {
+        uint64_t v1 = seed + PRIME1 + PRIME2;
+        uint64_t v2 = seed + PRIME2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - PRIME1;
+
+        // four independent lanes over 32 byte stripes
+        do {
+            v1 = hash_round(v1, read64(p));
+            v2 = hash_round(v2, read64(p + 8));
+            v3 = hash_round(v3, read64(p + 16));
+            v4 = hash_round(v4, read64(p + 24));
+            p += 32;
+        } while (end - p >= 32);
+
+        h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+        h = merge_round(h, v1);
+        h = merge_round(h, v2);
+        h = merge_round(h, v3);
+        h = merge_round(h, v4);
+    } else {
+        h = seed + PRIME5;
+    }
+
+    return hash_tail(h + length, p, end - p);
+}
+
+// the last bytes that don't fill a stripe, and the final mix
+static uint64_t hash_tail(uint64_t h, const uint8_t* p, size_t left) {
+    const uint8_t* end = p + left;
+
+    while (end - p >= 8) {
+        h ^= hash_round(0, read64(p));
+        h = rotl64(h, 27) * PRIME1 + PRIME4;
+        p += 8;
+    }
+    if (end - p >= 4) {
+        h ^= (uint64_t) read32(p) * PRIME1;
+        h = rotl64(h, 23) * PRIME2 + PRIME3;
+        p += 4;
+    }
+    while (p < end) {
+        h ^= *p * PRIME5;
+        h = rotl64(h, 11) * PRIME1;
+        p++;
+    }
+
+    h ^= h >> 33;
+    h *= PRIME2;
+    h ^= h >> 29;
+    h *= PRIME3;
+    h ^= h >> 32;
+
+    return h;
+}
+
+// the same hash over data that arrives in pieces
+void xxhash64_init(struct xxhash_state* state, uint64_t seed) {
+    memset(state, 0, sizeof(*state));
+    state->v[0] = seed + PRIME1 + PRIME2;
+    state->v[1] = seed + PRIME2;
+    state->v[2] = seed;
+    state->v[3] = seed - PRIME1;
+    state->seed = seed;
+}
+
+static void hash_stripe(struct xxhash_state* state, const uint8_t* p) {
+    for (int i = 0; i < 4; i++) {
+        state->v[i] = hash_round(state->v[i], read64(p + 8 * i));
+    }
+}
+
+void xxhash64_update(struct xxhash_state* state, const void* data, size_t length) {
+    const uint8_t* p = data;
+    const uint8_t* end = p + length;
+
+    state->total += length;
+
+    // finish a stripe left over from the last piece first
+    if (state->buffered > 0) {
+        size_t take = 32 - state->buffered < length ? 32 - state->buffered : length;
+        memcpy(state->buffer + state->buffered, p, take);
+        state->buffered += take;
+        p += take;
+        if (state->buffered < 32) {
+            return;
+        }
+        hash_stripe(state, state->buffer);
+        state->buffered = 0;
+    }
+
+    while (end - p >= 32) {
+        hash_stripe(state, p);
+        p += 32;
+    }
+
+    memcpy(state->buffer, p, end - p);
+    state->buffered = end - p;
+}
+
+uint64_t xxhash64_digest(const struct xxhash_state* state) {
+    uint64_t h;
+
+    if (state->total >= 32) {
+        h = rotl64(state->v[0], 1) + rotl64(state->v[1], 7) + rotl64(state->v[2], 12) + rotl64(state->v[3], 18);
+        for (int i = 0; i < 4; i++) {
+            h = merge_round(h, state->v[i]);
+        }
+    } else {
+        h = state->seed + PRIME5;
+    }
+
+    return hash_tail(h + state->total, state->buffer, state->buffered);
+}
+
+// size the table for the budget, a budget of 0 leaves the cache off
+static void lru_init(struct lru_cache* lru, size_t budget, const char* name) {
+    memset(lru, 0, sizeof(*lru));
+    lru->budget = budget;
+    if (budget == 0) {
+        return;
+    }
+
+    lru->num_buckets = MIN_BUCKETS;
+    while (lru->num_buckets < MAX_BUCKETS && lru->num_buckets * 1024 < budget) {
+        lru->num_buckets *= 2;
+    }
+
+    lru->buckets = calloc(lru->num_buckets, sizeof(*lru->buckets));
+    if (lru->buckets == NULL) {
+        fprintf(stderr, "ERROR allocating %s, running without it\n", name);
+        lru->budget = 0;
+    }
+}
+
+static struct cache_entry** bucket_of(struct lru_cache* lru, const struct cache_key* key) {
+    return &lru->buckets[(key->text_hash ^ rotl64(key->key_hash, 17) ^ key->text_len) & (lru->num_buckets - 1)];
+}
+
+static int same_key(const struct cache_key* a, const struct cache_key* b) {
+    return a->text_hash == b->text_hash && a->key_hash == b->key_hash
+    && a->text_len == b->text_len && a->format == b->format;
+}
+
+static void unlink_lru(struct lru_cache* lru, struct cache_entry* entry) {
+    if (entry->prev != NULL) {
+        entry->prev->next = entry->next;
+    } else {
+        lru->newest = entry->next;
+    }
+    if (entry->next != NULL) {
+        entry->next->prev = entry->prev;
+    } else {
+        lru->oldest = entry->prev;
+    }
+}
+
+static void push_newest(struct lru_cache* lru, struct cache_entry* entry) {
+    entry->prev = NULL;
+    entry->next = lru->newest;
+    if (lru->newest != NULL) {
+        lru->newest->prev = entry;
+    }
+    lru->newest = entry;
+    if (lru->oldest == NULL) {
+        lru->oldest = entry;
+    }
+}
+
+static void remove_entry(struct lru_cache* lru, struct cache_entry* entry) {
+    struct cache_entry** link = bucket_of(lru, &entry->key);
+    while (*link != entry) {
+        link = &(*link)->chain;
+    }
+    *link = entry->chain;
+
+    unlink_lru(lru, entry);
+    lru->stats.bytes -= sizeof(*entry) + entry->length;
+    lru->stats.entries--;
+    buffer_free(entry);
+}
+
+// the entry stored under key, made the most recently used
+static const void* lru_find(struct lru_cache* lru, const struct cache_key* key) {
+    for (struct cache_entry* entry = *bucket_of(lru, key); entry != NULL; entry = entry->chain) {
+        if (same_key(&entry->key, key)) {
+            unlink_lru(lru, entry);
+            push_newest(lru, entry);
+            lru->stats.hits++;
+            return entry->result;
+        }
+    }
+
+    lru->stats.misses++;
+    return NULL;
+}
+
+// keep a copy of data under key, dropping the least recently used entries to fit it
+static void lru_store(struct lru_cache* lru, const struct cache_key* key, const void* data, size_t length) {
+    size_t size = sizeof(struct cache_entry) + length;
+
+    // an entry that would push out most of the cache isn't worth it
+    if (lru->budget == 0 || size > lru->budget / 4) {
+        return;
+    }
+
+    while (lru->stats.bytes + size > lru->budget && lru->oldest != NULL) {
+        remove_entry(lru, lru->oldest);
+        lru->stats.evictions++;
+    }
+
+    // a big key or result stays on huge pages like the payload it came from
+    struct cache_entry* entry = buffer_alloc(size);
+    if (entry == NULL) {
+        return;
+    }
+    entry->key = *key;
+    entry->length = length;
+    memcpy(entry->result, data, length);
+
+    struct cache_entry** bucket = bucket_of(lru, key);
+    entry->chain = *bucket;
+    *bucket = entry;
+    push_newest(lru, entry);
+
+    lru->stats.bytes += size;
+    lru->stats.entries++;
+}
+
+static void lru_report(struct lru_cache* lru, FILE* out, const char* name) {
+    if (lru->budget == 0) {
+        return;
+    }
+
+    struct cache_stats* stats = &lru->stats;
+    uint64_t lookups = stats->hits + stats->misses;
+    fprintf(out, "SERVER: %s %llu hits %llu misses (%.1f%%), %llu evicted, %zu entries in %zu of %zu bytes\n",
+    name, (unsigned long long) stats->hits, (unsigned long long) stats->misses,
+    lookups > 0 ? 100.0 * stats->hits / lookups : 0.0,
+    (unsigned long long) stats->evictions, stats->entries, stats->bytes, lru->budget);
+}
+
+void cache_init(size_t result_budget, size_t key_budget) {
+    lru_init(&results, result_budget, "result cache");
+    lru_init(&keys, key_budget, "key store");
+}
+
+int cache_enabled() {
+    return results.budget > 0;
+}
+
+// find the result of a request already served, filling in the lookup to store it under if
+// there is none. bytes is how much of the text (and so of the key) the cipher reads for
+// its count symbols. the result stays valid until the next cache_store, returns NULL on a
+// miss or when the cache is off
+const void* cache_lookup(int format, const void* text, const void* key, size_t bytes, uint32_t count, struct cache_key* lookup) {
+    if (results.budget == 0) {
+        return NULL;
+    }
+
+    // the key's hash is seeded with the text's, so swapping the two gives another entry
+    lookup->text_hash = xxhash64(text, bytes, format);
+    lookup->key_hash = xxhash64(key, bytes, lookup->text_hash);
+    lookup->text_len = count;
+    lookup->format = format;
+
+    return lru_find(&results, lookup);
+}
+
+// keep a result for the lookup that missed
+void cache_store(const struct cache_key* lookup, const void* result, size_t length) {
+    lru_store(&results, lookup, result, length);
+}
+
+int key_store_enabled() {
+    return keys.budget > 0;
+}
+
+// a key of key_len symbols a client sent before, held in format, NULL if it is not held
+// any more. it stays valid until the next key_store_add
+const void* key_store_find(uint64_t hash, uint32_t key_len, int format) {
+    struct cache_key lookup = { hash, 0, key_len, format };
+
+    if (keys.budget == 0) {
+        return NULL;
+    }
+    return lru_find(&keys, &lookup);
+}
+
+// hold on to a key the client will offer by its hash, hash has to be the key's own
+void key_store_add(uint64_t hash, uint32_t key_len, int format, const void* key, size_t bytes) {
+    struct cache_key lookup = { hash, 0, key_len, format };
+    lru_store(&keys, &lookup, key, bytes);
+}
+
+void cache_get_stats(struct cache_stats* result_stats, struct cache_stats* key_stats) {
+    *result_stats = results.stats;
+    *key_stats = keys.stats;
+}
+
+void cache_report(FILE* out) {
+    lru_report(&results, out, "result cache");
+    lru_report(&keys, out, "key store");
+    fflush(out);
+}
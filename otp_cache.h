@@ -0,0 +1,70 @@
+#ifndef OTP_CACHE_H
+#define OTP_CACHE_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+* Result cache
+* Clients that decrypt the same ciphertext with the same key again and
+* again (audit jobs re-checking archives, retries) get the earlier result
+* back without the cipher running a second time.
+*
+* Entries are found by a 64 bit xxHash of the text and another of the part
+* of the key the cipher uses, along with the text length and its format.
+* Only the results are kept, never copies of the inputs. The cache holds
+* at most the budget given to cache_init and drops the least recently used
+* results to make room. Each server process has its own cache, a budget of
+* 0 (the default) turns it off.
+*
+* The key store works the same way for whole keys. Clients that send the
+* same big key with every request offer its hash first (see otp_header.h),
+* and a key the store still holds is not sent again. A key is only kept
+* under the hash the server worked out from the key itself.
+*/
+
+#define CACHE_TEXT 0   // results ciphered as text
+#define CACHE_PACKED 1 // results ciphered as packed symbols
+
+// the formats double as the form a stored key is kept in
+
+struct cache_key {
+    uint64_t text_hash;
+    uint64_t key_hash;
+    uint32_t text_len;
+    uint32_t format;
+};
+
+struct cache_stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    size_t bytes;   // held by the entries
+    size_t entries;
+};
+
+struct xxhash_state {
+    uint64_t v[4];
+    uint64_t seed;
+    uint64_t total;
+    uint8_t buffer[32]; // the start of a stripe that isn't complete yet
+    size_t buffered;
+};
+
+uint64_t xxhash64(const void* data, size_t length, uint64_t seed);
+void xxhash64_init(struct xxhash_state* state, uint64_t seed);
+void xxhash64_update(struct xxhash_state* state, const void* data, size_t length);
+uint64_t xxhash64_digest(const struct xxhash_state* state);
+
+void cache_init(size_t result_budget, size_t key_budget);
+int cache_enabled();
+const void* cache_lookup(int format, const void* text, const void* key, size_t bytes, uint32_t count, struct cache_key* lookup);
+void cache_store(const struct cache_key* lookup, const void* result, size_t length);
+int key_store_enabled();
+const void* key_store_find(uint64_t hash, uint32_t key_len, int format);
+void key_store_add(uint64_t hash, uint32_t key_len, int format, const void* key, size_t bytes);
+void cache_get_stats(struct cache_stats* result_stats, struct cache_stats* key_stats);
+void cache_report(FILE* out);
+
+#endif
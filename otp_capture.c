@@ -0,0 +1,142 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "otp_capture.h"
+
+static int capture_fd = -1;
+static char* batch = NULL;
+static size_t batched = 0;
+
+// the connection being recorded, there is only ever one per process
+static int capture_socket = -1;
+static uint64_t connection_id = 0;
+static uint32_t connections = 0;
+static pid_t batch_pid = 0; // the process the batch belongs to, a shard starts its own
+
+static uint64_t now_us() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+// append to the capture in one write, so other shards' batches can't land in the middle
+// of it. stops capturing if it can't be written
+static void write_out(const void* data, size_t length, const void* more, size_t more_length) {
+    struct iovec iov[2] = { { (void*) data, length }, { (void*) more, more_length } };
+    int first = 0;
+
+    while (capture_fd >= 0 && first < 2) {
+        ssize_t written = writev(capture_fd, iov + first, 2 - first);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            perror("ERROR writing the capture, no longer capturing");
+            close(capture_fd);
+            capture_fd = -1;
+            return;
+        }
+
+        // only a full disk writes part of it
+        for (; first < 2 && (size_t) written >= iov[first].iov_len; first++) {
+            written -= iov[first].iov_len;
+        }
+        if (first < 2) {
+            iov[first].iov_base = (char*) iov[first].iov_base + written;
+            iov[first].iov_len -= written;
+        }
+    }
+}
+
+// open the capture before any shards are forked so they all append to it, -1 if it can't be
+int capture_start(const char* path, int role) {
+    struct stat st;
+
+    capture_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (capture_fd < 0 || fstat(capture_fd, &st) < 0) {
+        return -1;
+    }
+
+    batch = malloc(CAPTURE_BATCHSIZE);
+    if (batch == NULL) {
+        close(capture_fd);
+        capture_fd = -1;
+        return -1;
+    }
+
+    // a server started again on the same capture carries on after the last one
+    if (st.st_size == 0) {
+        struct capture_header header = { CAPTURE_MAGIC, CAPTURE_VERSION, role };
+        write_out(&header, sizeof(header), NULL, 0);
+    }
+    return capture_fd >= 0 ? 0 : -1;
+}
+
+void capture_flush() {
+    if (capture_fd >= 0 && batched > 0) {
+        write_out(batch, batched, NULL, 0);
+    }
+    batched = 0;
+}
+
+static void add_record(uint32_t type, const void* data, size_t length) {
+    struct capture_record record = { now_us(), connection_id, type, length };
+
+    if (batched + sizeof(record) + length > CAPTURE_BATCHSIZE) {
+        capture_flush();
+    }
+
+    // a read bigger than a batch goes out on its own, right behind its record
+    if (sizeof(record) + length > CAPTURE_BATCHSIZE) {
+        write_out(&record, sizeof(record), data, length);
+        return;
+    }
+
+    memcpy(batch + batched, &record, sizeof(record));
+    if (length > 0) {
+        memcpy(batch + batched + sizeof(record), data, length);
+    }
+    batched += sizeof(record) + length;
+}
+
+void capture_open(int socketFD) {
+    if (capture_fd < 0) {
+        return;
+    }
+
+    // a forked shard starts counting its own connections, the parent's were never its
+    if (batch_pid != getpid()) {
+        batch_pid = getpid();
+        connections = 0;
+        batched = 0;
+    }
+
+    capture_socket = socketFD;
+    connection_id = (uint64_t) batch_pid << 32 | connections++;
+    add_record(CAPTURE_OPEN, NULL, 0);
+}
+
+// every module's recv loop hands what it read here, only the connection being captured is kept
+void capture_received(int socketFD, const void* data, size_t length) {
+    if (capture_fd < 0 || socketFD != capture_socket || length == 0) {
+        return;
+    }
+    add_record(CAPTURE_DATA, data, length);
+}
+
+void capture_close(int socketFD) {
+    if (capture_fd < 0 || socketFD != capture_socket) {
+        return;
+    }
+
+    add_record(CAPTURE_CLOSE, NULL, 0);
+    capture_flush();
+    capture_socket = -1;
+}
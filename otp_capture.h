@@ -0,0 +1,61 @@
+#ifndef OTP_CAPTURE_H
+#define OTP_CAPTURE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+* Traffic capture
+* A server started with -W path records everything its clients send: the
+* hello, every frame and every file, each stamped with when the server
+* read it. otp_replay sends the same bytes to another server, at the
+* original pace or as fast as it can, to put production load on a new
+* build.
+*
+* A capture is a capture_header then capture_records. A CAPTURE_DATA record
+* is followed by the length bytes that were read, CAPTURE_OPEN and
+* CAPTURE_CLOSE records have no data. Times are CLOCK_MONOTONIC in
+* microseconds, so the records of every shard share one clock. A
+* connection is named by the pid of the process serving it and how many
+* that process served before it.
+*
+* Records are gathered per process and appended in batches, when a
+* connection closes or the batch gets to CAPTURE_BATCHSIZE. All shards
+* append to the one file (O_APPEND), a batch at a time, and a server
+* started again on the same path carries on the capture.
+*
+* Only the bytes a server read are recorded, so replaying them is exactly
+* the conversation it had, as long as the server replayed to starts in
+* the same state. Keys offered by their hash only replay right in order,
+* against a server with the same -K, and requests that went through a
+* shared memory ring (CAP_SHM) aren't on the socket at all.
+*/
+
+#define CAPTURE_MAGIC 0x4f545043 // "OTPC"
+#define CAPTURE_VERSION 1
+#define CAPTURE_BATCHSIZE (1024 * 1024)
+
+#define CAPTURE_OPEN 0
+#define CAPTURE_DATA 1
+#define CAPTURE_CLOSE 2
+
+struct capture_header {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t role; // the ROLE_ of the clients (see otp_header.h)
+};
+
+struct capture_record {
+    uint64_t time_us;
+    uint64_t connection; // pid << 32 | connections served before it
+    uint32_t type;
+    uint32_t length;     // of the data that follows
+};
+
+int capture_start(const char* path, int role);
+void capture_open(int socketFD);
+void capture_received(int socketFD, const void* data, size_t length);
+void capture_close(int socketFD);
+void capture_flush();
+
+#endif
@@ -0,0 +1,775 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <stddef.h>
+#include <netdb.h>
+
+#include "otp_client.h"
+#include "otp_ring.h"
+#include "otp_pack.h"
+#include "otp_lz4.h"
+#include "otp_header.h"
+#include "otp_cache.h"
+#include "otp_socket.h"
+
+#define ERROR_BUFFERSIZE 1024 // the server's error text comes in 513 byte chunks
+
+// Read exactly length bytes, returns 0 if the peer closed or the read failed
+static int recv_all (int socketFD, void* buffer, int length) {
+    int total = 0;
+
+    while (total < length) {
+        int got = recv(socketFD, (char*) buffer + total, length - total, 0);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            return 0;
+        }
+        total += got;
+    }
+
+    return 1;
+}
+
+// the error text comes in short frames, anything bigger than the buffer is not ours
+static int recv_frame (int socketFD, char* buffer, int size) {
+    int length;
+
+    if (!recv_all(socketFD, &length, sizeof(length))) {
+        return -1;
+    }
+    if (length < 0 || length >= size) {
+        return -1;
+    }
+    if (!recv_all(socketFD, buffer, length)) {
+        return -1;
+    }
+    buffer[length] = '\0';
+
+    return length;
+}
+
+static long now_ms () {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+// full jitter: sleep a random amount between 0 and the capped exponential delay
+static void backoff (struct conn_pool* pool, int attempt) {
+    long delay = pool->base_delay_ms;
+
+    for (int i = 0; i < attempt && delay < pool->max_delay_ms; i++) {
+        delay *= 2;
+    }
+    if (delay > pool->max_delay_ms) {
+        delay = pool->max_delay_ms;
+    }
+
+    long sleep_ms = rand() % (delay + 1);
+    struct timespec ts = { sleep_ms / 1000, (sleep_ms % 1000) * 1000000L };
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR);
+}
+
+// a warm socket the server has since closed reads as EOF without blocking, the pool
+// only keeps connections whose grant has been read so nothing else can be waiting
+static int is_stale (int socketFD) {
+    struct pollfd pfd = { socketFD, POLLIN, 0 };
+
+    if (poll(&pfd, 1, 0) < 0) {
+        return 1;
+    }
+    return (pfd.revents & (POLLIN | POLLHUP | POLLERR)) != 0;
+}
+
+// connect to one of the endpoint's cached addresses and say hello, without waiting for
+// the reply unless the connection is for a ring (its fds only go over once granted)
+// returns the socket, POOL_ERR_CONNECT for retryable failures or POOL_ERR_PERMISSION,
+// with the grant awaiting when the reply is still to be read
+static int open_connection (struct conn_pool* pool, struct endpoint* ep, struct grant* grant) {
+    int socketFD = -1;
+
+    if (ep->local) {
+        socketFD = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (socketFD >= 0 && connect(socketFD, (struct sockaddr*) &ep->local_addr, ep->local_len) < 0) {
+            close(socketFD);
+            socketFD = -1;
+        }
+    }
+
+    for (struct addrinfo* ai = ep->addrs; ai != NULL; ai = ai->ai_next) {
+        socketFD = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (socketFD < 0) {
+            continue;
+        }
+        if (connect(socketFD, ai->ai_addr, ai->ai_addrlen) == 0) {
+            break;
+        }
+        close(socketFD);
+        socketFD = -1;
+    }
+
+    if (socketFD < 0) {
+        return POOL_ERR_CONNECT;
+    }
+    tune_socket(socketFD);
+
+    int ring = ep->local && pool->shared_memory;
+    int options = pool->sized ? CAP_SIZED : 0;
+    if (ring) {
+        options |= CAP_SHM;
+    } else if (pool->compress) {
+        options |= CAP_COMPRESS;
+    } else if (pool->packed) {
+        options |= CAP_PACKED | (pool->multi ? CAP_MULTI : 0);
+    }
+    if (!ring && pool->offer_keys) {
+        options |= CAP_KEYS;
+    }
+    options = settle_options(options);
+
+    if (send_hello(socketFD, pool->role, options) < 0) {
+        close(socketFD);
+        return POOL_ERR_CONNECT;
+    }
+
+    // the server settles the options the same way, so requests can be framed for them
+    // before the grant is back
+    ep->options = options;
+    grant->awaiting = !ring;
+    grant->endpoint = ep;
+    if (!ring) {
+        return socketFD;
+    }
+
+    int status = recv_hello_reply(socketFD, &ep->options);
+    if (status == HELLO_GRANTED) {
+        return socketFD;
+    }
+
+    close(socketFD);
+
+    // a busy server is worth trying again, a refusal is not
+    return status == HELLO_DENIED ? POOL_ERR_PERMISSION : POOL_ERR_CONNECT;
+}
+
+// take an endpoint out of rotation, longer each time it fails in a row
+static void eject (struct endpoint* ep, int denied) {
+    long eject_ms = EJECT_PERMISSION_MS;
+
+    if (!denied) {
+        eject_ms = EJECT_BASE_MS;
+        for (int i = 1; i < ep->failures && eject_ms < EJECT_MAX_MS; i++) {
+            eject_ms *= 2;
+        }
+        if (eject_ms > EJECT_MAX_MS) {
+            eject_ms = EJECT_MAX_MS;
+        }
+    }
+
+    ep->denied = denied;
+    ep->eject_until_ms = now_ms() + eject_ms;
+}
+
+// read the reply to the hello on a new connection, before anything else is read from it,
+// if the connection's grant (from pool_acquire) says it hasn't been yet. the options the
+// server granted go to the endpoint, one that refused the client is ejected
+// returns 0 once granted, POOL_ERR_PERMISSION if the server refused the client or
+// POOL_ERR_CONNECT if the connection failed
+int await_grant(int socketFD, struct grant* grant) {
+    int options;
+
+    if (!grant->awaiting) {
+        return 0;
+    }
+    grant->awaiting = 0;
+
+    int status = recv_hello_reply(socketFD, &options);
+    if (status == HELLO_GRANTED) {
+        grant->endpoint->options = options;
+        return 0;
+    }
+    if (status == HELLO_DENIED) {
+        eject(grant->endpoint, 1);
+        return POOL_ERR_PERMISSION;
+    }
+    return POOL_ERR_CONNECT;
+}
+
+// wait up to timeout_ms for a new connection to be granted, -1 if no shard took it by then
+static int grant_within (int socketFD, struct grant* grant, int timeout_ms) {
+    struct pollfd pfd = { socketFD, POLLIN, 0 };
+
+    if (!grant->awaiting) {
+        return 0;
+    }
+    if (poll(&pfd, 1, timeout_ms) <= 0) {
+        return -1;
+    }
+    return await_grant(socketFD, grant) < 0 ? -1 : 0;
+}
+
+void pool_init(struct conn_pool* pool, int role) {
+    memset(pool, 0, sizeof(*pool));
+
+    pool->role = role;
+    pool->max_attempts = RETRY_MAX_ATTEMPTS;
+    pool->base_delay_ms = RETRY_BASE_DELAY_MS;
+    pool->max_delay_ms = RETRY_MAX_DELAY_MS;
+    pool->sized = 1;
+    pool->offer_keys = 1;
+
+    srand(time(NULL) ^ getpid());
+}
+
+// resolve the endpoint once, returns its index or -1 if the host is unknown
+int pool_add_endpoint(struct conn_pool* pool, const char* host, const char* port) {
+    if (pool->num_endpoints >= POOL_MAX_ENDPOINTS) {
+        return -1;
+    }
+
+    struct endpoint* ep = &pool->endpoints[pool->num_endpoints];
+    memset(ep, 0, sizeof(*ep));
+    snprintf(ep->host, sizeof(ep->host), "%s", host);
+    snprintf(ep->port, sizeof(ep->port), "%s", port);
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    if (getaddrinfo(ep->host, ep->port, &hints, &ep->addrs) != 0) {
+        ep->addrs = NULL;
+        return -1;
+    }
+
+    return pool->num_endpoints++;
+}
+
+// a unix socket endpoint, a leading '@' puts the name in the abstract namespace
+int pool_add_local_endpoint(struct conn_pool* pool, const char* path) {
+    if (pool->num_endpoints >= POOL_MAX_ENDPOINTS) {
+        return -1;
+    }
+
+    struct endpoint* ep = &pool->endpoints[pool->num_endpoints];
+    memset(ep, 0, sizeof(*ep));
+
+    size_t len = strlen(path);
+    if (len == 0 || len >= sizeof(ep->local_addr.sun_path)) {
+        return -1;
+    }
+
+    ep->local = 1;
+    ep->local_addr.sun_family = AF_UNIX;
+    memcpy(ep->local_addr.sun_path, path, len);
+    if (path[0] == '@') {
+        ep->local_addr.sun_path[0] = '\0';
+    }
+    ep->local_len = offsetof(struct sockaddr_un, sun_path) + len + (path[0] == '@' ? 0 : 1);
+
+    snprintf(ep->host, sizeof(ep->host), "unix:%s", path);
+    return pool->num_endpoints++;
+}
+
+// add a comma separated list of host:port (or bare port) endpoints
+// returns how many were added, or -1 if any of them could not be resolved
+int pool_add_endpoints(struct conn_pool* pool, const char* list, const char* default_host) {
+    char* copy = strdup(list);
+    char* saveptr = NULL;
+    int added = 0;
+
+    if (copy == NULL) {
+        return -1;
+    }
+
+    for (char* item = strtok_r(copy, ",", &saveptr); item != NULL; item = strtok_r(NULL, ",", &saveptr)) {
+        const char* host = default_host;
+        char* port = item;
+
+        if (strncmp(item, "unix:", 5) == 0) {
+            if (pool_add_local_endpoint(pool, item + 5) < 0) {
+                free(copy);
+                return -1;
+            }
+            added++;
+            continue;
+        }
+
+        // split on the last colon so bracket-less hosts like "a:b" still work
+        char* colon = strrchr(item, ':');
+        if (colon != NULL) {
+            *colon = '\0';
+            host = item;
+            port = colon + 1;
+        }
+
+        if (pool_add_endpoint(pool, host, port) < 0) {
+            free(copy);
+            return -1;
+        }
+        added++;
+    }
+
+    free(copy);
+    return added;
+}
+
+// open connections ahead of time, returns how many are now waiting in the pool
+int pool_prewarm(struct conn_pool* pool, int per_endpoint) {
+    int warmed = 0;
+
+    for (int i = 0; i < pool->num_endpoints; i++) {
+        struct endpoint* ep = &pool->endpoints[i];
+
+        while (ep->num_idle < per_endpoint && ep->num_idle < POOL_MAX_IDLE) {
+            struct grant grant;
+            int socketFD = open_connection(pool, ep, &grant);
+            if (socketFD < 0) {
+                break;
+            }
+
+            // the hello waits to go out with the first request, here there isn't one yet.
+            // one no shard takes is queued behind the warm ones, and would wait for them to close
+            push_socket(socketFD);
+            if (grant_within(socketFD, &grant, PREWARM_GRANT_MS) < 0) {
+                close(socketFD);
+                break;
+            }
+            ep->idle[ep->num_idle] = socketFD;
+            ep->idle_since_ms[ep->num_idle++] = now_ms();
+        }
+        warmed += ep->num_idle;
+    }
+
+    return warmed;
+}
+
+// close the connections that have been idle for POOL_IDLE_MS, each is holding a shard
+// another client could be served on
+void pool_trim(struct conn_pool* pool) {
+    long now = now_ms();
+
+    for (int i = 0; i < pool->num_endpoints; i++) {
+        struct endpoint* ep = &pool->endpoints[i];
+        int kept = 0;
+
+        for (int j = 0; j < ep->num_idle; j++) {
+            if (now - ep->idle_since_ms[j] >= POOL_IDLE_MS) {
+                close(ep->idle[j]);
+                continue;
+            }
+            ep->idle[kept] = ep->idle[j];
+            ep->idle_since_ms[kept++] = ep->idle_since_ms[j];
+        }
+        ep->num_idle = kept;
+    }
+}
+
+// every endpoint has refused us, so retrying cannot help
+static int all_denied (struct conn_pool* pool) {
+    for (int i = 0; i < pool->num_endpoints; i++) {
+        if (!pool->endpoints[i].denied) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// pick the endpoint with the fewest requests in flight, -1 if all are ejected
+static int choose_endpoint (struct conn_pool* pool) {
+    int healthy[POOL_MAX_ENDPOINTS];
+    int num_healthy = 0;
+    long now = now_ms();
+
+    // healthy unix socket endpoints first, TCP ones are only the fallback
+    for (int local = 1; local >= 0 && num_healthy == 0; local--) {
+        for (int i = 0; i < pool->num_endpoints; i++) {
+            if (pool->endpoints[i].local == local && pool->endpoints[i].eject_until_ms <= now) {
+                healthy[num_healthy++] = i;
+            }
+        }
+    }
+
+    if (num_healthy == 0) {
+        return -1;
+    }
+    if (num_healthy == 1) {
+        return healthy[0];
+    }
+
+    if (pool->balance == BALANCE_LEAST_OUTSTANDING) {
+        // start the scan somewhere random so ties don't all land on the first one
+        int offset = rand() % num_healthy;
+        int best = healthy[offset];
+
+        for (int i = 1; i < num_healthy; i++) {
+            int candidate = healthy[(offset + i) % num_healthy];
+            if (pool->endpoints[candidate].outstanding < pool->endpoints[best].outstanding) {
+                best = candidate;
+            }
+        }
+        return best;
+    }
+
+    // power of two choices: two distinct random endpoints, keep the less loaded one
+    int first = rand() % num_healthy;
+    int second = rand() % (num_healthy - 1);
+    if (second >= first) {
+        second++;
+    }
+
+    first = healthy[first];
+    second = healthy[second];
+    if (pool->endpoints[second].outstanding < pool->endpoints[first].outstanding) {
+        return second;
+    }
+    return first;
+}
+
+// hand out a warm connection, or make a new one retrying with backoff. grant is the
+// connection's for await_grant, awaiting on a new one until the reply is read
+int pool_acquire(struct conn_pool* pool, int* endpoint_index, struct grant* grant) {
+    int retry_now = 0;
+
+    pool_trim(pool);
+
+    for (int attempt = 0; attempt < pool->max_attempts; attempt++) {
+        if (attempt > 0 && !retry_now) {
+            backoff(pool, attempt - 1);
+        }
+        retry_now = 0;
+
+        int index = choose_endpoint(pool);
+        if (index < 0) {
+            // everything is ejected, only give up for good if they all refused us
+            if (all_denied(pool)) {
+                return POOL_ERR_PERMISSION;
+            }
+            continue;
+        }
+
+        struct endpoint* ep = &pool->endpoints[index];
+        int socketFD = -1;
+
+        // reuse an idle connection first, dropping any the server already closed
+        while (ep->num_idle > 0 && socketFD < 0) {
+            socketFD = ep->idle[--ep->num_idle];
+            if (is_stale(socketFD)) {
+                close(socketFD);
+                socketFD = -1;
+            }
+        }
+
+        grant->awaiting = 0;
+        grant->endpoint = ep;
+        if (socketFD < 0) {
+            socketFD = open_connection(pool, ep, grant);
+        }
+
+        if (socketFD >= 0) {
+            ep->failures = 0;
+            ep->denied = 0;
+            ep->outstanding++;
+            *endpoint_index = index;
+            return socketFD;
+        }
+
+        if (socketFD == POOL_ERR_PERMISSION) {
+            eject(ep, 1);
+
+            // a server that refuses us won't change its mind on a retry
+            if (all_denied(pool)) {
+                return POOL_ERR_PERMISSION;
+            }
+
+            // the next endpoint is worth trying straight away
+            attempt--;
+            retry_now = 1;
+            continue;
+        }
+
+        ep->failures++;
+        if (pool->num_endpoints > 1) {
+            eject(ep, 0);
+        }
+    }
+
+    return POOL_ERR_CONNECT;
+}
+
+// give a connection back, it is only kept if the request on it completed cleanly
+// (which always reads the grant of a new one)
+void pool_release(struct conn_pool* pool, int endpoint_index, int socketFD, int reusable) {
+    struct endpoint* ep = &pool->endpoints[endpoint_index];
+
+    ep->outstanding--;
+
+    // a ring connection belongs to the ring that was passed over it
+    if (ep->local && pool->shared_memory) {
+        reusable = 0;
+    }
+
+    if (reusable && ep->num_idle < POOL_MAX_IDLE) {
+        ep->idle[ep->num_idle] = socketFD;
+        ep->idle_since_ms[ep->num_idle++] = now_ms();
+    } else {
+        close(socketFD);
+    }
+}
+
+void pool_destroy(struct conn_pool* pool) {
+    for (int i = 0; i < pool->num_endpoints; i++) {
+        struct endpoint* ep = &pool->endpoints[i];
+
+        while (ep->num_idle > 0) {
+            close(ep->idle[--ep->num_idle]);
+        }
+        if (ep->addrs != NULL) {
+            freeaddrinfo(ep->addrs);
+            ep->addrs = NULL;
+        }
+    }
+    pool->num_endpoints = 0;
+}
+
+// send one request through a shared memory ring on a freshly granted connection
+// and write the result (or the server's error) to out, -1 if the ring failed
+int ring_request(int socketFD, const char* text, const char* key, struct otp_output* out) {
+    struct shm_ring ring;
+    uint64_t position;
+    uint32_t text_len = strlen(text);
+    uint32_t key_len = strlen(key);
+
+    // one request, so the ring only has to be big enough for it
+    uint32_t capacity = sizeof(struct ring_entry) + text_len + key_len;
+    if (capacity < RING_DEFAULT_CAPACITY) {
+        capacity = RING_DEFAULT_CAPACITY;
+    }
+
+    if (ring_create(&ring, capacity) < 0) {
+        return -1;
+    }
+    if (ring_send_fds(&ring, socketFD) < 0) {
+        ring_close(&ring);
+        return -1;
+    }
+
+    struct ring_entry* entry = ring_reserve(&ring, text_len, key_len, &position);
+    if (entry == NULL) {
+        ring_close(&ring);
+        return -1;
+    }
+    memcpy(RING_TEXT(entry), text, text_len);
+    memcpy(RING_KEY(entry), key, key_len);
+    ring_commit(&ring, position);
+
+    entry = ring_wait(&ring, position);
+    if (entry == NULL) {
+        ring_close(&ring);
+        return -1;
+    }
+
+    if (entry->status == RING_DONE) {
+        output_write(out, RING_TEXT(entry), entry->text_len);
+        output_puts(out, "\n");
+    } else if (entry->status == RING_LEN_ERROR) {
+        output_puts(out, RING_LEN_ERROR_MSG);
+    } else {
+        output_puts(out, RING_CHAR_ERROR_MSG);
+    }
+
+    ring_release(&ring, position);
+    ring_close(&ring);
+    return 0;
+}
+
+// the error text of a packed or compressed request is sent the old way,
+// in chunks ending with a lone '\r'. offset is where its status said the error is
+static int recv_error_text (int socketFD, int64_t offset, struct otp_output* out) {
+    char chunk[ERROR_BUFFERSIZE];
+
+    out->error_at = offset;
+
+    while (recv_frame(socketFD, chunk, sizeof(chunk)) >= 0) {
+        if (chunk[0] == '\r') {
+            output_puts(out, "\n");
+            return 0;
+        }
+        output_puts(out, chunk);
+    }
+
+    return -1;
+}
+
+// pass each piece of a result straight on to the output
+static int write_text (const char* text, uint32_t length, void* arg) {
+    return output_write(arg, text, length) == 0;
+}
+
+static int write_block (char* block, int length, uint32_t offset, void* arg) {
+    return output_write(arg, block, length) == 0;
+}
+
+// announce the sizes of the next request, when the server agreed to have them upfront
+// returns 1 to go ahead and send the files, 0 if the server turned the request down
+// (its error text is written to out), -1 if the connection failed or POOL_ERR_PERMISSION
+// if the server refused the client
+int announce_request(int socketFD, struct grant* grant, int options, uint32_t text_len, const char* key, struct otp_output* out) {
+    struct request_header header = { text_len, strlen(key), 0 };
+
+    if (!(options & CAP_SIZED)) {
+        return 1;
+    }
+
+    // only a big request is worth a round trip to find out if it will be turned down,
+    // and only a big key is worth offering by its hash
+    if ((uint64_t) header.text_len + header.key_len > EXPECT_THRESHOLD) {
+        header.flags |= HEADER_EXPECT;
+    }
+    if ((options & CAP_KEYS) && header.key_len > KEY_HASH_THRESHOLD) {
+        header.flags |= HEADER_EXPECT | HEADER_KEY_HASH;
+    }
+
+    size_socket_buffers(socketFD, (size_t) header.text_len + header.key_len, header.text_len);
+
+    if (send_request_header(socketFD, &header) < 0) {
+        return -1;
+    }
+    if ((header.flags & HEADER_KEY_HASH) && send_key_hash(socketFD, xxhash64(key, header.key_len, 0)) < 0) {
+        return -1;
+    }
+    if (!(header.flags & HEADER_EXPECT)) {
+        return 1;
+    }
+
+    // the reply to the hello comes ahead of the first response on a new connection
+    int granted = await_grant(socketFD, grant);
+    if (granted < 0) {
+        return granted;
+    }
+
+    int32_t result;
+    int64_t offset;
+    if (recv_status(socketFD, &result, &offset) < 0) {
+        return -1;
+    }
+    if (result == PACK_STATUS_OK) {
+        return 1;
+    }
+    if (result == PACK_STATUS_KEY_HELD) {
+        return ANNOUNCE_KEY_HELD;
+    }
+    return recv_error_text(socketFD, offset, out) < 0 ? -1 : 0;
+}
+
+// send one request as packed symbols on a connection granted packed transfers
+// and write the result (or the server's error) to out, -1 if the connection failed
+// or POOL_ERR_PERMISSION if the server refused the client
+// more than one text needs a connection granted multi, the file count is already sent
+int packed_request(int socketFD, struct grant* grant, const char** texts, int num_texts, const char* key, int send_key, struct otp_output* out) {
+    uint32_t key_count = send_key ? strlen(key) : 0;
+    uint8_t* packed_key = malloc(PACKED_BYTES(key_count) + 1);
+
+    if (packed_key == NULL || pack_text(key, key_count, packed_key) < 0) {
+        free(packed_key);
+        return -1;
+    }
+
+    // a throughput connection holds back partial segments until the key is sent
+    cork_socket(socketFD);
+    for (int i = 0; i < num_texts; i++) {
+        uint32_t text_count = strlen(texts[i]);
+        uint8_t* packed_text = malloc(PACKED_BYTES(text_count) + 1);
+
+        if (packed_text == NULL || pack_text(texts[i], text_count, packed_text) < 0
+        || send_packed(socketFD, packed_text, text_count) < 0) {
+            free(packed_text);
+            free(packed_key);
+            return -1;
+        }
+        free(packed_text);
+    }
+
+    int sent = !send_key || send_packed(socketFD, packed_key, key_count) == 0;
+    free(packed_key);
+    if (!sent) {
+        return -1;
+    }
+    uncork_socket(socketFD);
+
+    // the reply to the hello comes ahead of the first response on a new connection
+    int granted = await_grant(socketFD, grant);
+    if (granted < 0) {
+        return granted;
+    }
+
+    // a status and a result (or the error text) for each document, in order
+    // the result is written out a frame at a time as it is unpacked
+    for (int i = 0; i < num_texts; i++) {
+        int32_t result;
+        int64_t offset;
+        uint32_t count;
+
+        if (recv_status(socketFD, &result, &offset) < 0) {
+            return -1;
+        }
+        if (result != PACK_STATUS_OK) {
+            if (recv_error_text(socketFD, offset, out) < 0) {
+                return -1;
+            }
+            continue;
+        }
+        if (stream_packed(socketFD, &count, write_text, out) < 0) {
+            return -1;
+        }
+        output_puts(out, "\n");
+    }
+
+    return 0;
+}
+
+// send one request on a connection granted compressed transfers, compressing the text
+// when it is plaintext, and write the result (or the server's error) to out
+// -1 if the connection failed or POOL_ERR_PERMISSION if the server refused the client
+int compressed_request(int socketFD, struct grant* grant, const char* text, const char* key, int send_key, int compress_text, struct otp_output* out) {
+    cork_socket(socketFD);
+    if ((send_key && send_blocks(socketFD, key, strlen(key), 0) < 0)
+    || send_blocks(socketFD, text, strlen(text), compress_text) < 0) {
+        return -1;
+    }
+    uncork_socket(socketFD);
+
+    // the reply to the hello comes ahead of the first response on a new connection
+    int granted = await_grant(socketFD, grant);
+    if (granted < 0) {
+        return granted;
+    }
+
+    int32_t result;
+    int64_t offset;
+    if (recv_status(socketFD, &result, &offset) < 0) {
+        return -1;
+    }
+
+    if (result != PACK_STATUS_OK) {
+        return recv_error_text(socketFD, offset, out);
+    }
+
+    // each block is written out as soon as it is decoded
+    uint32_t length;
+    if (stream_blocks(socketFD, &length, write_block, out) < 0) {
+        return -1;
+    }
+    output_puts(out, "\n");
+
+    return 0;
+}
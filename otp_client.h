@@ -0,0 +1,147 @@
+#ifndef OTP_CLIENT_H
+#define OTP_CLIENT_H
+
+#include <stdio.h>
+#include <netdb.h>
+#include <sys/un.h>
+
+#include "otp_pack.h"
+#include "otp_lz4.h"
+#include "otp_header.h"
+#include "otp_output.h"
+
+/**
+* Client library
+* Keeps a pool of warm (connected and already past the hello) connections
+* to one or more servers so batch jobs don't pay for a new connect on every
+* request. Connecting retries with jittered exponential backoff when the
+* server refuses the connection or says it is busy.
+*
+* With several endpoints, new requests go to the endpoint with the fewest
+* requests in flight (either among all of them or the better of two random
+* picks). Endpoints that refuse permission or keep failing to connect are
+* ejected for a while so requests stop going to them.
+*
+* A new connection sends its hello (see otp_header.h) and is handed out
+* straight away; the reply is read by await_grant ahead of the first
+* response, which the request functions do themselves. Whether it still
+* has to be read is kept in the connection's grant, which pool_acquire
+* hands out with it and the caller passes along with the socket until the
+* connection is released. await_grant puts the options the server granted
+* in the endpoint's options bits. When it turns out the server refused the
+* client, the endpoint is ejected as if the connect had been refused and
+* the request functions return POOL_ERR_PERMISSION; the caller releases
+* the connection and runs the request again on the next one pool_acquire
+* hands out, which only fails with POOL_ERR_PERMISSION itself once every
+* endpoint has refused. Only ring connections wait for the reply before
+* they are handed out.
+*
+* A server shard serves one connection at a time, so a warm connection
+* holds a shard for as long as it is open, idle or not, and a new client of
+* that shard waits until it is closed. Idle connections are closed once
+* they have waited POOL_IDLE_MS, well before the server's own idle
+* deadline, whenever the pool is used again or pool_trim is called; a
+* program that keeps a pool through a pause calls pool_trim (or
+* pool_destroy) so it doesn't hold shards it isn't using. pool_prewarm only
+* keeps connections a shard has granted within PREWARM_GRANT_MS, so it
+* never warms more connections than the server has free shards for.
+*
+* Unix socket endpoints ("unix:/path", or "unix:@name" for the abstract
+* namespace) are preferred over TCP ones while they are healthy, so clients
+* on the same host as the servers skip the loopback TCP stack. With
+* shared_memory set, connections to unix socket endpoints ask for a shared
+* memory ring (see otp_ring.h); those are not put back in the pool.
+*
+* With packed set, other connections ask to send the files as packed
+* symbols (see otp_pack.h); compress asks for compressed transfers instead
+* (see otp_lz4.h) and sized for request headers (see otp_header.h). With
+* offer_keys as well, big keys are offered by their hash and only sent to
+* servers that don't hold them already. With multi, packed connections ask
+* to take several documents with one key in a request. The options each
+* endpoint is asked for are kept in its options bits.
+*/
+
+#define POOL_MAX_ENDPOINTS 16
+#define POOL_MAX_IDLE 8
+#define POOL_IDLE_MS 500       // an idle connection kept longer than this is closed, see pool_trim
+#define PREWARM_GRANT_MS 200   // how long pool_prewarm waits for a shard to take a connection
+
+#define RETRY_MAX_ATTEMPTS 6
+#define RETRY_BASE_DELAY_MS 50
+#define RETRY_MAX_DELAY_MS 2000
+
+#define EJECT_BASE_MS 500          // first ejection after a failed connect
+#define EJECT_MAX_MS 30000         // cap for repeated connect failures
+#define EJECT_PERMISSION_MS 30000  // wrong kind of server on that port
+
+#define BALANCE_P2C 0                // power of two random choices
+#define BALANCE_LEAST_OUTSTANDING 1  // scan every endpoint
+
+// return values of pool_acquire when no connection could be handed out
+#define POOL_ERR_CONNECT -1    // every attempt was refused or failed
+#define POOL_ERR_PERMISSION -2 // the server does not accept this client
+
+// announce_request's return when the server holds the key and only the text is sent
+#define ANNOUNCE_KEY_HELD 2
+
+struct endpoint {
+    char host[256];
+    char port[16];
+    struct addrinfo* addrs; // resolved once and kept for the life of the pool
+
+    int local; // unix socket endpoint, uses local_addr instead of addrs
+    struct sockaddr_un local_addr;
+    socklen_t local_len;
+
+    int idle[POOL_MAX_IDLE]; // warm sockets that can be handed out again
+    long idle_since_ms[POOL_MAX_IDLE]; // when each was last released
+    int num_idle;
+
+    int outstanding;     // connections handed out and not released yet
+    int failures;        // consecutive failed connects, grows the ejection time
+    int denied;          // last ejection was because permission was refused
+    long eject_until_ms; // skipped by the balancer until this time
+
+    int options; // CAP_ bits of the options the server agreed to
+};
+
+// the hello reply a connection from pool_acquire may still owe, passed along with its socket
+struct grant {
+    int awaiting;              // the reply is still to be read
+    struct endpoint* endpoint; // where the connection goes, for the options and a refusal
+};
+
+struct conn_pool {
+    int role; // ROLE_ENC or ROLE_DEC, sent in the hello on every new connection
+    struct endpoint endpoints[POOL_MAX_ENDPOINTS];
+    int num_endpoints;
+    int balance; // BALANCE_P2C or BALANCE_LEAST_OUTSTANDING
+    int shared_memory; // ask unix socket endpoints for a shared memory ring
+    int packed;        // ask for packed transfers, the files must only hold the 27 symbols
+    int compress;      // ask for compressed transfers, takes the place of packed
+    int sized;         // announce the sizes of each request upfront
+    int offer_keys;    // offer big keys by their hash first, needs sized
+    int multi;         // ask to send several documents in one packed request
+
+    int max_attempts;
+    int base_delay_ms;
+    int max_delay_ms;
+};
+
+void pool_init(struct conn_pool* pool, int role);
+int pool_add_endpoint(struct conn_pool* pool, const char* host, const char* port);
+int pool_add_local_endpoint(struct conn_pool* pool, const char* path);
+int pool_add_endpoints(struct conn_pool* pool, const char* list, const char* default_host);
+int pool_prewarm(struct conn_pool* pool, int per_endpoint);
+void pool_trim(struct conn_pool* pool);
+int pool_acquire(struct conn_pool* pool, int* endpoint_index, struct grant* grant);
+void pool_release(struct conn_pool* pool, int endpoint_index, int socketFD, int reusable);
+void pool_destroy(struct conn_pool* pool);
+int await_grant(int socketFD, struct grant* grant);
+
+int ring_request(int socketFD, const char* text, const char* key, struct otp_output* out);
+int announce_request(int socketFD, struct grant* grant, int options, uint32_t text_len, const char* key, struct otp_output* out);
+int packed_request(int socketFD, struct grant* grant, const char** texts, int num_texts, const char* key, int send_key, struct otp_output* out);
+int compressed_request(int socketFD, struct grant* grant, const char* text, const char* key, int send_key, int compress_text, struct otp_output* out);
+
+#endif
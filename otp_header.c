@@ -0,0 +1,144 @@
+#include <stdio.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "otp_header.h"
+#include "otp_pack.h"
+#include "otp_lz4.h"
+#include "otp_capture.h"
+#include "otp_socket.h"
+
+static int send_all (int socketFD, const void* data, size_t length) {
+    size_t total = 0;
+
+    while (total < length) {
+        ssize_t sent = send(socketFD, (const char*) data + total, length - total, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent < 0) {
+            return -1;
+        }
+        total += sent;
+    }
+
+    return 0;
+}
+
+static int recv_all (int socketFD, void* buffer, size_t length) {
+    size_t total = 0;
+
+    while (total < length) {
+        ssize_t got = recv(socketFD, (char*) buffer + total, length - total, 0);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            return -1;
+        }
+        capture_received(socketFD, (char*) buffer + total, got);
+        total += got;
+    }
+
+    return 0;
+}
+
+// the options that combine out of the ones asked for, the server grants these
+// less keys when it keeps none
+int settle_options (int options) {
+    // the two transfer formats don't combine, compression wins
+    if (options & CAP_COMPRESS) {
+        options &= ~CAP_PACKED;
+    }
+
+    // several documents to a request only go over packed transfers
+    if (!(options & CAP_PACKED)) {
+        options &= ~CAP_MULTI;
+    }
+
+    // keys are offered in the request header, and only kept in the packed and compressed forms
+    if (!(options & CAP_SIZED) || !(options & (CAP_PACKED | CAP_COMPRESS))) {
+        options &= ~CAP_KEYS;
+    }
+
+    return options;
+}
+
+// the hello is held back (MSG_MORE) to go out along with the first request
+int send_hello (int socketFD, int role, int options) {
+    struct {
+        int length;
+        struct hello hello;
+    } frame = { sizeof(struct hello), { HELLO_MAGIC, HELLO_VERSION, role, options } };
+
+    ssize_t sent = send(socketFD, &frame, sizeof(frame), MSG_NOSIGNAL | MSG_MORE);
+    if (sent < 0 && errno == EINTR) {
+        sent = 0;
+    }
+    if (sent < 0) {
+        return -1;
+    }
+    return send_all(socketFD, (const char*) &frame + sent, sizeof(frame) - sent);
+}
+
+// -1 if the client hung up or the frame is not a hello, the fields are not checked
+int recv_hello (int socketFD, struct hello* hello) {
+    int length;
+
+    if (recv_all(socketFD, &length, sizeof(length)) < 0 || length != sizeof(*hello)) {
+        return -1;
+    }
+    return recv_all(socketFD, hello, sizeof(*hello));
+}
+
+int send_hello_reply (int socketFD, int status, int options) {
+    struct {
+        int length;
+        struct hello_reply reply;
+    } frame = { sizeof(struct hello_reply), { HELLO_MAGIC, status, options } };
+
+    return send_all(socketFD, &frame, sizeof(frame));
+}
+
+// returns the HELLO_ status with the options granted, -1 if the server hung up or
+// the reply is not one
+int recv_hello_reply (int socketFD, int* options) {
+    struct hello_reply reply;
+    int length;
+
+    if (recv_all(socketFD, &length, sizeof(length)) < 0 || length != sizeof(reply)
+    || recv_all(socketFD, &reply, sizeof(reply)) < 0 || reply.magic != HELLO_MAGIC) {
+        return -1;
+    }
+
+    *options = reply.options;
+    return reply.status;
+}
+
+int send_request_header (int socketFD, const struct request_header* header) {
+    return send_frame_all(socketFD, header, sizeof(*header));
+}
+
+// -1 if the client hung up or the frame is not a header
+int recv_request_header (int socketFD, struct request_header* header) {
+    int length;
+
+    if (recv_all(socketFD, &length, sizeof(length)) < 0 || length != sizeof(*header)) {
+        return -1;
+    }
+    return recv_all(socketFD, header, sizeof(*header));
+}
+
+int send_key_hash (int socketFD, uint64_t hash) {
+    return send_frame_all(socketFD, &hash, sizeof(hash));
+}
+
+int recv_key_hash (int socketFD, uint64_t* hash) {
+    int length;
+
+    if (recv_all(socketFD, &length, sizeof(length)) < 0 || length != sizeof(*hash)) {
+        return -1;
+    }
+    return recv_all(socketFD, hash, sizeof(*hash));
+}
@@ -0,0 +1,89 @@
+#ifndef OTP_HEADER_H
+#define OTP_HEADER_H
+
+#include <stdint.h>
+
+/**
+* Hello
+* Every connection starts with a hello frame from the client: a magic
+* number, the protocol version, the client's role and the CAP_ bits of the
+* options it asks for. The client doesn't wait to be let in; its first
+* request goes out right behind the hello, in the same segment when it is
+* small, so a short request costs a single round trip.
+*
+* The server answers each hello with one reply frame ahead of anything
+* else, the options it granted or a refusal (the wrong role, or another
+* version), and hangs up after a refusal without serving the request. Both
+* sides settle the options asked for the same way (settle_options), so the
+* client can frame requests before the grant is back. The only option the
+* server leaves out on its own is keys, when it keeps none; a key offered
+* by hash to such a server is just sent after it.
+*
+* Request header
+* A client that asks for it in the hello starts every request (after
+* dec_client's file count) with a frame holding the size of the text and
+* of the key. The server can then turn down a short key before reading any
+* of the files, and size its buffers exactly.
+*
+* For a big request the client also sets HEADER_EXPECT and waits for a
+* status frame (see otp_pack.h) before sending the files. On an error
+* status the error text follows and the files are never sent. Small
+* requests skip the wait and send the files straight away; the server
+* reads past them when the key is too short.
+*
+* A client granted CAP_KEYS can also set HEADER_KEY_HASH on a request with a
+* big key, and send an 8 byte frame with the xxHash of the key (see
+* otp_cache.h) after the header. If the server still holds that key the
+* status is PACK_STATUS_KEY_HELD and only the text is sent. Only packed and
+* compressed transfers keep keys.
+*/
+
+#define HELLO_MAGIC 0x4f545031 // "OTP1"
+#define HELLO_VERSION 1
+
+#define ROLE_ENC 1 // enc_client, served by enc_server
+#define ROLE_DEC 2 // dec_client, served by dec_server
+
+// status of the reply to a hello
+#define HELLO_GRANTED 0
+#define HELLO_DENIED 1 // wrong role or version, retrying won't help
+#define HELLO_BUSY 2   // worth trying again later
+
+#define CAP_SIZED 8 // the client announces the sizes of each request upfront
+#define CAP_KEYS 16 // the server keeps keys that can then be sent by their hash
+
+#define HEADER_EXPECT 1 // the client waits for a go ahead before sending the files
+#define HEADER_KEY_HASH 2 // a key hash frame follows, only along with HEADER_EXPECT
+#define EXPECT_THRESHOLD 65536 // requests bigger than this wait for the go ahead
+#define KEY_HASH_THRESHOLD 65536 // keys bigger than this are offered by their hash first
+
+struct hello {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t role;
+    uint32_t options;
+};
+
+struct hello_reply {
+    uint32_t magic;
+    uint32_t status;
+    uint32_t options; // the ones granted
+};
+
+struct request_header {
+    uint32_t text_len;
+    uint32_t key_len;
+    uint32_t flags;
+};
+
+int settle_options(int options);
+int send_hello(int socketFD, int role, int options);
+int recv_hello(int socketFD, struct hello* hello);
+int send_hello_reply(int socketFD, int status, int options);
+int recv_hello_reply(int socketFD, int* options);
+int send_request_header(int socketFD, const struct request_header* header);
+int recv_request_header(int socketFD, struct request_header* header);
+int send_key_hash(int socketFD, uint64_t hash);
+int recv_key_hash(int socketFD, uint64_t* hash);
+
+#endif
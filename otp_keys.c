@@ -0,0 +1,161 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/random.h>
+
+#include "otp_keys.h"
+
+static int send_all (int socketFD, const void* data, size_t length) {
+    size_t total = 0;
+
+    while (total < length) {
+        ssize_t sent = send(socketFD, (const char*) data + total, length - total, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent < 0) {
+            return -1;
+        }
+        total += sent;
+    }
+
+    return 0;
+}
+
+static int recv_all (int socketFD, void* buffer, size_t length) {
+    size_t total = 0;
+
+    while (total < length) {
+        ssize_t got = recv(socketFD, (char*) buffer + total, length - total, 0);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            return -1;
+        }
+        total += got;
+    }
+
+    return 0;
+}
+
+// fill buffer from the kernel's generator, -1 if it can't give the bytes
+static int random_bytes(unsigned char* buffer, size_t length) {
+    size_t total = 0;
+
+    while (total < length) {
+        ssize_t got = getrandom(buffer + total, length - total, 0);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got < 0 && errno == ENOSYS) {
+            // a kernel from before getrandom, the same generator is behind /dev/urandom
+            int fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+            got = fd < 0 ? -1 : read(fd, buffer + total, length - total);
+            if (fd >= 0) {
+                close(fd);
+            }
+        }
+        if (got <= 0) {
+            return -1;
+        }
+        total += got;
+    }
+
+    return 0;
+}
+
+// length symbols straight from the kernel's generator, -1 if it failed. a byte only
+// becomes a symbol below 243, the largest multiple of 27 it can hold, so every symbol
+// is equally likely
+int generate_key(char* key, uint32_t length) {
+    static const char alphabet[KEY_ALPHABET_SIZE] = KEY_ALPHABET;
+    unsigned char random[4096];
+    size_t used = sizeof(random);
+
+    for (uint32_t i = 0; i < length; ) {
+        if (used == sizeof(random)) {
+            if (random_bytes(random, sizeof(random)) < 0) {
+                return -1;
+            }
+            used = 0;
+        }
+
+        unsigned char byte = random[used++];
+        if (byte < KEY_ALPHABET_SIZE * (256 / KEY_ALPHABET_SIZE)) {
+            key[i++] = alphabet[byte % KEY_ALPHABET_SIZE];
+        }
+    }
+    return 0;
+}
+
+// a socket path, @name for the abstract namespace, returns -1 if it is too long
+int key_address(const char* path, struct sockaddr_un* address, socklen_t* address_len) {
+    size_t len = strlen(path);
+
+    memset(address, 0, sizeof(*address));
+    if (len == 0 || len >= sizeof(address->sun_path)) {
+        return -1;
+    }
+    address->sun_family = AF_UNIX;
+    memcpy(address->sun_path, path, len);
+
+    *address_len = offsetof(struct sockaddr_un, sun_path) + len + 1;
+    if (path[0] == '@') {
+        address->sun_path[0] = '\0';
+        (*address_len)--;
+    }
+    return 0;
+}
+
+// -1 on a request that doesn't start with the magic, or a closed connection
+int recv_key_request(int socketFD, struct key_request* request) {
+    if (recv_all(socketFD, request, sizeof(*request)) < 0 || request->magic != KEYS_MAGIC) {
+        return -1;
+    }
+    return 0;
+}
+
+// the status, and the key when there is one
+int send_key_reply(int socketFD, int32_t status, const char* key, uint32_t length) {
+    if (send_all(socketFD, &status, sizeof(status)) < 0) {
+        return -1;
+    }
+    if (status == KEY_OK && send_all(socketFD, key, length) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+// ask the service at path for a key of length symbols. 0 with the key filled in,
+// the KEY_ status the service turned the request down with, or -1 if it couldn't be reached
+int fetch_key(const char* path, uint32_t length, char* key) {
+    struct sockaddr_un address;
+    socklen_t address_len;
+    struct key_request request = { KEYS_MAGIC, length };
+    int32_t status = -1;
+
+    if (key_address(path, &address, &address_len) < 0) {
+        return -1;
+    }
+
+    int socketFD = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (socketFD < 0) {
+        return -1;
+    }
+    if (connect(socketFD, (struct sockaddr*) &address, address_len) < 0
+    || send_all(socketFD, &request, sizeof(request)) < 0
+    || recv_all(socketFD, &status, sizeof(status)) < 0
+    || (status == KEY_OK && recv_all(socketFD, key, length) < 0)) {
+        close(socketFD);
+        return -1;
+    }
+
+    close(socketFD);
+    return status;
+}
@@ -0,0 +1,52 @@
+#ifndef OTP_KEYS_H
+#define OTP_KEYS_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/**
+* Key service
+* key_server keeps pools of pads generated ahead of time, one pool per
+* segment length, and refills them in a background thread while it is
+* otherwise idle. A job that needs a key asks the service over a unix
+* socket and gets one straight away instead of running keygen first.
+*
+* A request is a KEYS_MAGIC frame and the number of symbols wanted. The
+* reply is a status and, when it is KEY_OK, exactly that many symbols. The
+* key is cut from a segment of the smallest pool long enough, or made on
+* the spot when that pool is empty; what is left of the segment is thrown
+* away, no part of a pad is ever handed out twice. A connection can make
+* one request after another, and each is served on a thread of its own,
+* so one client never keeps the others waiting.
+*
+* Every pad comes straight from the kernel's generator (getrandom). The
+* service hands pads to many clients, so they can't come from a seeded
+* generator one pad would let a client work out the rest of.
+*
+* keygen -s path fetches a key from the service (fetch_key) and writes it
+* out like one it generated itself.
+*/
+
+#define KEYS_MAGIC 0x4f54504b // "OTPK"
+#define KEY_MAX_LENGTH (1u << 30) // like the other transfers, refuse what could only be an attack
+
+#define KEY_OK 0
+#define KEY_TOO_LONG 1 // more than KEY_MAX_LENGTH
+#define KEY_FAILED 2   // the service couldn't make the key
+
+#define KEY_ALPHABET "ABCDEFGHIJKLMNOPQRSTUVWXYZ "
+#define KEY_ALPHABET_SIZE 27
+
+struct key_request {
+    uint32_t magic;
+    uint32_t length;
+};
+
+int generate_key(char* key, uint32_t length);
+int key_address(const char* path, struct sockaddr_un* address, socklen_t* address_len);
+int recv_key_request(int socketFD, struct key_request* request);
+int send_key_reply(int socketFD, int32_t status, const char* key, uint32_t length);
+int fetch_key(const char* path, uint32_t length, char* key);
+
+#endif
@@ -0,0 +1,363 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+
+#include "otp_async.h"
+#include "otp_client.h"
+#include "otp_header.h"
+#include "otp_lz4.h"
+#include "otp_output.h"
+
+/**
+* Library checks
+* Drives libotpclient.a the way a program embedding it would, for the
+* cases regress.sh can't reach through enc_client and dec_client. Every
+* check makes its own text and key, knows what the server should answer
+* and exits 1 as soon as something else comes back.
+*
+* pool: a pooled client of one enc_server that prewarms, makes a request,
+* leaves its connection idle past POOL_IDLE_MS and makes another. Run two
+* at once against a server with one shard, neither may wait anywhere near
+* the server's idle deadline for the other.
+*
+* async: requests pipelined through otp_async to enc_server, driven from a
+* poll loop on otp_async_fd the way an event loop would. Some have to come
+* back ASYNC_OK with the right ciphertext, one ASYNC_LEN_ERROR and one
+* ASYNC_CHAR_ERROR, each with the offset where the server found it. Each ciphertext is submitted to dec_server from inside
+* its callback and has to come back as the plaintext.
+*
+* limit: packed and then compressed requests to an enc_server run with -m 1,
+* without announcing their sizes, so the server only learns how big they are
+* from the counts in the stream. One over the limit has to be turned down as
+* too big and a small one on the same connection served after it.
+*/
+
+#define TEXT_LENGTH 4000
+#define SLOW_REQUEST_MS 5000 // far below the server's idle deadline, far above a queued request
+#define ASYNC_REQUESTS 8      // pipelined, the last spans several compressed blocks
+#define ASYNC_TIMEOUT_MS 10000
+#define LIMIT_TEXT_LENGTH (600 * 1024) // with its key, over the 1 MB the server is run with
+#define SIZE_ERROR_TEXT "The request is bigger than this server takes!"
+
+// one request through otp_async and what its callback has to see
+struct async_check {
+    char* text;
+    char* key;
+    int expected;   // ASYNC_ status
+    long expected_offset; // where the error is, -1 with ASYNC_OK
+    char* cipher;   // the ciphertext expected with ASYNC_OK
+    int status;     // from the callback, once done
+    long offset;
+    int done;
+    int decrypted;  // the ciphertext came back from dec_server as the text
+    struct otp_async* dec; // where the ciphertext goes to be decrypted
+};
+
+static int callback_failures = 0;
+
+static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ ";
+
+static void usage(const char* name) {
+    fprintf(stderr, "USAGE: %s pool port scratch | async encport decport | limit port scratch\n", name);
+    fprintf(stderr, "  pool port scratch      two requests through a prewarmed pool, with results written to scratch\n");
+    fprintf(stderr, "  async encport decport  requests and errors through otp_async, decrypting what comes back\n");
+    fprintf(stderr, "  limit port scratch     unannounced requests over and under a 1 MB -m limit, packed and compressed\n");
+    exit(1);
+}
+
+static long now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+static void sleep_ms(long ms) {
+    struct timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
+    while (nanosleep(&ts, &ts) < 0);
+}
+
+// length symbols, different for every seed
+static char* make_symbols(uint32_t length, unsigned int seed) {
+    char* text = malloc(length + 1);
+    if (text == NULL) {
+        fprintf(stderr, "otp_libcheck: out of memory\n");
+        exit(1);
+    }
+    for (uint32_t i = 0; i < length; i++) {
+        text[i] = alphabet[rand_r(&seed) % 27];
+    }
+    text[length] = '\0';
+    return text;
+}
+
+// what enc_server makes of text with key
+static char* expected_cipher(const char* text, const char* key) {
+    size_t length = strlen(text);
+    char* cipher = strdup(text);
+
+    for (size_t i = 0; cipher != NULL && i < length; i++) {
+        cipher[i] = alphabet[(strchr(alphabet, text[i]) - alphabet + strchr(alphabet, key[i]) - alphabet) % 27];
+    }
+    return cipher;
+}
+
+// 0 if the file at path holds expected and its newline
+static int check_file(const char* path, const char* expected) {
+    size_t length = strlen(expected);
+    char* got = malloc(length + 2);
+    FILE* file = fopen(path, "r");
+    size_t read = file != NULL && got != NULL ? fread(got, 1, length + 2, file) : 0;
+    int same = read == length + 1 && memcmp(got, expected, length) == 0 && got[length] == '\n';
+
+    if (file != NULL) {
+        fclose(file);
+    }
+    free(got);
+    return same ? 0 : -1;
+}
+
+// one packed or compressed request through the pool, its result written to path
+static int pooled_request(struct conn_pool* pool, const char* text, const char* key, const char* path) {
+    struct otp_output out;
+    int endpoint;
+    struct grant grant;
+
+    int socketFD = pool_acquire(pool, &endpoint, &grant);
+    if (socketFD < 0) {
+        fprintf(stderr, "otp_libcheck: no connection (%d)\n", socketFD);
+        return -1;
+    }
+    if (output_open(&out, path, 0) < 0) {
+        pool_release(pool, endpoint, socketFD, 0);
+        return -1;
+    }
+
+    int options = pool->endpoints[endpoint].options;
+    int status = announce_request(socketFD, &grant, options, strlen(text), key, &out);
+    if (status > 0 && (options & CAP_COMPRESS)) {
+        status = compressed_request(socketFD, &grant, text, key, status != ANNOUNCE_KEY_HELD, 1, &out);
+    } else if (status > 0) {
+        status = packed_request(socketFD, &grant, &text, 1, key, status != ANNOUNCE_KEY_HELD, &out);
+    }
+
+    pool_release(pool, endpoint, socketFD, status >= 0);
+    if (output_close(&out) < 0 || status < 0) {
+        fprintf(stderr, "otp_libcheck: request failed (%d)\n", status);
+        return -1;
+    }
+    return 0;
+}
+
+static int check_pool(const char* port, const char* scratch) {
+    struct conn_pool pool;
+
+    pool_init(&pool, ROLE_ENC);
+    pool.packed = 1;
+    if (pool_add_endpoints(&pool, port, "localhost") <= 0) {
+        fprintf(stderr, "otp_libcheck: bad port %s\n", port);
+        return 1;
+    }
+
+    // more than one shard's worth, only what a shard grants is kept
+    int warmed = pool_prewarm(&pool, 2);
+    printf("pool: %d warm\n", warmed);
+
+    for (int round = 0; round < 2; round++) {
+        char* text = make_symbols(TEXT_LENGTH, getpid() * 2 + round);
+        char* key = make_symbols(TEXT_LENGTH, getpid() * 2 + round + 1000);
+        char* cipher = expected_cipher(text, key);
+
+        long start = now_ms();
+        int failed = pooled_request(&pool, text, key, scratch) < 0 || check_file(scratch, cipher) < 0;
+        long took = now_ms() - start;
+        printf("pool: request %d %s in %ld ms\n", round, failed ? "FAILED" : "ok", took);
+
+        free(text);
+        free(key);
+        free(cipher);
+        if (failed || took > SLOW_REQUEST_MS) {
+            pool_destroy(&pool);
+            return 1;
+        }
+
+        // idle long enough that the connection is closed instead of reused
+        if (round == 0) {
+            sleep_ms(POOL_IDLE_MS + 100);
+        }
+    }
+
+    pool_destroy(&pool);
+    return 0;
+}
+
+// the pool asks for packed or compressed transfers but not for CAP_SIZED, so a request's
+// size is only in its stream. over the limit comes first, the connection has to survive it
+static int check_limit(const char* port, const char* scratch, int compress) {
+    const char* transfer = compress ? "compressed" : "packed";
+    struct conn_pool pool;
+    int failed = 0;
+
+    pool_init(&pool, ROLE_ENC);
+    pool.packed = !compress;
+    pool.compress = compress;
+    pool.sized = 0;
+    if (pool_add_endpoints(&pool, port, "localhost") <= 0) {
+        fprintf(stderr, "otp_libcheck: bad port %s\n", port);
+        return 1;
+    }
+
+    for (int round = 0; round < 2 && !failed; round++) {
+        uint32_t length = round == 0 ? LIMIT_TEXT_LENGTH : TEXT_LENGTH;
+        char* text = make_symbols(length, round);
+        char* key = make_symbols(length, round + 1000);
+        char* cipher = expected_cipher(text, key);
+
+        failed = pooled_request(&pool, text, key, scratch) < 0
+        || check_file(scratch, round == 0 ? SIZE_ERROR_TEXT : cipher) < 0;
+        printf("limit: %s request of %u %s\n", transfer, length, failed ? "FAILED" : "ok");
+
+        free(text);
+        free(key);
+        free(cipher);
+    }
+
+    pool_destroy(&pool);
+    return failed;
+}
+
+static void decrypted(void* arg, int status, const char* result, uint32_t length, long offset) {
+    struct async_check* check = arg;
+
+    check->decrypted = status == ASYNC_OK && length == strlen(check->text) && memcmp(result, check->text, length) == 0;
+}
+
+// the result is only good during the call, so it is checked here and sent on to be decrypted
+static void encrypted(void* arg, int status, const char* result, uint32_t length, long offset) {
+    struct async_check* check = arg;
+
+    check->status = status;
+    check->offset = offset;
+    check->done++;
+    if (status != ASYNC_OK) {
+        return;
+    }
+    if (check->cipher == NULL || length != strlen(check->cipher) || memcmp(result, check->cipher, length) != 0) {
+        callback_failures++;
+        return;
+    }
+
+    // the ciphertext is copied into the request, so result can go when this returns
+    char* cipher = strndup(result, length);
+    if (cipher == NULL || otp_async_submit(check->dec, cipher, check->key, decrypted, check) < 0) {
+        callback_failures++;
+    }
+    free(cipher);
+}
+
+// run both until nothing is outstanding, as an event loop would: wait for either
+// descriptor and let otp_async_poll do what can be done without blocking
+static int run_async(struct otp_async* enc, struct otp_async* dec) {
+    long deadline = now_ms() + ASYNC_TIMEOUT_MS;
+
+    while (otp_async_outstanding(enc) > 0 || otp_async_outstanding(dec) > 0) {
+        struct pollfd pfds[2] = {
+            { otp_async_fd(enc), POLLIN, 0 },
+            { otp_async_fd(dec), POLLIN, 0 }
+        };
+        long left = deadline - now_ms();
+
+        if (left <= 0 || poll(pfds, 2, left) < 0) {
+            return -1;
+        }
+        if (((pfds[0].revents & POLLIN) && otp_async_poll(enc, 0) < 0)
+        || ((pfds[1].revents & POLLIN) && otp_async_poll(dec, 0) < 0)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int check_async(const char* encport, const char* decport) {
+    struct async_check checks[ASYNC_REQUESTS + 2];
+    int num_checks = 0;
+    struct otp_async* enc = otp_async_create(ROLE_ENC);
+    struct otp_async* dec = otp_async_create(ROLE_DEC);
+
+    if (enc == NULL || dec == NULL || otp_async_connect(enc, "localhost", encport, 2) <= 0
+    || otp_async_connect(dec, "localhost", decport, 2) <= 0) {
+        fprintf(stderr, "otp_libcheck: can't connect\n");
+        return 1;
+    }
+
+    memset(checks, 0, sizeof(checks));
+    for (int i = 0; i < ASYNC_REQUESTS; i++) {
+        uint32_t length = i == ASYNC_REQUESTS - 1 ? 3 * LZ4_BLOCKSIZE + 17 : 100 * (i + 1);
+        struct async_check* check = &checks[num_checks++];
+
+        check->text = make_symbols(length, i);
+        check->key = make_symbols(length + i, i + 1000);
+        check->cipher = expected_cipher(check->text, check->key);
+        check->expected = ASYNC_OK;
+        check->expected_offset = -1;
+    }
+
+    // a key shorter than the text, and a text with a char outside the 27
+    struct async_check* short_key = &checks[num_checks++];
+    short_key->text = make_symbols(500, 1);
+    short_key->key = make_symbols(499, 2);
+    short_key->expected = ASYNC_LEN_ERROR;
+    short_key->expected_offset = 499;
+
+    struct async_check* bad_char = &checks[num_checks++];
+    bad_char->text = make_symbols(500, 3);
+    bad_char->text[250] = 'a';
+    bad_char->key = make_symbols(500, 4);
+    bad_char->expected = ASYNC_CHAR_ERROR;
+    bad_char->expected_offset = 250;
+
+    // all of them are in flight before any is answered
+    for (int i = 0; i < num_checks; i++) {
+        checks[i].dec = dec;
+        if (otp_async_submit(enc, checks[i].text, checks[i].key, encrypted, &checks[i]) < 0) {
+            fprintf(stderr, "otp_libcheck: submit %d failed\n", i);
+            return 1;
+        }
+    }
+    printf("async: %d submitted, %d outstanding\n", num_checks, otp_async_outstanding(enc));
+
+    int failed = run_async(enc, dec) < 0 || callback_failures > 0;
+    for (int i = 0; i < num_checks; i++) {
+        struct async_check* check = &checks[i];
+        int ok = check->done == 1 && check->status == check->expected && check->offset == check->expected_offset
+        && (check->expected != ASYNC_OK || check->decrypted);
+
+        printf("async: request %d of %zu status %d at %ld (wanted %d at %ld)%s %s\n", i, strlen(check->text), check->status, check->offset,
+        check->expected, check->expected_offset, check->decrypted ? " decrypted" : "", ok ? "ok" : "FAILED");
+        failed |= !ok;
+
+        free(check->text);
+        free(check->key);
+        free(check->cipher);
+    }
+
+    otp_async_destroy(enc);
+    otp_async_destroy(dec);
+    return failed;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc == 4 && strcmp(argv[1], "pool") == 0) {
+        return check_pool(argv[2], argv[3]);
+    }
+    if (argc == 4 && strcmp(argv[1], "async") == 0) {
+        return check_async(argv[2], argv[3]);
+    }
+    if (argc == 4 && strcmp(argv[1], "limit") == 0) {
+        return check_limit(argv[2], argv[3], 0) || check_limit(argv[2], argv[3], 1);
+    }
+    usage(argv[0]);
+    return 1;
+}
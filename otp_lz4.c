@@ -0,0 +1,335 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "otp_lz4.h"
+#include "otp_buffer.h"
+#include "otp_capture.h"
+#include "otp_socket.h"
+
+#define HASH_BITS 12
+#define MIN_MATCH 4
+#define LAST_LITERALS 5 // the format ends every block with at least this many literals
+#define MATCH_LIMIT 12  // and no match starts this close to the end
+#define MAX_OFFSET 65535
+
+static uint32_t read32 (const char* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static int hash4 (uint32_t v) {
+    return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+// lengths of 15 and up carry on in extra bytes of 255 until one is smaller
+static int put_length (char* dst, int out, int length) {
+    while (length >= 255) {
+        dst[out++] = (char) 255;
+        length -= 255;
+    }
+    dst[out++] = length;
+    return out;
+}
+
+// one sequence: literals, then a match of match_len bytes (0 for the last sequence)
+// returns the new output size or -1 if it does not fit
+static int put_sequence (char* dst, int out, int capacity, const char* literals, int lit_len, int offset, int match_len) {
+    if ((long) out + 1 + lit_len / 255 + 1 + lit_len + 2 + match_len / 255 + 1 > capacity) {
+        return -1;
+    }
+
+    int token = out++;
+    dst[token] = (lit_len >= 15 ? 15 : lit_len) << 4;
+    if (lit_len >= 15) {
+        out = put_length(dst, out, lit_len - 15);
+    }
+    memcpy(dst + out, literals, lit_len);
+    out += lit_len;
+
+    if (match_len == 0) {
+        return out;
+    }
+
+    dst[out++] = offset & 0xff;
+    dst[out++] = offset >> 8;
+    match_len -= MIN_MATCH;
+    dst[token] |= match_len >= 15 ? 15 : match_len;
+    if (match_len >= 15) {
+        out = put_length(dst, out, match_len - 15);
+    }
+
+    return out;
+}
+
+// returns the compressed size, or 0 if it would not be smaller than capacity
+int lz4_compress (const char* src, int length, char* dst, int capacity) {
+    int table[1 << HASH_BITS];
+    int anchor = 0;
+    int out = 0;
+
+    memset(table, 0xff, sizeof(table));
+
+    for (int pos = 0; pos < length - MATCH_LIMIT;) {
+        uint32_t seq = read32(src + pos);
+        int h = hash4(seq);
+        int ref = table[h];
+        table[h] = pos;
+
+        if (ref < 0 || pos - ref > MAX_OFFSET || read32(src + ref) != seq) {
+            pos++;
+            continue;
+        }
+
+        int match_len = MIN_MATCH;
+        while (pos + match_len < length - LAST_LITERALS && src[ref + match_len] == src[pos + match_len]) {
+            match_len++;
+        }
+
+        out = put_sequence(dst, out, capacity, src + anchor, pos - anchor, pos - ref, match_len);
+        if (out < 0) {
+            return 0;
+        }
+
+        pos += match_len;
+        anchor = pos;
+    }
+
+    out = put_sequence(dst, out, capacity, src + anchor, length - anchor, 0, 0);
+    return out < 0 ? 0 : out;
+}
+
+// returns the decoded size, or -1 for a block that is corrupt or too big for dst
+int lz4_decompress (const char* src, int length, char* dst, int capacity) {
+    const uint8_t* in = (const uint8_t*) src;
+    int pos = 0;
+    int out = 0;
+
+    while (pos < length) {
+        int token = in[pos++];
+
+        int lit_len = token >> 4;
+        if (lit_len == 15) {
+            int b;
+            do {
+                if (pos >= length || lit_len > capacity) {
+                    return -1;
+                }
+                b = in[pos++];
+                lit_len += b;
+            } while (b == 255);
+        }
+
+        if (lit_len > length - pos || lit_len > capacity - out) {
+            return -1;
+        }
+        memcpy(dst + out, src + pos, lit_len);
+        pos += lit_len;
+        out += lit_len;
+
+        // the last sequence has no match
+        if (pos == length) {
+            break;
+        }
+
+        if (length - pos < 2) {
+            return -1;
+        }
+        int offset = in[pos] | in[pos + 1] << 8;
+        pos += 2;
+        if (offset == 0 || offset > out) {
+            return -1;
+        }
+
+        int match_len = token & 15;
+        if (match_len == 15) {
+            int b;
+            do {
+                if (pos >= length || match_len > capacity) {
+                    return -1;
+                }
+                b = in[pos++];
+                match_len += b;
+            } while (b == 255);
+        }
+        match_len += MIN_MATCH;
+
+        if (match_len > capacity - out) {
+            return -1;
+        }
+
+        // a match can overlap the bytes it is producing, so copy forwards one at a time
+        for (int i = 0; i < match_len; i++) {
+            dst[out + i] = dst[out - offset + i];
+        }
+        out += match_len;
+    }
+
+    return out;
+}
+
+static int recv_all (int socketFD, void* buffer, size_t length) {
+    size_t total = 0;
+
+    while (total < length) {
+        ssize_t got = recv(socketFD, (char*) buffer + total, length - total, 0);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            return -1;
+        }
+        capture_received(socketFD, (char*) buffer + total, got);
+        total += got;
+    }
+
+    return 0;
+}
+
+// the length, then each block compressed if asked to and if that makes it smaller
+int send_blocks (int socketFD, const char* data, uint32_t length, int compress) {
+    char* block = malloc(4 + LZ4_BOUND(LZ4_BLOCKSIZE));
+
+    if (block == NULL) {
+        return -1;
+    }
+
+    if (send_frame_all(socketFD, &length, sizeof(length)) < 0) {
+        free(block);
+        return -1;
+    }
+
+    for (uint32_t sent = 0; sent < length; sent += LZ4_BLOCKSIZE) {
+        int size = length - sent < LZ4_BLOCKSIZE ? length - sent : LZ4_BLOCKSIZE;
+        uint32_t header = size;
+        int packed = compress ? lz4_compress(data + sent, size, block + 4, size) : 0;
+
+        if (packed == 0) {
+            header |= LZ4_STORED;
+            memcpy(block + 4, data + sent, size);
+            packed = size;
+        }
+        memcpy(block, &header, sizeof(header));
+
+        if (send_frame_all(socketFD, block, 4 + packed) < 0) {
+            free(block);
+            return -1;
+        }
+    }
+
+    free(block);
+    return 0;
+}
+
+// the length frame at the start of a stream, -1 (with length 0) if the connection
+// closed or the length could only be an attack
+static int recv_length (int socketFD, uint32_t* length) {
+    int frame;
+
+    if (recv_all(socketFD, &frame, sizeof(frame)) < 0 || frame != sizeof(*length)
+    || recv_all(socketFD, length, sizeof(*length)) < 0 || *length > LZ4_MAX_LENGTH) {
+        *length = 0;
+        return -1;
+    }
+    return 0;
+}
+
+// decode every block of a stream of length bytes, after its length frame, into data
+// when it is kept or else each into the same block sized buffer, calling consume on
+// each block as it is decoded (consume returning 0 stops the calls but the stream is
+// still read). returns the data, or NULL if the connection closed or the stream is corrupt
+static char* read_blocks (int socketFD, uint32_t length, int keep, int (*consume)(char* block, int length, uint32_t offset, void* arg), void* arg) {
+    int frame;
+
+    char* data = buffer_alloc(keep ? length + 1 : LZ4_BLOCKSIZE + 1);
+    char* block = malloc(4 + LZ4_BOUND(LZ4_BLOCKSIZE));
+    if (data == NULL || block == NULL) {
+        buffer_free(data);
+        free(block);
+        return NULL;
+    }
+
+    uint32_t got = 0;
+    while (got < length) {
+        uint32_t header;
+        int size;
+        char* out = keep ? data + got : data;
+
+        if (recv_all(socketFD, &frame, sizeof(frame)) < 0
+        || frame < 4 || frame > 4 + LZ4_BOUND(LZ4_BLOCKSIZE)
+        || recv_all(socketFD, block, frame) < 0) {
+            break;
+        }
+        memcpy(&header, block, sizeof(header));
+
+        // every block but the last is full, so the expected size is known
+        uint32_t expected = length - got < LZ4_BLOCKSIZE ? length - got : LZ4_BLOCKSIZE;
+        if ((header & ~LZ4_STORED) != expected) {
+            break;
+        }
+
+        if (header & LZ4_STORED) {
+            size = frame - 4 == expected ? (int) expected : -1;
+            if (size > 0) {
+                memcpy(out, block + 4, size);
+            }
+        } else {
+            size = lz4_decompress(block + 4, frame - 4, out, expected);
+        }
+        if (size != (int) expected) {
+            break;
+        }
+
+        if (consume != NULL && !consume(out, size, got, arg)) {
+            consume = NULL;
+        }
+        got += size;
+    }
+
+    free(block);
+    if (got < length) {
+        buffer_free(data);
+        return NULL;
+    }
+    data[keep ? length : 0] = '\0';
+
+    return data;
+}
+
+// read a stream into one nul terminated buffer, NULL if the connection closed, the stream
+// is corrupt or its length is over max_length. nothing is allocated for a length over
+// max_length, its blocks are left for skip_blocks
+char* recv_blocks (int socketFD, uint32_t* length, uint32_t max_length, int (*consume)(char* block, int length, uint32_t offset, void* arg), void* arg) {
+    if (recv_length(socketFD, length) < 0 || *length > max_length) {
+        return NULL;
+    }
+    return read_blocks(socketFD, *length, 1, consume, arg);
+}
+
+// hand each block of a stream to consume without keeping any of it, -1 if the connection
+// closed or the stream is corrupt
+int stream_blocks (int socketFD, uint32_t* length, int (*consume)(char* block, int length, uint32_t offset, void* arg), void* arg) {
+    char* scratch = recv_length(socketFD, length) < 0 ? NULL : read_blocks(socketFD, *length, 0, consume, arg);
+    if (scratch == NULL) {
+        return -1;
+    }
+
+    buffer_free(scratch);
+    return 0;
+}
+
+// read past the blocks of a stream of length bytes, whose length frame has been read
+// -1 if the connection closed or the stream is corrupt
+int skip_blocks (int socketFD, uint32_t length) {
+    char* scratch = read_blocks(socketFD, length, 0, NULL, NULL);
+    if (scratch == NULL) {
+        return -1;
+    }
+
+    buffer_free(scratch);
+    return 0;
+}
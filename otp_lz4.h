@@ -0,0 +1,45 @@
+#ifndef OTP_LZ4_H
+#define OTP_LZ4_H
+
+#include <stdint.h>
+
+/**
+* Compressed transfers
+* English plaintext compresses well, so a client can ask in the hello
+* for the plaintext to be sent compressed. Blocks use the LZ4 block format
+* (a small, fast LZ77 with no entropy coding), built in here so the
+* programs don't need an extra library.
+*
+* A stream is a 4 byte length frame followed by one frame per block of at
+* most LZ4_BLOCKSIZE bytes. Each block frame starts with a 4 byte header,
+* the decoded size with LZ4_STORED set when the block did not shrink and is
+* sent as is. The receiver hands every block on as soon as it is decoded,
+* so the server ciphers the text while the rest of it is still arriving.
+*
+* A compressed request sends the key first (never compressed, it is
+* random) and then the text. The reply is a status frame (see otp_pack.h)
+* then the result as a stream, compressed only when it is plaintext.
+*
+* recv_blocks returns a payload buffer (see otp_buffer.h), it goes back
+* with buffer_free. Like recv_packed it refuses a length over the most the
+* caller will hold before allocating, skip_blocks then reads past the stream.
+*/
+
+#define LZ4_BLOCKSIZE 65536
+#define LZ4_STORED 0x80000000u
+#define LZ4_MAX_LENGTH (1u << 30) // refuse streams that could only be an attack
+
+#define CAP_COMPRESS 4 // asked for in the hello (see otp_header.h) for compressed transfers
+
+// room for a block that does not compress, plus its header
+#define LZ4_BOUND(length) ((length) + (length) / 255 + 16)
+
+int lz4_compress(const char* src, int length, char* dst, int capacity);
+int lz4_decompress(const char* src, int length, char* dst, int capacity);
+
+int send_blocks(int socketFD, const char* data, uint32_t length, int compress);
+char* recv_blocks(int socketFD, uint32_t* length, uint32_t max_length, int (*consume)(char* block, int length, uint32_t offset, void* arg), void* arg);
+int stream_blocks(int socketFD, uint32_t* length, int (*consume)(char* block, int length, uint32_t offset, void* arg), void* arg);
+int skip_blocks(int socketFD, uint32_t length);
+
+#endif
@@ -0,0 +1,125 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "otp_output.h"
+
+static int setup_buffer(struct otp_output* out) {
+    void* buffer;
+
+    if (posix_memalign(&buffer, OUTPUT_ALIGN, OUTPUT_BUFFERSIZE) != 0) {
+        return -1;
+    }
+    out->buffer = buffer;
+    out->used = 0;
+    out->failed = 0;
+    return 0;
+}
+
+int output_open(struct otp_output* out, const char* path, int direct) {
+    memset(out, 0, sizeof(*out));
+
+    out->fd = -1;
+    out->error_at = -1;
+    if (direct) {
+        out->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+        out->direct = out->fd >= 0;
+    }
+
+    // tmpfs and some others don't do O_DIRECT
+    if (out->fd < 0) {
+        out->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    }
+    if (out->fd < 0) {
+        return -1;
+    }
+    out->owned = 1;
+
+    if (setup_buffer(out) < 0) {
+        close(out->fd);
+        return -1;
+    }
+    return 0;
+}
+
+int output_stdout(struct otp_output* out) {
+    memset(out, 0, sizeof(*out));
+    out->fd = STDOUT_FILENO;
+    out->error_at = -1;
+
+    // anything printf left in stdio's buffer goes first
+    fflush(stdout);
+    return setup_buffer(out);
+}
+
+static int write_all(struct otp_output* out, const char* data, size_t length) {
+    while (length > 0) {
+        ssize_t written = write(out->fd, data, length);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            out->failed = 1;
+            return -1;
+        }
+        data += written;
+        length -= written;
+    }
+    return 0;
+}
+
+// write out everything buffered, a full buffer keeps the O_DIRECT alignment
+static int flush_buffer(struct otp_output* out) {
+    int status = write_all(out, out->buffer, out->used);
+    out->used = 0;
+    return status;
+}
+
+int output_write(struct otp_output* out, const void* data, size_t length) {
+    const char* p = data;
+
+    if (out->failed) {
+        return -1;
+    }
+
+    while (length > 0) {
+        size_t take = OUTPUT_BUFFERSIZE - out->used < length ? OUTPUT_BUFFERSIZE - out->used : length;
+        memcpy(out->buffer + out->used, p, take);
+        out->used += take;
+        p += take;
+        length -= take;
+
+        if (out->used == OUTPUT_BUFFERSIZE && flush_buffer(out) < 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int output_puts(struct otp_output* out, const char* text) {
+    return output_write(out, text, strlen(text));
+}
+
+// write the tail and let go of the file, returns -1 if any of it could not be written
+int output_close(struct otp_output* out) {
+    // the tail is rarely a whole number of blocks, so it goes through the page cache
+    if (out->direct && out->used > 0) {
+        fcntl(out->fd, F_SETFL, fcntl(out->fd, F_GETFL) & ~O_DIRECT);
+    }
+    if (out->used > 0 && !out->failed) {
+        flush_buffer(out);
+    }
+
+    free(out->buffer);
+    out->buffer = NULL;
+
+    if (out->owned && close(out->fd) < 0) {
+        out->failed = 1;
+    }
+    return out->failed ? -1 : 0;
+}
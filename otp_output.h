@@ -0,0 +1,41 @@
+#ifndef OTP_OUTPUT_H
+#define OTP_OUTPUT_H
+
+#include <stddef.h>
+
+/**
+* Client output
+* Results are written out block by block as they come off the socket, so
+* a client never holds a whole result in memory. Writes are gathered in an
+* aligned buffer and go to the file OUTPUT_BUFFERSIZE bytes at a time.
+*
+* Opened with direct set, a file is written with O_DIRECT (skipping the
+* page cache, for results much bigger than memory). Every full buffer is
+* aligned in memory, size and offset like O_DIRECT needs; the tail left at
+* the end is written after turning O_DIRECT off again. Filesystems that
+* refuse O_DIRECT get normal writes.
+*
+* An error the server sends back is written out as its text; error_at
+* keeps the offset its status frame gave (see otp_pack.h).
+*/
+
+#define OUTPUT_BUFFERSIZE (1024 * 1024)
+#define OUTPUT_ALIGN 4096
+
+struct otp_output {
+    int fd;
+    int owned;  // opened here, so closed here
+    int direct; // writing with O_DIRECT
+    char* buffer;
+    size_t used;
+    int failed; // a write went wrong, the rest is dropped
+    long error_at; // where the server said the last error it sent was, -1 if none
+};
+
+int output_open(struct otp_output* out, const char* path, int direct);
+int output_stdout(struct otp_output* out);
+int output_write(struct otp_output* out, const void* data, size_t length);
+int output_puts(struct otp_output* out, const char* text);
+int output_close(struct otp_output* out);
+
+#endif
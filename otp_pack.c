@@ -0,0 +1,366 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "otp_pack.h"
+#include "otp_buffer.h"
+#include "otp_capture.h"
+#include "otp_socket.h"
+
+#define LANES_ONE 0x0101010101010101ULL
+#define LANES_HIGH 0x8080808080808080ULL
+#define LANES_TOO_BIG (LANES_ONE * (128 - 27)) // pushes lanes >= 27 into the high bit
+
+// 32 entries so any 5 bit value can be looked up, the last ones are never valid
+static const char alphabet[33] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ ?????";
+
+static int symbol_of (char c) {
+    if (c == ' ') {
+        return 26;
+    }
+    if (c >= 'A' && c <= 'Z') {
+        return c - 'A';
+    }
+    return -1;
+}
+
+// 8 five bit fields (40 bits) -> 8 byte lanes, all shifts happen on the whole word
+static uint64_t spread (uint64_t w) {
+    w = (w & 0xFFFFFULL) | ((w >> 20) << 32);
+    w = (w & 0x000003FF000003FFULL) | ((w & 0x000FFC00000FFC00ULL) << 6);
+    w = (w & 0x001F001F001F001FULL) | ((w & 0x03E003E003E003E0ULL) << 3);
+    return w;
+}
+
+// 8 byte lanes (each below 32) -> 8 five bit fields in the low 40 bits
+static uint64_t squeeze (uint64_t v) {
+    v = (v & 0x001F001F001F001FULL) | ((v & 0x1F001F001F001F00ULL) >> 3);
+    v = (v & 0x000003FF000003FFULL) | ((v & 0x03FF000003FF0000ULL) >> 6);
+    v = (v & 0xFFFFFULL) | ((v >> 32) << 20);
+    return v;
+}
+
+static uint64_t load_block (const uint8_t* p, int nbytes) {
+    uint64_t w = 0;
+    for (int b = 0; b < nbytes; b++) {
+        w |= (uint64_t) p[b] << (8 * b);
+    }
+    return w;
+}
+
+static void store_block (uint8_t* p, int nbytes, uint64_t w) {
+    for (int b = 0; b < nbytes; b++) {
+        p[b] = w >> (8 * b);
+    }
+}
+
+// bytes of block i that belong to a string of count symbols
+static int block_bytes (uint32_t count, uint32_t block) {
+    uint64_t left = PACKED_BYTES(count) - (uint64_t) block * 5;
+    return left < 5 ? left : 5;
+}
+
+// lanes of the last block that hold real symbols
+static uint64_t lane_mask (uint32_t count, uint32_t block) {
+    uint32_t left = count - block * 8;
+    return left >= 8 ? ~0ULL : (1ULL << (8 * left)) - 1;
+}
+
+// pack count chars of text, returns -1 if there is a char outside the alphabet
+// with packed NULL the text is only checked
+int pack_text (const char* text, uint32_t count, uint8_t* packed) {
+    uint32_t blocks = (count + 7) / 8;
+
+    for (uint32_t i = 0; i < blocks; i++) {
+        uint64_t lanes = 0;
+
+        for (uint32_t j = 0; j < 8 && i * 8 + j < count; j++) {
+            int value = symbol_of(text[i * 8 + j]);
+            if (value < 0) {
+                return -1;
+            }
+            lanes |= (uint64_t) value << (8 * j);
+        }
+
+        if (packed != NULL) {
+            store_block(packed + i * 5, block_bytes(count, i), squeeze(lanes));
+        }
+    }
+
+    return 0;
+}
+
+void unpack_text (const uint8_t* packed, uint32_t count, char* text) {
+    uint32_t blocks = (count + 7) / 8;
+
+    for (uint32_t i = 0; i < blocks; i++) {
+        uint64_t lanes = spread(load_block(packed + i * 5, block_bytes(count, i)));
+
+        for (uint32_t j = 0; j < 8 && i * 8 + j < count; j++) {
+            text[i * 8 + j] = alphabet[(lanes >> (8 * j)) & 0x1F];
+        }
+    }
+}
+
+// cipher packed text in place with a packed key, 8 symbols per step
+// returns -1 when done, or the position of the first symbol that isn't valid
+long cipher_packed (uint8_t* text, const uint8_t* key, uint32_t count, int decrypt) {
+    uint32_t blocks = (count + 7) / 8;
+
+    for (uint32_t i = 0; i < blocks; i++) {
+        int nbytes = block_bytes(count, i);
+        uint64_t mask = lane_mask(count, i);
+        uint64_t t = spread(load_block(text + i * 5, nbytes)) & mask;
+        uint64_t k = spread(load_block(key + i * 5, nbytes)) & mask;
+
+        // a lane of 27 or more is a corrupt file, not a symbol
+        uint64_t bad = ((t + LANES_TOO_BIG) | (k + LANES_TOO_BIG)) & LANES_HIGH & mask;
+        if (bad != 0) {
+            return (long) i * 8 + __builtin_ctzll(bad) / 8;
+        }
+
+        // lanes never carry into each other: sums are at most 53
+        uint64_t sum = decrypt ? t + LANES_ONE * 27 - k : t + k;
+        uint64_t wrap = ((sum + LANES_TOO_BIG) & LANES_HIGH) >> 7;
+        sum = (sum - wrap * 27) & mask;
+
+        store_block(text + i * 5, nbytes, squeeze(sum));
+    }
+
+    return -1;
+}
+
+// copy count symbols starting at symbol first of a packed string of total symbols into
+// out, repacked so they start on a block boundary. the symbols are one little endian
+// bit stream, so each block of out is the 40 bits found 5 * first bits further on
+void slice_packed (const uint8_t* packed, uint32_t total, uint32_t first, uint32_t count, uint8_t* out) {
+    uint64_t size = PACKED_BYTES(total);
+    uint32_t blocks = (count + 7) / 8;
+
+    for (uint32_t i = 0; i < blocks; i++) {
+        uint64_t bit = ((uint64_t) first + (uint64_t) i * 8) * 5;
+        uint64_t byte = bit / 8;
+        int nbytes = size - byte < 6 ? size - byte : 6;
+
+        uint64_t w = load_block(packed + byte, nbytes) >> (bit % 8);
+        store_block(out + i * 5, block_bytes(count, i), w & 0xFFFFFFFFFFULL);
+    }
+}
+
+int is_packed_file (const char* content, long size) {
+    return size >= PACK_HEADER_SIZE && memcmp(content, PACK_MAGIC, 4) == 0;
+}
+
+// turn a packed file back into a plain string, NULL if it is cut short
+char* unpack_file (const char* content, long size) {
+    const uint8_t* header = (const uint8_t*) content + 4;
+    uint32_t count = header[0] | header[1] << 8 | header[2] << 16 | (uint32_t) header[3] << 24;
+
+    if (count > PACK_MAX_SYMBOLS || size - PACK_HEADER_SIZE < (long) PACKED_BYTES(count)) {
+        return NULL;
+    }
+
+    char* text = malloc(count + 1);
+    if (text == NULL) {
+        return NULL;
+    }
+    unpack_text((const uint8_t*) content + PACK_HEADER_SIZE, count, text);
+    text[count] = '\0';
+
+    return text;
+}
+
+int write_packed_file (FILE* out, const uint8_t* packed, uint32_t count) {
+    uint8_t header[PACK_HEADER_SIZE] = { 'O', 'T', 'P', '5', count, count >> 8, count >> 16, count >> 24 };
+
+    if (fwrite(header, 1, sizeof(header), out) != sizeof(header)) {
+        return -1;
+    }
+    if (fwrite(packed, 1, PACKED_BYTES(count), out) != PACKED_BYTES(count)) {
+        return -1;
+    }
+    return 0;
+}
+
+static int recv_all (int socketFD, void* buffer, size_t length) {
+    size_t total = 0;
+
+    while (total < length) {
+        ssize_t got = recv(socketFD, (char*) buffer + total, length - total, 0);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            return -1;
+        }
+        capture_received(socketFD, (char*) buffer + total, got);
+        total += got;
+    }
+
+    return 0;
+}
+
+// the symbol count, then the packed bytes in frames of up to PACK_CHUNKSIZE
+int send_packed (int socketFD, const uint8_t* packed, uint32_t count) {
+    uint64_t total = PACKED_BYTES(count);
+
+    if (send_frame_all(socketFD, &count, sizeof(count)) < 0) {
+        return -1;
+    }
+
+    for (uint64_t sent = 0; sent < total; sent += PACK_CHUNKSIZE) {
+        int length = total - sent < PACK_CHUNKSIZE ? total - sent : PACK_CHUNKSIZE;
+        if (send_frame_all(socketFD, packed + sent, length) < 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// NULL if the connection closed, the frames don't add up or the count is over max_count.
+// nothing is allocated for a count over max_count, its frames are left for skip_packed
+uint8_t* recv_packed (int socketFD, uint32_t* count, uint32_t max_count) {
+    int length;
+
+    *count = 0;
+    if (recv_all(socketFD, &length, sizeof(length)) < 0 || length != sizeof(*count)
+    || recv_all(socketFD, count, sizeof(*count)) < 0) {
+        *count = 0;
+        return NULL;
+    }
+    if (*count > max_count || *count > PACK_MAX_SYMBOLS) {
+        return NULL;
+    }
+
+    uint64_t total = PACKED_BYTES(*count);
+    uint8_t* packed = buffer_alloc(total + 1);
+    if (packed == NULL) {
+        return NULL;
+    }
+
+    for (uint64_t got = 0; got < total; got += length) {
+        if (recv_all(socketFD, &length, sizeof(length)) < 0
+        || length <= 0 || length > PACK_CHUNKSIZE || length > total - got
+        || recv_all(socketFD, packed + got, length) < 0) {
+            buffer_free(packed);
+            return NULL;
+        }
+    }
+
+    return packed;
+}
+
+// read past the frames of count packed symbols, whose count frame has been read
+// -1 if the connection closed or the frames don't add up
+int skip_packed (int socketFD, uint32_t count) {
+    uint64_t total = PACKED_BYTES(count);
+    uint8_t* scratch = malloc(PACK_CHUNKSIZE);
+    int length;
+
+    if (scratch == NULL || count > PACK_MAX_SYMBOLS) {
+        free(scratch);
+        return -1;
+    }
+
+    for (uint64_t got = 0; got < total; got += length) {
+        if (recv_all(socketFD, &length, sizeof(length)) < 0
+        || length <= 0 || length > PACK_CHUNKSIZE || length > total - got
+        || recv_all(socketFD, scratch, length) < 0) {
+            free(scratch);
+            return -1;
+        }
+    }
+
+    free(scratch);
+    return 0;
+}
+
+// unpack a packed stream as its frames arrive and hand the text on a frame at a time,
+// without keeping the whole of it (consume returning 0 stops the calls but the stream
+// is still read). -1 if the connection closed or the frames don't add up
+int stream_packed (int socketFD, uint32_t* count, int (*consume)(const char* text, uint32_t length, void* arg), void* arg) {
+    int length;
+
+    if (recv_all(socketFD, &length, sizeof(length)) < 0 || length != sizeof(*count)
+    || recv_all(socketFD, count, sizeof(*count)) < 0 || *count > PACK_MAX_SYMBOLS) {
+        return -1;
+    }
+
+    // a frame doesn't split evenly into 5 byte blocks, so the start of a block
+    // cut off at the end of one frame waits in front of the next
+    uint64_t total = PACKED_BYTES(*count);
+    uint8_t* packed = malloc(PACK_CHUNKSIZE + 5);
+    char* text = malloc((PACK_CHUNKSIZE + 5) / 5 * 8 + 8);
+    uint32_t done = 0;
+    int carried = 0;
+    int status = 0;
+
+    if (packed == NULL || text == NULL) {
+        status = -1;
+    }
+
+    for (uint64_t got = 0; status == 0 && got < total; got += length) {
+        if (recv_all(socketFD, &length, sizeof(length)) < 0
+        || length <= 0 || length > PACK_CHUNKSIZE || length > total - got
+        || recv_all(socketFD, packed + carried, length) < 0) {
+            status = -1;
+            break;
+        }
+
+        // the last frame finishes off the count, the others give whole blocks
+        int have = carried + length;
+        int used = got + length == total ? have : have / 5 * 5;
+        uint32_t symbols = got + length == total ? *count - done : (uint32_t) used / 5 * 8;
+
+        unpack_text(packed, symbols, text);
+        if (consume != NULL && !consume(text, symbols, arg)) {
+            consume = NULL;
+        }
+        done += symbols;
+
+        carried = have - used;
+        memmove(packed, packed + used, carried);
+    }
+
+    free(packed);
+    free(text);
+    return status;
+}
+
+int send_status (int socketFD, int32_t status) {
+    return send_frame_all(socketFD, &status, sizeof(status));
+}
+
+// an error status, with where in the request the server found the error
+int send_status_at (int socketFD, int32_t status, int64_t offset) {
+    char frame[STATUS_AT_SIZE];
+
+    memcpy(frame, &status, sizeof(status));
+    memcpy(frame + sizeof(status), &offset, sizeof(offset));
+    return send_frame_all(socketFD, frame, sizeof(frame));
+}
+
+// either kind of status frame, offset (when not NULL) is -1 if the status didn't say where
+int recv_status (int socketFD, int32_t* status, int64_t* offset) {
+    char frame[STATUS_AT_SIZE];
+    int64_t at = -1;
+    int length;
+
+    if (recv_all(socketFD, &length, sizeof(length)) < 0 || (length != sizeof(*status) && length != STATUS_AT_SIZE)
+    || recv_all(socketFD, frame, length) < 0) {
+        return -1;
+    }
+
+    memcpy(status, frame, sizeof(*status));
+    if (length == STATUS_AT_SIZE) {
+        memcpy(&at, frame + sizeof(*status), sizeof(at));
+    }
+    if (offset != NULL) {
+        *offset = at;
+    }
+    return 0;
+}
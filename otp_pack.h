@@ -0,0 +1,70 @@
+#ifndef OTP_PACK_H
+#define OTP_PACK_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/**
+* Packed encoding
+* The 27 symbols (A-Z and space) fit in 5 bits, so 8 symbols pack into 5
+* bytes instead of 8. Packing, unpacking and the cipher work on a block of
+* 8 symbols at a time inside one 64 bit word (one symbol per byte lane), so
+* the cipher runs on packed data without ever going back to ASCII.
+*
+* At rest a packed file is PACK_MAGIC, the symbol count as 4 little endian
+* bytes, then the packed symbols. On the wire, a client that asks for it in
+* the hello sends each file as a 4 byte count frame followed by frames
+* of packed bytes, and gets back a status frame and then the packed result
+* (or the error text, chunked like before). An error status frame also
+* holds, after the status, the 8 byte offset where the server found the
+* error: the first bad char, where the key ran out, or the byte limit for
+* a request that is too big.
+*
+* A client granted CAP_MULTI can send several documents in one request, all
+* ciphered with one key: the file count frame (documents plus the key)
+* comes first, then each document and the key. Each document uses the part
+* of the key after the one before it, and gets its own status and result
+* in the reply, in order.
+*
+* recv_packed returns a payload buffer (see otp_buffer.h), it goes back
+* with buffer_free. It refuses a count over the most the caller will hold
+* before allocating anything, skip_packed then reads past the frames.
+*/
+
+#define PACK_MAGIC "OTP5"
+#define PACK_HEADER_SIZE 8
+#define PACK_CHUNKSIZE 65536
+#define PACK_MAX_SYMBOLS (1u << 30) // refuse counts that could only be an attack
+
+#define CAP_PACKED 2 // asked for in the hello (see otp_header.h) for packed transfers
+#define CAP_MULTI 32 // to send several documents with one key in a request
+#define MULTI_MAX_DOCUMENTS 1024
+
+// after an error status the error text follows as a normal chunked file
+#define PACK_STATUS_OK 0
+#define PACK_STATUS_LEN_ERROR 1
+#define PACK_STATUS_CHAR_ERROR 2
+#define PACK_STATUS_KEY_HELD 3 // go ahead, but send only the text (see otp_header.h)
+#define PACK_STATUS_TOO_BIG 4  // more than the server takes in one request
+#define STATUS_AT_SIZE 12      // an error status frame, the status and its offset
+
+#define PACKED_BYTES(count) (((uint64_t) (count) * 5 + 7) / 8)
+
+int pack_text(const char* text, uint32_t count, uint8_t* packed);
+void unpack_text(const uint8_t* packed, uint32_t count, char* text);
+long cipher_packed(uint8_t* text, const uint8_t* key, uint32_t count, int decrypt);
+void slice_packed(const uint8_t* packed, uint32_t total, uint32_t first, uint32_t count, uint8_t* out);
+
+int is_packed_file(const char* content, long size);
+char* unpack_file(const char* content, long size);
+int write_packed_file(FILE* out, const uint8_t* packed, uint32_t count);
+
+int send_packed(int socketFD, const uint8_t* packed, uint32_t count);
+uint8_t* recv_packed(int socketFD, uint32_t* count, uint32_t max_count);
+int skip_packed(int socketFD, uint32_t count);
+int stream_packed(int socketFD, uint32_t* count, int (*consume)(const char* text, uint32_t length, void* arg), void* arg);
+int send_status(int socketFD, int32_t status);
+int send_status_at(int socketFD, int32_t status, int64_t offset);
+int recv_status(int socketFD, int32_t* status, int64_t* offset);
+
+#endif
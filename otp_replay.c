@@ -0,0 +1,473 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "otp_capture.h"
+#include "otp_header.h"
+#include "otp_ring.h"
+
+#define DEFAULT_CONCURRENCY 8
+#define DEFAULT_STALL_SECONDS 10
+#define MAX_POLL_MS 100
+
+// what one client sent in one read of the server
+struct chunk {
+    uint64_t at; // microseconds after the connection opened
+    const char* data;
+    uint32_t length;
+};
+
+struct replay_conn {
+    uint64_t id;
+    uint64_t opened;  // when the capture saw it, microseconds
+    uint64_t closed;  // after opened
+    struct chunk* chunks;
+    int num_chunks;
+    int max_chunks;
+
+    // while it is being replayed
+    int fd;
+    int next;         // the chunk being sent
+    uint32_t offset;  // how much of it is out
+    int shut;         // everything is sent and the write side is closed
+    uint64_t started; // real time the replay connected
+    uint64_t progress;
+};
+
+static struct replay_conn* conns = NULL;
+static int num_conns = 0;
+static int max_conns = 0;
+
+// from a connection id to its index in conns, open addressing
+static int* index_of = NULL;
+static size_t index_size = 0;
+
+static uint64_t now_us() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static void usage(const char* name) {
+    fprintf(stderr, "USAGE: %s [-f] [-c connections] [-x speed] [-t seconds] capture [host:]port|unix:path\n", name);
+    fprintf(stderr, "  -f              send as fast as possible instead of at the original pace\n");
+    fprintf(stderr, "  -c connections  replay this many at once with -f (default %d)\n", DEFAULT_CONCURRENCY);
+    fprintf(stderr, "  -x speed        at the original pace, run this many times faster (default 1)\n");
+    fprintf(stderr, "  -t seconds      give up on a connection that gets nowhere for this long (default %d)\n", DEFAULT_STALL_SECONDS);
+    exit(1);
+}
+
+static void out_of_memory() {
+    fprintf(stderr, "otp_replay: out of memory\n");
+    exit(1);
+}
+
+static void grow_index() {
+    size_t old_size = index_size;
+    int* old = index_of;
+
+    index_size = old_size == 0 ? 1024 : old_size * 2;
+    index_of = malloc(index_size * sizeof(int));
+    if (index_of == NULL) {
+        out_of_memory();
+    }
+    memset(index_of, -1, index_size * sizeof(int));
+
+    for (int i = 0; i < num_conns; i++) {
+        size_t slot = conns[i].id * 0x9E3779B97F4A7C15ULL & (index_size - 1);
+        while (index_of[slot] >= 0) {
+            slot = (slot + 1) & (index_size - 1);
+        }
+        index_of[slot] = i;
+    }
+    free(old);
+}
+
+// the connection with this id, added the first time it is seen
+static struct replay_conn* find_conn(uint64_t id, uint64_t time) {
+    if ((size_t) num_conns * 2 >= index_size) {
+        grow_index();
+    }
+
+    size_t slot = id * 0x9E3779B97F4A7C15ULL & (index_size - 1);
+    while (index_of[slot] >= 0) {
+        if (conns[index_of[slot]].id == id) {
+            return &conns[index_of[slot]];
+        }
+        slot = (slot + 1) & (index_size - 1);
+    }
+
+    if (num_conns == max_conns) {
+        max_conns = max_conns == 0 ? 256 : max_conns * 2;
+        conns = realloc(conns, max_conns * sizeof(*conns));
+        if (conns == NULL) {
+            out_of_memory();
+        }
+    }
+
+    struct replay_conn* conn = &conns[num_conns];
+    memset(conn, 0, sizeof(*conn));
+    conn->id = id;
+    conn->opened = time;
+    conn->fd = -1;
+    index_of[slot] = num_conns++;
+    return conn;
+}
+
+static void add_chunk(struct replay_conn* conn, uint64_t time, const char* data, uint32_t length) {
+    uint64_t at = time > conn->opened ? time - conn->opened : 0;
+
+    // reads that came in together go out together
+    if (conn->num_chunks > 0) {
+        struct chunk* last = &conn->chunks[conn->num_chunks - 1];
+        if (last->data + last->length == data && at == last->at) {
+            last->length += length;
+            return;
+        }
+    }
+
+    if (conn->num_chunks == conn->max_chunks) {
+        conn->max_chunks = conn->max_chunks == 0 ? 8 : conn->max_chunks * 2;
+        conn->chunks = realloc(conn->chunks, conn->max_chunks * sizeof(struct chunk));
+        if (conn->chunks == NULL) {
+            out_of_memory();
+        }
+    }
+    conn->chunks[conn->num_chunks++] = (struct chunk) { at, data, length };
+}
+
+// map the capture and sort its records out by connection, returns the role it was taken for
+static int load_capture(const char* path) {
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror("otp_replay: opening the capture");
+        exit(1);
+    }
+    if ((size_t) st.st_size < sizeof(struct capture_header)) {
+        fprintf(stderr, "otp_replay: %s is not a capture\n", path);
+        exit(1);
+    }
+
+    const char* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        perror("otp_replay: mapping the capture");
+        exit(1);
+    }
+
+    struct capture_header header;
+    memcpy(&header, data, sizeof(header));
+    if (header.magic != CAPTURE_MAGIC || header.version != CAPTURE_VERSION) {
+        fprintf(stderr, "otp_replay: %s is not a capture this version can read\n", path);
+        exit(1);
+    }
+
+    size_t at = sizeof(header);
+    while (at + sizeof(struct capture_record) <= (size_t) st.st_size) {
+        struct capture_record record;
+        memcpy(&record, data + at, sizeof(record));
+        at += sizeof(record);
+
+        // a capture cut off part way through a record, when the disk filled up
+        if (record.length > st.st_size - at) {
+            fprintf(stderr, "otp_replay: the capture ends part way through a record\n");
+            break;
+        }
+
+        struct replay_conn* conn = find_conn(record.connection, record.time_us);
+        if (record.type == CAPTURE_DATA) {
+            add_chunk(conn, record.time_us, data + at, record.length);
+        } else if (record.type == CAPTURE_CLOSE) {
+            conn->closed = record.time_us - conn->opened;
+        }
+        at += record.length;
+    }
+
+    return header.role;
+}
+
+// the first bytes a connection sent, for its hello frame
+static int first_bytes(const struct replay_conn* conn, void* out, size_t length) {
+    size_t got = 0;
+
+    for (int i = 0; i < conn->num_chunks && got < length; i++) {
+        size_t take = conn->chunks[i].length < length - got ? conn->chunks[i].length : length - got;
+        memcpy((char*) out + got, conn->chunks[i].data, take);
+        got += take;
+    }
+    return got == length;
+}
+
+static int by_open_time(const void* a, const void* b) {
+    const struct replay_conn* x = a;
+    const struct replay_conn* y = b;
+    return x->opened < y->opened ? -1 : x->opened > y->opened;
+}
+
+static int by_value(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*) a;
+    uint64_t y = *(const uint64_t*) b;
+    return x < y ? -1 : x > y;
+}
+
+// resolve [host:]port or unix:path (@name for the abstract namespace)
+static int resolve(const char* target, struct sockaddr_storage* address, socklen_t* address_len) {
+    memset(address, 0, sizeof(*address));
+
+    if (strncmp(target, "unix:", 5) == 0) {
+        struct sockaddr_un* un = (struct sockaddr_un*) address;
+        const char* path = target + 5;
+        size_t len = strlen(path);
+
+        if (len == 0 || len >= sizeof(un->sun_path)) {
+            return -1;
+        }
+        un->sun_family = AF_UNIX;
+        memcpy(un->sun_path, path, len);
+        *address_len = offsetof(struct sockaddr_un, sun_path) + len + 1;
+        if (path[0] == '@') {
+            un->sun_path[0] = '\0';
+            (*address_len)--;
+        }
+        return 0;
+    }
+
+    char host[256] = "localhost";
+    const char* port = target;
+    const char* colon = strrchr(target, ':');
+    if (colon != NULL) {
+        snprintf(host, sizeof(host), "%.*s", (int) (colon - target), target);
+        port = colon + 1;
+    }
+
+    struct addrinfo hints, *found;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &found) != 0) {
+        return -1;
+    }
+    memcpy(address, found->ai_addr, found->ai_addrlen);
+    *address_len = found->ai_addrlen;
+    freeaddrinfo(found);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    int fast = 0;
+    int concurrency = DEFAULT_CONCURRENCY;
+    double speed = 1;
+    int stall_seconds = DEFAULT_STALL_SECONDS;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "fc:x:t:")) != -1) {
+        switch (opt) {
+            case 'f':
+                fast = 1;
+                break;
+            case 'c':
+                concurrency = atoi(optarg);
+                break;
+            case 'x':
+                speed = atof(optarg);
+                break;
+            case 't':
+                stall_seconds = atoi(optarg);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (argc - optind != 2 || concurrency < 1 || speed <= 0 || stall_seconds < 1) {
+        usage(argv[0]);
+    }
+
+    int role = load_capture(argv[optind]);
+
+    struct sockaddr_storage address;
+    socklen_t address_len;
+    if (resolve(argv[optind + 1], &address, &address_len) < 0) {
+        fprintf(stderr, "otp_replay: can't resolve %s\n", argv[optind + 1]);
+        return 1;
+    }
+
+    qsort(conns, num_conns, sizeof(*conns), by_open_time);
+
+    // connections that went through a shared memory ring only have their hello on the socket
+    int skipped = 0;
+    int kept = 0;
+    for (int i = 0; i < num_conns; i++) {
+        struct {
+            int length;
+            struct hello hello;
+        } frame;
+        if (first_bytes(&conns[i], &frame, sizeof(frame)) && frame.hello.magic == HELLO_MAGIC && (frame.hello.options & CAP_SHM)) {
+            free(conns[i].chunks);
+            skipped++;
+            continue;
+        }
+        conns[kept++] = conns[i];
+    }
+    num_conns = kept;
+
+    printf("otp_replay: %d connections to %s server %s, %s\n", num_conns, role == ROLE_DEC ? "a dec" : "an enc",
+    argv[optind + 1], fast ? "as fast as possible" : "at the original pace");
+    fflush(stdout);
+
+    struct replay_conn** active = calloc(num_conns > 0 ? num_conns : 1, sizeof(*active));
+    struct pollfd* pfds = calloc(num_conns > 0 ? num_conns : 1, sizeof(*pfds));
+    uint64_t* times = calloc(num_conns > 0 ? num_conns : 1, sizeof(*times));
+    if (active == NULL || pfds == NULL || times == NULL) {
+        out_of_memory();
+    }
+
+    uint64_t begin = now_us();
+    uint64_t first_open = num_conns > 0 ? conns[0].opened : 0;
+    uint64_t sent = 0, received = 0;
+    int num_active = 0, started = 0, finished = 0, failed = 0, stalled = 0;
+    char discard[65536];
+
+    while (started < num_conns || num_active > 0) {
+        uint64_t now = now_us();
+        uint64_t wait = (uint64_t) MAX_POLL_MS * 1000;
+
+        // start the connections that are due
+        while (started < num_conns && (fast ? num_active < concurrency
+        : begin + (uint64_t) ((conns[started].opened - first_open) / speed) <= now)) {
+            struct replay_conn* conn = &conns[started++];
+
+            // a server with a full backlog can't be waited on here, it may be waiting on us
+            conn->fd = socket(address.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+            if (conn->fd < 0 || (connect(conn->fd, (struct sockaddr*) &address, address_len) < 0
+            && errno != EINPROGRESS && errno != EAGAIN)) {
+                if (conn->fd >= 0) {
+                    close(conn->fd);
+                }
+                free(conn->chunks);
+                failed++;
+                continue;
+            }
+            conn->started = conn->progress = now;
+            active[num_active++] = conn;
+        }
+        if (!fast && started < num_conns) {
+            uint64_t due = begin + (uint64_t) ((conns[started].opened - first_open) / speed);
+            wait = due > now && due - now < wait ? due - now : wait;
+        }
+
+        // send whatever is due, and shut the write side once the client would have hung up
+        for (int i = 0; i < num_active; i++) {
+            struct replay_conn* conn = active[i];
+            short events = POLLIN;
+
+            if (!conn->shut && conn->next < conn->num_chunks) {
+                uint64_t due = fast ? now : conn->started + (uint64_t) (conn->chunks[conn->next].at / speed);
+                if (due <= now) {
+                    events |= POLLOUT;
+                } else if (due - now < wait) {
+                    wait = due - now;
+                }
+            } else if (!conn->shut) {
+                uint64_t due = fast ? now : conn->started + (uint64_t) (conn->closed / speed);
+                if (due <= now) {
+                    shutdown(conn->fd, SHUT_WR);
+                    conn->shut = 1;
+                } else if (due - now < wait) {
+                    wait = due - now;
+                }
+            }
+            pfds[i] = (struct pollfd) { conn->fd, events, 0 };
+        }
+
+        if (poll(pfds, num_active, (wait + 999) / 1000) < 0 && errno != EINTR) {
+            perror("otp_replay: poll");
+            return 1;
+        }
+        now = now_us();
+
+        for (int i = 0; i < num_active; i++) {
+            struct replay_conn* conn = active[i];
+            int done = 0;
+
+            if (pfds[i].revents & POLLOUT) {
+                while (conn->next < conn->num_chunks
+                && (fast || conn->started + (uint64_t) (conn->chunks[conn->next].at / speed) <= now)) {
+                    struct chunk* chunk = &conn->chunks[conn->next];
+                    ssize_t n = send(conn->fd, chunk->data + conn->offset, chunk->length - conn->offset, MSG_NOSIGNAL);
+                    if (n < 0) {
+                        // the server hung up before taking all of it
+                        done = errno != EAGAIN && errno != EWOULDBLOCK ? -1 : 0;
+                        break;
+                    }
+                    sent += n;
+                    conn->progress = now;
+                    conn->offset += n;
+                    if (conn->offset < chunk->length) {
+                        break;
+                    }
+                    conn->next++;
+                    conn->offset = 0;
+                }
+            }
+
+            if (!done && (pfds[i].revents & (POLLIN | POLLHUP | POLLERR))) {
+                ssize_t n;
+                while ((n = recv(conn->fd, discard, sizeof(discard), 0)) > 0) {
+                    received += n;
+                    conn->progress = now;
+                }
+                if (n == 0) {
+                    done = 1;
+                } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    done = -1;
+                }
+            }
+
+            if (!done && now - conn->progress > (uint64_t) stall_seconds * 1000000) {
+                stalled++;
+                done = -2;
+            }
+
+            if (done != 0) {
+                // the server hung up, on a connection that sent all it had that is the end of it
+                if (done == 1 && conn->next == conn->num_chunks) {
+                    times[finished++] = now - conn->started;
+                } else if (done != -2) {
+                    failed++;
+                }
+                close(conn->fd);
+                free(conn->chunks);
+                active[i] = active[--num_active];
+                pfds[i] = pfds[num_active];
+                i--;
+            }
+        }
+    }
+
+    double elapsed = (now_us() - begin) / 1e6;
+    printf("otp_replay: %d replayed, %d skipped (shared memory), %d failed, %d stalled in %.3fs\n",
+    finished, skipped, failed, stalled, elapsed);
+    printf("otp_replay: sent %llu bytes, received %llu bytes\n", (unsigned long long) sent, (unsigned long long) received);
+    if (finished > 0) {
+        qsort(times, finished, sizeof(*times), by_value);
+        printf("otp_replay: connection time p50 %.2fms p90 %.2fms p99 %.2fms max %.2fms\n",
+        times[finished / 2] / 1e3, times[finished * 9 / 10] / 1e3, times[finished * 99 / 100] / 1e3, times[finished - 1] / 1e3);
+    }
+
+    return failed > 0 || stalled > 0;
+}
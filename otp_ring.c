@@ -0,0 +1,252 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+
+#include "otp_ring.h"
+
+#define RING_ALIGN(n) (((n) + 7) & ~(uint64_t) 7)
+
+static int map_ring (struct shm_ring* ring, size_t map_size) {
+    ring->map_size = map_size;
+    ring->header = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, ring->memfd, 0);
+    if (ring->header == MAP_FAILED) {
+        ring->header = NULL;
+        return -1;
+    }
+    ring->data = (char*) ring->header + RING_ALIGN(sizeof(struct ring_header));
+    return 0;
+}
+
+// make an empty ring, capacity is rounded up to a multiple of 8
+int ring_create(struct shm_ring* ring, uint32_t capacity) {
+    memset(ring, 0, sizeof(*ring));
+    ring->memfd = ring->request_fd = ring->response_fd = -1;
+
+    capacity = RING_ALIGN(capacity);
+    size_t map_size = RING_ALIGN(sizeof(struct ring_header)) + capacity;
+
+    // sealed at its size, so the server can't be made to fault on a shrunk mapping
+    ring->memfd = memfd_create("otp_ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (ring->memfd < 0 || ftruncate(ring->memfd, map_size) < 0
+    || fcntl(ring->memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0
+    || map_ring(ring, map_size) < 0) {
+        ring_close(ring);
+        return -1;
+    }
+
+    ring->request_fd = eventfd(0, EFD_CLOEXEC);
+    ring->response_fd = eventfd(0, EFD_CLOEXEC);
+    if (ring->request_fd < 0 || ring->response_fd < 0) {
+        ring_close(ring);
+        return -1;
+    }
+
+    ring->header->magic = RING_MAGIC;
+    ring->header->capacity = capacity;
+    ring->capacity = capacity;
+    atomic_init(&ring->header->head, 0);
+    atomic_init(&ring->header->served, 0);
+    atomic_init(&ring->header->released, 0);
+
+    return 0;
+}
+
+// pass the memfd and both eventfds to the server over the unix socket
+int ring_send_fds(struct shm_ring* ring, int socketFD) {
+    int fds[3] = { ring->memfd, ring->request_fd, ring->response_fd };
+    char control[CMSG_SPACE(sizeof(fds))];
+    char byte = 'R';
+    struct iovec iov = { &byte, 1 };
+    struct msghdr msg;
+
+    memset(&msg, 0, sizeof(msg));
+    memset(control, 0, sizeof(control));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    if (sendmsg(socketFD, &msg, MSG_NOSIGNAL) < 0) {
+        return -1;
+    }
+
+    ring->socketFD = socketFD;
+    return 0;
+}
+
+// room for one request, NULL if it can't fit until earlier entries are released
+struct ring_entry* ring_reserve(struct shm_ring* ring, uint32_t text_len, uint32_t key_len, uint64_t* position) {
+    uint32_t capacity = ring->capacity;
+    uint64_t size = RING_ALIGN(sizeof(struct ring_entry) + (uint64_t) text_len + key_len);
+
+    if (size > capacity) {
+        return NULL;
+    }
+
+    uint64_t pos = atomic_load_explicit(&ring->header->head, memory_order_relaxed);
+    uint64_t offset = pos % capacity;
+    uint64_t needed = size;
+
+    // entries never wrap, the rest of the ring is skipped instead
+    if (offset + size > capacity) {
+        needed += capacity - offset;
+    }
+
+    uint64_t released = atomic_load_explicit(&ring->header->released, memory_order_acquire);
+    if (pos + needed - released > capacity) {
+        return NULL;
+    }
+
+    if (offset + size > capacity) {
+        ((struct ring_entry*) (ring->data + offset))->size = RING_WRAP;
+        pos += capacity - offset;
+        offset = 0;
+    }
+
+    struct ring_entry* entry = (struct ring_entry*) (ring->data + offset);
+    entry->size = size;
+    entry->status = RING_PENDING;
+    entry->text_len = text_len;
+    entry->key_len = key_len;
+
+    *position = pos;
+    return entry;
+}
+
+// publish a filled in entry and wake the server
+void ring_commit(struct shm_ring* ring, uint64_t position) {
+    struct ring_entry* entry = (struct ring_entry*) (ring->data + position % ring->capacity);
+    uint64_t one = 1;
+
+    atomic_store_explicit(&ring->header->head, position + entry->size, memory_order_release);
+    if (write(ring->request_fd, &one, sizeof(one)) < 0) {
+        perror("ERROR waking server");
+    }
+}
+
+// block until the server is done with the entry, NULL if the server went away
+struct ring_entry* ring_wait(struct shm_ring* ring, uint64_t position) {
+    while (atomic_load_explicit(&ring->header->served, memory_order_acquire) <= position) {
+        struct pollfd pfds[2] = {
+            { ring->response_fd, POLLIN, 0 },
+            { ring->socketFD, POLLIN, 0 }
+        };
+
+        if (poll(pfds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return NULL;
+        }
+
+        if (pfds[0].revents & POLLIN) {
+            uint64_t count;
+            if (read(ring->response_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+                return NULL;
+            }
+            continue;
+        }
+
+        // the server never writes to the socket once the ring is up, so this is a hang up
+        if (pfds[1].revents) {
+            if (atomic_load_explicit(&ring->header->served, memory_order_acquire) > position) {
+                break;
+            }
+            return NULL;
+        }
+    }
+
+    return (struct ring_entry*) (ring->data + position % ring->capacity);
+}
+
+// let the space of an entry (and any wrap before it) be used again
+void ring_release(struct shm_ring* ring, uint64_t position) {
+    struct ring_entry* entry = (struct ring_entry*) (ring->data + position % ring->capacity);
+    atomic_store_explicit(&ring->header->released, position + entry->size, memory_order_release);
+}
+
+// receive the client's ring over the unix socket and map it
+int ring_attach(struct shm_ring* ring, int socketFD) {
+    int fds[3];
+    char control[CMSG_SPACE(sizeof(fds))];
+    char byte;
+    struct iovec iov = { &byte, 1 };
+    struct msghdr msg;
+
+    memset(ring, 0, sizeof(*ring));
+    ring->memfd = ring->request_fd = ring->response_fd = -1;
+    ring->socketFD = socketFD;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t got;
+    while ((got = recvmsg(socketFD, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR);
+    if (got <= 0) {
+        return -1;
+    }
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS
+    || cmsg->cmsg_len != CMSG_LEN(sizeof(fds))) {
+        return -1;
+    }
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    ring->memfd = fds[0];
+    ring->request_fd = fds[1];
+    ring->response_fd = fds[2];
+
+    // the size comes from the sealed file itself, not from anything the client wrote
+    struct stat st;
+    int seals = fcntl(ring->memfd, F_GET_SEALS);
+    if (seals < 0 || !(seals & F_SEAL_SHRINK) || fstat(ring->memfd, &st) < 0 || st.st_size <= (off_t) RING_ALIGN(sizeof(struct ring_header))
+    || map_ring(ring, st.st_size) < 0) {
+        ring_close(ring);
+        return -1;
+    }
+
+    if (ring->header->magic != RING_MAGIC
+    || ring->header->capacity != ring->map_size - RING_ALIGN(sizeof(struct ring_header))) {
+        ring_close(ring);
+        return -1;
+    }
+    ring->capacity = ring->header->capacity;
+
+    return 0;
+}
+
+void ring_close(struct shm_ring* ring) {
+    if (ring->header != NULL) {
+        munmap(ring->header, ring->map_size);
+        ring->header = NULL;
+    }
+    if (ring->memfd >= 0) {
+        close(ring->memfd);
+    }
+    if (ring->request_fd >= 0) {
+        close(ring->request_fd);
+    }
+    if (ring->response_fd >= 0) {
+        close(ring->response_fd);
+    }
+    ring->memfd = ring->request_fd = ring->response_fd = -1;
+}
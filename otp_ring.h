@@ -0,0 +1,78 @@
+#ifndef OTP_RING_H
+#define OTP_RING_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+/**
+* Shared memory transport
+* A client connected over a unix socket can ask for a ring instead of
+* sending its files over the socket. The client creates the ring in a
+* memfd and passes it, with two eventfds for wakeups, to the server. Each
+* request is written once into the ring by the client, ciphered in place by
+* the server and read back from the same bytes by the client.
+*
+* One producer (the client) and one consumer (the server) per ring:
+* the client owns head and released, the server owns served. Positions
+* only grow; the byte offset is the position modulo the capacity.
+*/
+
+#define RING_MAGIC 0x4f545052 // "OTPR"
+#define RING_DEFAULT_CAPACITY (16 * 1024 * 1024)
+#define CAP_SHM 1 // asked for in the hello (see otp_header.h) instead of socket transfers
+
+// entry status, written by the server once it is done with an entry
+#define RING_PENDING 0
+#define RING_DONE 1
+#define RING_LEN_ERROR 2
+#define RING_CHAR_ERROR 3
+
+#define RING_WRAP 0xffffffffu // entry size meaning skip to the start of the ring
+
+#define RING_LEN_ERROR_MSG "Invalid key! The key must be longer in length than the file content!\n"
+#define RING_CHAR_ERROR_MSG "invalid character, not sending!\n"
+
+struct ring_header {
+    uint32_t magic;
+    uint32_t capacity;         // bytes in the data area, a multiple of 8
+    _Atomic uint64_t head;     // end of the last entry the client published
+    _Atomic uint64_t served;   // the server is done with everything before this
+    _Atomic uint64_t released; // the client is done with everything before this
+};
+
+// the text follows the entry header and the key follows the text
+struct ring_entry {
+    uint32_t size; // whole entry including this header, or RING_WRAP
+    int32_t status;
+    uint32_t text_len;
+    uint32_t key_len;
+};
+
+struct shm_ring {
+    struct ring_header* header;
+    char* data;
+    uint32_t capacity; // our own copy, the header is writable by the other side
+    size_t map_size;
+    int socketFD;      // the unix socket the ring was passed over
+    int memfd;
+    int request_fd;  // eventfd, the client wakes the server
+    int response_fd; // eventfd, the server wakes the client
+};
+
+#define RING_TEXT(entry) ((char*) (entry) + sizeof(struct ring_entry))
+#define RING_KEY(entry) (RING_TEXT(entry) + (entry)->text_len)
+
+// client side
+int ring_create(struct shm_ring* ring, uint32_t capacity);
+int ring_send_fds(struct shm_ring* ring, int socketFD);
+struct ring_entry* ring_reserve(struct shm_ring* ring, uint32_t text_len, uint32_t key_len, uint64_t* position);
+void ring_commit(struct shm_ring* ring, uint64_t position);
+struct ring_entry* ring_wait(struct shm_ring* ring, uint64_t position);
+void ring_release(struct shm_ring* ring, uint64_t position);
+
+// server side
+int ring_attach(struct shm_ring* ring, int socketFD);
+
+void ring_close(struct shm_ring* ring);
+
+#endif
@@ -0,0 +1,1159 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sched.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <stddef.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+#include "otp_server.h"
+#include "otp_ring.h"
+#include "otp_pack.h"
+#include "otp_lz4.h"
+#include "otp_header.h"
+#include "otp_cache.h"
+#include "otp_timer.h"
+#include "otp_buffer.h"
+#include "otp_capture.h"
+#include "otp_socket.h"
+
+static volatile sig_atomic_t stop_requested = 0;
+static volatile sig_atomic_t restart_requested = 0;
+static volatile sig_atomic_t report_requested = 0;
+static int draining = 0;
+static size_t request_limit = 0;       // -m, 0 for no limit
+static unsigned long oversized = 0;    // requests turned down for it
+static int drain_deadline = 0; // seconds, only set in processes that serve clients
+
+// the deadline of the connection being served, there is only ever one per process
+static struct timer_wheel wheel;
+static struct otp_timer deadline;
+static timer_t tick_timer;
+static int deadlines_started = 0;
+static int ticking = 0;
+static int deadline_seconds[NUM_DEADLINES];
+static volatile sig_atomic_t deadline_socket = -1;
+static volatile sig_atomic_t deadline_stage = 0;
+static volatile sig_atomic_t deadline_missed = 0; // the tick shut the connection down
+static unsigned long missed_deadlines[NUM_DEADLINES];
+static const char* deadline_names[NUM_DEADLINES] = { "hello", "idle", "request" };
+
+// the serving process's setup, so a restart can start from inside a connection
+static struct server_config* serving_config = NULL;
+static int* serving_listeners = NULL;
+static int is_shard = 0; // the supervisor owns the unix socket file, not its shards
+
+static void usage(const char* name) {
+    fprintf(stderr, "USAGE: %s [-n shards] [-p] [-c cpulist] [-d seconds] [-u path] [-C megabytes] [-K megabytes] [-H seconds] [-I seconds] [-R seconds] [-G megabytes] [-m megabytes] [-M megabytes] [-W path] [-T profile] port\n", name);
+    fprintf(stderr, "  -n shards   run this many processes on the port (SO_REUSEPORT)\n");
+    fprintf(stderr, "  -p          pin each shard to its own cpu\n");
+    fprintf(stderr, "  -c cpulist  pin shards to these cpus in turn, e.g. 0-3,8\n");
+    fprintf(stderr, "  -d seconds  drain deadline for requests in progress on SIGTERM (default %d)\n", DEFAULT_DRAIN_SECONDS);
+    fprintf(stderr, "  -u path     also listen on this unix socket, @name for the abstract namespace\n");
+    fprintf(stderr, "  -C megabytes  keep recent results in a cache this big per shard (SIGUSR1 reports it)\n");
+    fprintf(stderr, "  -K megabytes  keep keys clients offer by hash in a store this big per shard\n");
+    fprintf(stderr, "  -H seconds  deadline for a new connection's hello (default %d, 0 for none)\n", DEFAULT_HELLO_SECONDS);
+    fprintf(stderr, "  -I seconds  deadline for the next request on a kept connection (default %d)\n", DEFAULT_IDLE_SECONDS);
+    fprintf(stderr, "  -R seconds  deadline for each request and its response (default %d)\n", DEFAULT_REQUEST_SECONDS);
+    fprintf(stderr, "  -G megabytes  put payloads this big or bigger on huge pages (default %d, 0 for none)\n", DEFAULT_HUGE_PAGE_MEGABYTES);
+    fprintf(stderr, "  -m megabytes  turn down requests with more text and key than this (default no limit)\n");
+    fprintf(stderr, "  -M megabytes  spill buffers to temp files past this much for all shards (default no limit)\n");
+    fprintf(stderr, "  -W path     append what clients send to this capture, for otp_replay\n");
+    fprintf(stderr, "  -T profile  tune connections for latency (the default) or throughput\n");
+    exit(1);
+}
+
+// parse a list like "0-3,8,10-11", returns 0 if it is malformed
+static int parse_cpu_list(const char* list, struct server_config* config) {
+    const char* p = list;
+
+    config->num_cpus = 0;
+    while (*p != '\0') {
+        char* end;
+        long first = strtol(p, &end, 10);
+        long last = first;
+
+        if (end == p || first < 0) {
+            return 0;
+        }
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p || last < first) {
+                return 0;
+            }
+        }
+
+        for (long cpu = first; cpu <= last && config->num_cpus < MAX_CPUS; cpu++) {
+            config->cpus[config->num_cpus++] = cpu;
+        }
+
+        if (*end == ',') {
+            end++;
+        } else if (*end != '\0') {
+            return 0;
+        }
+        p = end;
+    }
+
+    return config->num_cpus > 0;
+}
+
+void parse_server_args(int argc, char* argv[], struct server_config* config) {
+    int opt;
+
+    memset(config, 0, sizeof(*config));
+    config->num_shards = 1;
+    config->drain_seconds = DEFAULT_DRAIN_SECONDS;
+    config->argv = argv;
+    config->unixSocket = -1;
+    config->deadline_seconds[DEADLINE_HELLO] = DEFAULT_HELLO_SECONDS;
+    config->deadline_seconds[DEADLINE_IDLE] = DEFAULT_IDLE_SECONDS;
+    config->deadline_seconds[DEADLINE_REQUEST] = DEFAULT_REQUEST_SECONDS;
+    config->huge_page_bytes = (size_t) DEFAULT_HUGE_PAGE_MEGABYTES << 20;
+
+    while ((opt = getopt(argc, argv, "n:pc:d:u:C:K:H:I:R:G:m:M:W:T:")) != -1) {
+        switch (opt) {
+            case 'n':
+                config->num_shards = atoi(optarg);
+                if (config->num_shards < 1 || config->num_shards > MAX_SHARDS) {
+                    fprintf(stderr, "shards must be between 1 and %d\n", MAX_SHARDS);
+                    exit(1);
+                }
+                break;
+            case 'p':
+                config->pin_cpus = 1;
+                break;
+            case 'c':
+                if (!parse_cpu_list(optarg, config)) {
+                    fprintf(stderr, "bad cpu list '%s'\n", optarg);
+                    exit(1);
+                }
+                config->pin_cpus = 1;
+                break;
+            case 'd':
+                config->drain_seconds = atoi(optarg);
+                if (config->drain_seconds < 1) {
+                    fprintf(stderr, "drain deadline must be at least 1 second\n");
+                    exit(1);
+                }
+                break;
+            case 'u':
+                config->unix_path = optarg;
+                break;
+            case 'C':
+                if (atol(optarg) < 0) {
+                    fprintf(stderr, "cache size can't be negative\n");
+                    exit(1);
+                }
+                config->cache_bytes = (size_t) atol(optarg) << 20;
+                break;
+            case 'K':
+                if (atol(optarg) < 0) {
+                    fprintf(stderr, "key store size can't be negative\n");
+                    exit(1);
+                }
+                config->key_store_bytes = (size_t) atol(optarg) << 20;
+                break;
+            case 'H':
+            case 'I':
+            case 'R': {
+                int stage = opt == 'H' ? DEADLINE_HELLO : opt == 'I' ? DEADLINE_IDLE : DEADLINE_REQUEST;
+                config->deadline_seconds[stage] = atoi(optarg);
+                if (config->deadline_seconds[stage] < 0) {
+                    fprintf(stderr, "a deadline can't be negative\n");
+                    exit(1);
+                }
+                break;
+            }
+            case 'G':
+                if (atol(optarg) < 0) {
+                    fprintf(stderr, "huge page threshold can't be negative\n");
+                    exit(1);
+                }
+                config->huge_page_bytes = (size_t) atol(optarg) << 20;
+                break;
+            case 'm':
+            case 'M':
+                if (atol(optarg) < 0) {
+                    fprintf(stderr, "a memory limit can't be negative\n");
+                    exit(1);
+                }
+                *(opt == 'm' ? &config->request_bytes : &config->memory_bytes) = (size_t) atol(optarg) << 20;
+                break;
+            case 'W':
+                config->capture_path = optarg;
+                break;
+            case 'T':
+                config->socket_profile = socket_profile_named(optarg);
+                if (config->socket_profile < 0) {
+                    fprintf(stderr, "socket profile must be latency or throughput\n");
+                    exit(1);
+                }
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+
+    // the port is the one required argument
+    if (optind >= argc) {
+        usage(argv[0]);
+    }
+    config->port = atoi(argv[optind]);
+}
+
+// the NUMA node a cpu belongs to, from its nodeN entry in sysfs
+static int cpu_to_node(int cpu) {
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+
+    DIR* dir = opendir(path);
+    if (dir == NULL) {
+        return -1;
+    }
+
+    int node = -1;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strncmp(entry->d_name, "node", 4) == 0 && entry->d_name[4] >= '0' && entry->d_name[4] <= '9') {
+            node = atoi(entry->d_name + 4);
+            break;
+        }
+    }
+
+    closedir(dir);
+    return node;
+}
+
+// pin to one cpu, prefer memory from its node and steer its connections here
+static void pin_to_cpu(struct server_config* config, int shard, int listenSocket) {
+    int cpu;
+
+    if (config->num_cpus > 0) {
+        cpu = config->cpus[shard % config->num_cpus];
+    } else {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        if (online < 1) {
+            return;
+        }
+        cpu = shard % online;
+    }
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+
+    if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+        perror("WARNING could not pin shard to cpu");
+        return;
+    }
+
+    // buffers are allocated after this, so they land on the local node
+    int node = cpu_to_node(cpu);
+    if (node >= 0 && node < (int) (sizeof(unsigned long) * 8)) {
+        unsigned long nodemask = 1UL << node;
+        if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, &nodemask, sizeof(nodemask) * 8) < 0) {
+            perror("WARNING could not set NUMA memory policy");
+        }
+    }
+
+    // with SO_REUSEPORT the kernel prefers the listener whose cpu handled the packet
+    if (setsockopt(listenSocket, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu)) < 0) {
+        perror("WARNING could not set SO_INCOMING_CPU");
+    }
+}
+
+// the deadline starts with the signal, so a long request can't push it back
+static void arm_deadline() {
+    if (!stop_requested && !restart_requested && drain_deadline > 0) {
+        alarm(drain_deadline);
+    }
+}
+
+static void handle_stop(int sig) {
+    arm_deadline();
+    stop_requested = 1;
+}
+
+static void handle_restart(int sig) {
+    arm_deadline();
+    restart_requested = 1;
+}
+
+static void handle_report(int sig) {
+    report_requested = 1;
+}
+
+static void report_deadlines(FILE* out) {
+    unsigned long total = 0;
+
+    for (int i = 0; i < NUM_DEADLINES; i++) {
+        total += missed_deadlines[i];
+    }
+    if (total > 0) {
+        fprintf(out, "SERVER: %lu stalled connections closed (%lu %s, %lu %s, %lu %s)\n", total,
+        missed_deadlines[DEADLINE_HELLO], deadline_names[DEADLINE_HELLO],
+        missed_deadlines[DEADLINE_IDLE], deadline_names[DEADLINE_IDLE],
+        missed_deadlines[DEADLINE_REQUEST], deadline_names[DEADLINE_REQUEST]);
+        fflush(out);
+    }
+}
+
+#define MB(bytes) ((double) (bytes) / (1 << 20))
+
+static void report_buffers(FILE* out) {
+    struct buffer_stats stats;
+
+    buffer_get_stats(&stats);
+    if (stats.peak > 0 || stats.budget > 0) {
+        fprintf(out, "SERVER: buffers hold %.1f MB (peak %.1f MB, largest connection %.1f MB), all shards %.1f MB (peak %.1f MB",
+        MB(stats.in_use), MB(stats.peak), MB(stats.connection_peak), MB(stats.total_in_use), MB(stats.total_peak));
+        if (stats.budget > 0) {
+            fprintf(out, " of %.1f MB", MB(stats.budget));
+        }
+        fprintf(out, ")\n");
+        fflush(out);
+    }
+    if (stats.spilled + oversized > 0) {
+        fprintf(out, "SERVER: %lu buffers spilled to disk past the memory budget, %lu requests over the size limit\n",
+        stats.spilled, oversized);
+        fflush(out);
+    }
+    if (stats.hugetlb + stats.advised > 0) {
+        fprintf(out, "SERVER: %lu payloads on huge pages (%lu reserved, %lu transparent)\n",
+        stats.hugetlb + stats.advised, stats.hugetlb, stats.advised);
+        fflush(out);
+    }
+}
+
+// print the cache, deadline and buffer counters once a SIGUSR1 has asked for them
+static void report_if_asked() {
+    if (report_requested) {
+        report_requested = 0;
+        cache_report(stdout);
+        report_deadlines(stdout);
+        report_buffers(stdout);
+    }
+}
+
+// the deadline passed, the read or write the connection is stuck in fails and the
+// connection is closed the usual way
+static void deadline_passed(struct otp_timer* timer) {
+    deadline_missed = 1;
+    shutdown(deadline_socket, SHUT_RDWR);
+}
+
+static void handle_tick(int sig) {
+    int overrun = timer_getoverrun(tick_timer);
+    wheel_tick(&wheel, 1 + (overrun > 0 ? overrun : 0));
+}
+
+// the tick only runs while a deadline is armed, a server waiting in accept isn't woken
+static void update_ticking() {
+    int want = wheel.armed > 0;
+    struct itimerspec spec;
+
+    if (want == ticking) {
+        return;
+    }
+
+    memset(&spec, 0, sizeof(spec));
+    if (want) {
+        spec.it_value.tv_nsec = TIMER_TICK_MS * 1000000L;
+        spec.it_interval = spec.it_value;
+    }
+    if (timer_settime(tick_timer, 0, &spec, NULL) == 0) {
+        ticking = want;
+    }
+}
+
+// set up the tick in a process that serves connections, SIGRTMIN is only used for it
+// and restarts the reads and writes it lands in
+static void start_deadlines(struct server_config* config) {
+    struct sigaction sa;
+    struct sigevent sev;
+
+    memcpy(deadline_seconds, config->deadline_seconds, sizeof(deadline_seconds));
+    wheel_init(&wheel);
+    deadline.fire = deadline_passed;
+
+    memset(&sa, 0, sizeof(sa));
+    sigemptyset(&sa.sa_mask);
+    sa.sa_handler = handle_tick;
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGRTMIN, &sa, NULL);
+
+    memset(&sev, 0, sizeof(sev));
+    sev.sigev_notify = SIGEV_SIGNAL;
+    sev.sigev_signo = SIGRTMIN;
+    if (timer_create(CLOCK_MONOTONIC, &sev, &tick_timer) < 0) {
+        perror("WARNING could not start the deadline timer, running without deadlines");
+        return;
+    }
+    deadlines_started = 1;
+}
+
+// hold the connection to the deadline for stage from now on, in place of the one before
+void set_deadline(int connectionSocket, int stage) {
+    sigset_t tick, old;
+
+    if (!deadlines_started) {
+        return;
+    }
+
+    // the tick must not run the wheel while it is being changed
+    sigemptyset(&tick);
+    sigaddset(&tick, SIGRTMIN);
+    sigprocmask(SIG_BLOCK, &tick, &old);
+
+    deadline_socket = connectionSocket;
+    if (deadline_seconds[stage] > 0 && !deadline_missed) {
+        deadline_stage = stage;
+        timer_arm(&wheel, &deadline, (uint64_t) deadline_seconds[stage] * 1000 / TIMER_TICK_MS);
+    } else {
+        timer_cancel(&wheel, &deadline);
+    }
+    update_ticking();
+
+    sigprocmask(SIG_SETMASK, &old, NULL);
+}
+
+// done with the connection, call before closing it. says so if a deadline ended it
+void clear_deadline() {
+    sigset_t tick, old;
+
+    if (!deadlines_started) {
+        return;
+    }
+
+    sigemptyset(&tick);
+    sigaddset(&tick, SIGRTMIN);
+    sigprocmask(SIG_BLOCK, &tick, &old);
+    timer_cancel(&wheel, &deadline);
+    update_ticking();
+    deadline_socket = -1;
+    sigprocmask(SIG_SETMASK, &old, NULL);
+
+    if (deadline_missed) {
+        deadline_missed = 0;
+        missed_deadlines[deadline_stage]++;
+        printf("SERVER: closed a connection stalled past its %s deadline\n", deadline_names[deadline_stage]);
+    }
+}
+
+// no SA_RESTART, so a blocked accept or poll wakes up to look at the flags
+// SIGALRM keeps its default action and ends a drain that runs past the deadline
+static void install_handlers(int restartable) {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sigemptyset(&sa.sa_mask);
+
+    sa.sa_handler = handle_stop;
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+
+    sa.sa_handler = restartable ? handle_restart : SIG_IGN;
+    sigaction(SIGHUP, &sa, NULL);
+    sigaction(SIGUSR2, &sa, NULL);
+
+    sa.sa_handler = handle_report;
+    sigaction(SIGUSR1, &sa, NULL);
+}
+
+// use the listening sockets a previous server passed down, returns 1 if there were any
+int inherit_listeners(struct server_config* config, int* listenSockets) {
+    char* fds = getenv(LISTEN_FDS_ENV);
+    char* unix_fd = getenv(UNIX_FD_ENV);
+    int num = 0;
+
+    if (unix_fd != NULL) {
+        config->unixSocket = atoi(unix_fd);
+        unsetenv(UNIX_FD_ENV);
+    }
+
+    if (fds == NULL) {
+        return 0;
+    }
+
+    for (char* p = fds; *p != '\0' && num < MAX_SHARDS; ) {
+        char* end;
+        long fd = strtol(p, &end, 10);
+        if (end == p) {
+            break;
+        }
+        listenSockets[num++] = fd;
+        p = (*end == ',') ? end + 1 : end;
+    }
+
+    // don't hand these down again to anything we start later
+    unsetenv(LISTEN_FDS_ENV);
+
+    if (num == 0) {
+        return 0;
+    }
+
+    // shards are tied to their sockets, so the count comes with them
+    if (num != config->num_shards) {
+        fprintf(stderr, "SERVER: inherited %d listening sockets where %d shards were asked for, running %d\n", num, config->num_shards, num);
+        config->num_shards = num;
+    }
+
+    return 1;
+}
+
+// start the binary again with our listening sockets, the new server starts
+// accepting from the same queues while this one drains
+static void start_replacement(struct server_config* config, int* listenSockets) {
+    char fds[MAX_SHARDS * 12] = "";
+    int len = 0;
+
+    for (int i = 0; i < config->num_shards; i++) {
+        len += snprintf(fds + len, sizeof(fds) - len, i == 0 ? "%d" : ",%d", listenSockets[i]);
+    }
+
+    fflush(NULL);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("ERROR starting replacement server");
+        return;
+    }
+
+    if (pid == 0) {
+        // only the listening sockets go to the new binary, not client connections
+        close_range(3, ~0U, CLOSE_RANGE_CLOEXEC);
+        for (int i = 0; i < config->num_shards; i++) {
+            fcntl(listenSockets[i], F_SETFD, 0);
+        }
+
+        sigset_t none;
+        sigemptyset(&none);
+        sigprocmask(SIG_SETMASK, &none, NULL);
+
+        if (config->unixSocket >= 0) {
+            char unix_fd[12];
+            snprintf(unix_fd, sizeof(unix_fd), "%d", config->unixSocket);
+            fcntl(config->unixSocket, F_SETFD, 0);
+            setenv(UNIX_FD_ENV, unix_fd, 1);
+        }
+
+        setenv(LISTEN_FDS_ENV, fds, 1);
+        execv(config->argv[0], config->argv);
+        perror("ERROR executing replacement server");
+        _exit(1);
+    }
+
+    fprintf(stderr, "SERVER: started replacement %d, draining\n", pid);
+}
+
+int server_stopping() {
+    return stop_requested || restart_requested;
+}
+
+// hand over to a replacement if asked to, then stop taking new work
+static void begin_draining() {
+    if (draining) {
+        return;
+    }
+    draining = 1;
+
+    if (restart_requested && serving_config != NULL) {
+        start_replacement(serving_config, serving_listeners);
+    }
+}
+
+// block until the client sends its next request, returns 0 if we are
+// stopping and it hasn't started one (an idle connection has nothing to drain)
+int wait_for_request(int connectionSocket) {
+    struct pollfd pfd = { connectionSocket, POLLIN, 0 };
+
+    // a throughput connection is corked from the start of a request until the next one
+    // is waited for, so the end of the response goes out here
+    uncork_socket(connectionSocket);
+    set_deadline(connectionSocket, DEADLINE_IDLE);
+    while (1) {
+        report_if_asked();
+        if (server_stopping()) {
+            begin_draining();
+        }
+
+        int ready = poll(&pfd, 1, server_stopping() ? 0 : -1);
+        if (ready > 0) {
+            set_deadline(connectionSocket, DEADLINE_REQUEST);
+            cork_socket(connectionSocket);
+            return 1;
+        }
+        if (ready == 0 || errno != EINTR) {
+            return 0;
+        }
+    }
+}
+
+// called between connections, returns 0 once this server should finish up
+int keep_serving() {
+    report_if_asked();
+    if (!server_stopping()) {
+        return 1;
+    }
+
+    begin_draining();
+    return 0;
+}
+
+// bind the unix socket given with -u, unless a previous server handed it down
+void open_unix_listener(struct server_config* config) {
+    if (config->unix_path == NULL || config->unixSocket >= 0) {
+        return;
+    }
+
+    struct sockaddr_un address;
+    size_t len = strlen(config->unix_path);
+
+    memset(&address, 0, sizeof(address));
+    if (len == 0 || len >= sizeof(address.sun_path)) {
+        fprintf(stderr, "ERROR unix socket path is too long\n");
+        exit(1);
+    }
+    address.sun_family = AF_UNIX;
+    memcpy(address.sun_path, config->unix_path, len);
+
+    socklen_t address_len = offsetof(struct sockaddr_un, sun_path) + len + 1;
+    if (config->unix_path[0] == '@') {
+        address.sun_path[0] = '\0';
+        address_len--;
+    } else {
+        // a socket file left behind by a server that didn't shut down cleanly
+        struct stat st;
+        if (stat(config->unix_path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+            unlink(config->unix_path);
+        }
+    }
+
+    int unixSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (unixSocket < 0) {
+        perror("ERROR opening unix socket");
+        exit(1);
+    }
+    if (bind(unixSocket, (struct sockaddr*) &address, address_len) < 0) {
+        perror("ERROR on binding unix socket");
+        exit(1);
+    }
+    listen(unixSocket, SOMAXCONN); // as deep as the TCP listeners, see create_socket
+
+    config->unixSocket = unixSocket;
+}
+
+// a connection just accepted, set up for the socket profile with its buffers counted from here
+static int accepted(int connectionSocket) {
+    if (connectionSocket >= 0) {
+        tune_socket(connectionSocket);
+        buffer_start_connection();
+    }
+    return connectionSocket;
+}
+
+// the port a listener is bound to, the one the kernel picked when it was asked for port 0
+int listening_port(int listenSocket) {
+    struct sockaddr_in address;
+    socklen_t length = sizeof(address);
+
+    if (getsockname(listenSocket, (struct sockaddr*) &address, &length) < 0) {
+        return -1;
+    }
+    return ntohs(address.sin_port);
+}
+
+// say where the server is listening, flushed before any shards fork
+void announce_listening(struct server_config* config, int listenSocket) {
+    config->port = listening_port(listenSocket);
+    printf("SERVER: listening on port %d\n", config->port);
+    fflush(stdout);
+}
+
+int accept_client(int listenSocket, struct server_config* config, struct sockaddr_in* clientAddress) {
+    socklen_t sizeOfClientInfo = sizeof(*clientAddress);
+
+    if (config->unixSocket < 0) {
+        return accepted(accept(listenSocket, (struct sockaddr*) clientAddress, &sizeOfClientInfo));
+    }
+
+    // every shard polls the shared unix socket, so whoever loses the race
+    // has to find it empty rather than block in accept
+    fcntl(config->unixSocket, F_SETFL, fcntl(config->unixSocket, F_GETFL) | O_NONBLOCK);
+
+    while (1) {
+        struct pollfd pfds[2] = {
+            { config->unixSocket, POLLIN, 0 },
+            { listenSocket, POLLIN, 0 }
+        };
+
+        if (poll(pfds, 2, -1) < 0) {
+            return -1;
+        }
+
+        // same-host clients first, they are the cheap ones to serve
+        if (pfds[0].revents & POLLIN) {
+            int connectionSocket = accept(config->unixSocket, NULL, NULL);
+            if (connectionSocket >= 0) {
+                memset(clientAddress, 0, sizeof(*clientAddress));
+                return accepted(connectionSocket);
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                return -1;
+            }
+        }
+
+        if (pfds[1].revents & POLLIN) {
+            return accepted(accept(listenSocket, (struct sockaddr*) clientAddress, &sizeOfClientInfo));
+        }
+    }
+}
+
+// close the unix socket, removing its file unless a replacement took it over
+void finish_serving(struct server_config* config) {
+    cache_report(stdout);
+    report_deadlines(stdout);
+    report_buffers(stdout);
+    capture_flush();
+
+    if (config->unixSocket < 0) {
+        return;
+    }
+
+    close(config->unixSocket);
+    if (!is_shard && !restart_requested && config->unix_path != NULL && config->unix_path[0] != '@') {
+        unlink(config->unix_path);
+    }
+}
+
+// the options a hello asks for as granted to a client in role, -1 if the client is in
+// another role or speaks another version
+int check_hello(const struct hello* hello, int role) {
+    int known = CAP_SHM | CAP_PACKED | CAP_COMPRESS | CAP_SIZED | CAP_KEYS | CAP_MULTI;
+
+    if (hello->magic != HELLO_MAGIC || hello->version != HELLO_VERSION || hello->role != role
+    || (hello->options & ~known) != 0) {
+        return -1;
+    }
+
+    int options = settle_options(hello->options);
+    if (!key_store_enabled()) {
+        options &= ~CAP_KEYS;
+    }
+
+    return options;
+}
+
+// turn the client down with a single reply frame. its first request may already be on
+// the way, so that is read and dropped until it hangs up (or stops sending): closing
+// with it unread would reset the connection and could lose the reply
+void refuse_client(int connectionSocket) {
+    char discard[4096];
+    struct pollfd pfd = { connectionSocket, POLLIN, 0 };
+
+    send_hello_reply(connectionSocket, HELLO_DENIED, 0);
+    shutdown(connectionSocket, SHUT_WR);
+
+    while (poll(&pfd, 1, REFUSE_LINGER_MS) > 0 && recv(connectionSocket, discard, sizeof(discard), 0) > 0);
+    close(connectionSocket);
+}
+
+// the status frame ahead of the error text, saying which error it is and where
+void send_error_status(int connectionSocket, const struct cipher_error* error) {
+    send_status_at(connectionSocket, error->code == CIPHER_LEN_ERROR ? PACK_STATUS_LEN_ERROR
+    : error->code == CIPHER_SIZE_ERROR ? PACK_STATUS_TOO_BIG : PACK_STATUS_CHAR_ERROR, error->offset);
+}
+
+// whether a request of bytes is over the -m limit, setting error and counting it if so
+int over_request_limit(uint64_t bytes, struct cipher_error* error) {
+    if (request_limit == 0 || bytes <= request_limit) {
+        return 0;
+    }
+
+    error->code = CIPHER_SIZE_ERROR;
+    error->offset = request_limit;
+    oversized++;
+    return 1;
+}
+
+// how much more a request that has used bytes so far can send of a file announced at most
+// bytes, none once the request is known to be over the -m limit
+static uint32_t request_room(uint64_t used, uint32_t most, const struct cipher_error* error) {
+    if (error->code == CIPHER_SIZE_ERROR) {
+        return 0;
+    }
+    if (request_limit == 0 || used + most <= request_limit) {
+        return most;
+    }
+    return used < request_limit ? request_limit - used : 0;
+}
+
+// receive one packed file of a request that has used bytes so far, announced at most
+// most symbols. a file over the -m limit (or any, once the request is) is read past
+// without being allocated, and leaves error set. 1 with the file in packed, 0 when it
+// was read past, -1 if the connection failed or the file is over what was announced
+int recv_request_packed(int connectionSocket, uint8_t** packed, uint32_t* count, uint64_t used, uint32_t most, struct cipher_error* error) {
+    uint32_t room = request_room(used, most, error);
+
+    *packed = recv_packed(connectionSocket, count, room);
+    if (*packed != NULL) {
+        return 1;
+    }
+    if (*count <= room || (error->code != CIPHER_SIZE_ERROR && !over_request_limit(used + *count, error))) {
+        return -1;
+    }
+    return skip_packed(connectionSocket, *count) < 0 ? -1 : 0;
+}
+
+// the same for a compressed stream, consume sees the blocks of a stream that is kept
+int recv_request_blocks(int connectionSocket, char** data, uint32_t* length, uint64_t used, uint32_t most, struct cipher_error* error, int (*consume)(char* block, int length, uint32_t offset, void* arg), void* arg) {
+    uint32_t room = request_room(used, most, error);
+
+    *data = recv_blocks(connectionSocket, length, room, consume, arg);
+    if (*data != NULL) {
+        return 1;
+    }
+    if (*length <= room || (error->code != CIPHER_SIZE_ERROR && !over_request_limit(used + *length, error))) {
+        return -1;
+    }
+    return skip_blocks(connectionSocket, *length) < 0 ? -1 : 0;
+}
+
+// read the sizes a client announced for its next request, when it agreed to announce them
+// returns -1 if the client hung up, 0 if the key is too short or the request too big and
+// the client is waiting to hear so (the caller sends the error text), 1 if the files follow; error is set when
+// they are only to be read past. offered->cached is set when only the text follows
+int start_request(int connectionSocket, int sized, struct request_header* header, struct cipher_error* error, struct offered_key* offered) {
+    memset(header, 0, sizeof(*header));
+    offered->cached = NULL;
+    if (!sized) {
+        return 1;
+    }
+
+    if (recv_request_header(connectionSocket, header) < 0) {
+        return -1;
+    }
+    if ((header->flags & HEADER_KEY_HASH) && recv_key_hash(connectionSocket, &offered->hash) < 0) {
+        return -1;
+    }
+    size_socket_buffers(connectionSocket, header->text_len, (size_t) header->text_len + header->key_len);
+
+    int expect = header->flags & HEADER_EXPECT;
+    if (over_request_limit((uint64_t) header->text_len + header->key_len, error)) {
+        if (expect) {
+            send_error_status(connectionSocket, error);
+            return 0;
+        }
+    } else if (header->key_len < header->text_len) {
+        error->code = CIPHER_LEN_ERROR;
+        error->offset = header->key_len;
+        if (expect) {
+            send_error_status(connectionSocket, error);
+            return 0;
+        }
+    } else if (expect) {
+        // the hash only saves the upload when the client waits to hear whether it can
+        if ((header->flags & HEADER_KEY_HASH) && offered->format >= 0) {
+            offered->cached = key_store_find(offered->hash, header->key_len, offered->format);
+        }
+        send_status(connectionSocket, offered->cached != NULL ? PACK_STATUS_KEY_HELD : PACK_STATUS_OK);
+
+        // the client is waiting on it before it sends the files
+        flush_socket(connectionSocket);
+    }
+
+    return 1;
+}
+
+// hash each block of a key as it arrives, to check it against the hash the client offered
+int hash_key_block(char* block, int length, uint32_t offset, void* arg) {
+    xxhash64_update(arg, block, length);
+    return 1;
+}
+
+// the hash of a packed key, over its symbols as text the way the client hashed it
+uint64_t hash_packed_key(const uint8_t* key, uint32_t count) {
+    char* text = buffer_alloc((size_t) count + 1);
+    if (text == NULL) {
+        return 0;
+    }
+
+    unpack_text(key, count, text);
+    uint64_t hash = xxhash64(text, count, 0);
+    buffer_free(text);
+
+    return hash;
+}
+
+// keep a key the client offered by its hash and then had to send, if it really has that hash
+void keep_offered_key(const struct request_header* header, const struct offered_key* offered, uint64_t hash, uint32_t key_len, const void* key, size_t bytes) {
+    if ((header->flags & HEADER_KEY_HASH) && offered->format >= 0 && key_len == header->key_len && hash == offered->hash) {
+        key_store_add(hash, key_len, offered->format, key, bytes);
+    }
+}
+
+// serve every request the client puts in its shared memory ring, until it hangs up
+void serve_ring(int connectionSocket, int (*cipher)(char* content, long length, const char* key, struct cipher_error* error)) {
+    struct shm_ring ring;
+
+    if (ring_attach(&ring, connectionSocket) < 0) {
+        fprintf(stderr, "ERROR attaching client ring\n");
+        return;
+    }
+
+    // the ring is the client's to write at any time, so what is read from it is read once into
+    // locals, checked, and only the locals are used after that
+    uint64_t served = atomic_load_explicit(&ring.header->served, memory_order_relaxed);
+    int done = served % sizeof(uint64_t) != 0;
+    if (done) {
+        fprintf(stderr, "ERROR bad ring position from client\n");
+    }
+
+    while (!done) {
+        uint64_t head = atomic_load_explicit(&ring.header->head, memory_order_acquire);
+
+        // a head behind what was served, or more than a ring ahead of it, was never published
+        if (head < served || head - served > ring.capacity) {
+            fprintf(stderr, "ERROR bad ring head from client\n");
+            ring_close(&ring);
+            return;
+        }
+
+        // the entries published so far have to be served within the request deadline
+        if (served < head) {
+            set_deadline(connectionSocket, DEADLINE_REQUEST);
+        }
+
+        while (served < head) {
+            // entries can be slow to cipher, don't serve past a stop or a missed deadline
+            if (server_stopping() || deadline_missed) {
+                done = 1;
+                break;
+            }
+
+            uint64_t offset = served % ring.capacity;
+            struct ring_entry* entry = (struct ring_entry*) (ring.data + offset);
+            uint32_t size = __atomic_load_n(&entry->size, __ATOMIC_RELAXED);
+
+            if (size == RING_WRAP) {
+                served += ring.capacity - offset;
+                continue;
+            }
+
+            // never trust sizes that would reach outside the ring, or leave the next entry unaligned
+            if (size < sizeof(struct ring_entry) || size > ring.capacity - offset || size % sizeof(uint64_t) != 0) {
+                fprintf(stderr, "ERROR bad ring entry from client\n");
+                ring_close(&ring);
+                return;
+            }
+            uint32_t text_len = __atomic_load_n(&entry->text_len, __ATOMIC_RELAXED);
+            uint32_t key_len = __atomic_load_n(&entry->key_len, __ATOMIC_RELAXED);
+            if ((uint64_t) text_len + key_len > size - sizeof(struct ring_entry)) {
+                fprintf(stderr, "ERROR bad ring entry from client\n");
+                ring_close(&ring);
+                return;
+            }
+            char* text = RING_TEXT(entry);
+            const char* key = text + text_len;
+
+            struct cipher_error error;
+            struct cache_key lookup;
+            const void* cached;
+            int32_t status;
+            if (key_len < text_len) {
+                status = RING_LEN_ERROR;
+            } else if ((cached = cache_lookup(CACHE_TEXT, text, key, text_len, text_len, &lookup)) != NULL) {
+                memcpy(text, cached, text_len);
+                status = RING_DONE;
+            } else {
+                status = cipher(text, text_len, key, &error) ? RING_DONE : RING_CHAR_ERROR;
+                if (status == RING_DONE) {
+                    cache_store(&lookup, text, text_len);
+                }
+            }
+            entry->status = status;
+
+            served += size;
+            atomic_store_explicit(&ring.header->served, served, memory_order_release);
+
+            uint64_t one = 1;
+            if (write(ring.response_fd, &one, sizeof(one)) < 0) {
+                perror("ERROR waking client");
+            }
+        }
+
+        if (done) {
+            break;
+        }
+
+        // whatever was published has been served, so stopping here drops nothing
+        if (server_stopping()) {
+            break;
+        }
+
+        // a client that keeps the ring open has to keep using it
+        set_deadline(connectionSocket, DEADLINE_IDLE);
+
+        struct pollfd pfds[2] = {
+            { ring.request_fd, POLLIN, 0 },
+            { connectionSocket, POLLIN, 0 }
+        };
+        if (poll(pfds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+
+        if (pfds[0].revents & POLLIN) {
+            uint64_t count;
+            if (read(ring.request_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+                break;
+            }
+        }
+
+        report_if_asked();
+
+        // the client doesn't write to the socket once the ring is up, so this is a hang up
+        if (pfds[1].revents) {
+            char discard[64];
+            int got = recv(connectionSocket, discard, sizeof(discard), MSG_DONTWAIT);
+            if (got == 0 || (got < 0 && errno != EAGAIN && errno != EINTR)) {
+                done = atomic_load_explicit(&ring.header->head, memory_order_acquire) == served;
+            }
+        }
+    }
+
+    ring_close(&ring);
+}
+
+// fork one shard, the child keeps only its own listening socket
+static pid_t spawn_shard(struct server_config* config, int* listenSockets, int shard) {
+    fflush(NULL);
+    pid_t pid = fork();
+
+    if (pid < 0) {
+        perror("ERROR forking shard");
+        return -1;
+    }
+
+    if (pid == 0) {
+        // the supervisor decides about restarts, shards only drain
+        install_handlers(0);
+        drain_deadline = config->drain_seconds;
+        is_shard = 1;
+        cache_init(config->cache_bytes, config->key_store_bytes);
+        start_deadlines(config);
+
+        for (int i = 0; i < config->num_shards; i++) {
+            if (i != shard) {
+                close(listenSockets[i]);
+            }
+        }
+
+        if (config->pin_cpus) {
+            pin_to_cpu(config, shard, listenSockets[shard]);
+        }
+    }
+
+    return pid;
+}
+
+// returns the shard index in each shard process, the parent stays here
+// supervising (restarting shards that die) until it is told to stop
+int run_shards(struct server_config* config, int* listenSockets) {
+    pid_t pids[MAX_SHARDS];
+
+    // set before any fork, so every shard has it
+    buffer_init(config->huge_page_bytes, config->memory_bytes);
+    request_limit = config->request_bytes;
+    set_socket_profile(config->socket_profile);
+
+    if (config->num_shards == 1) {
+        cache_init(config->cache_bytes, config->key_store_bytes);
+        start_deadlines(config);
+        install_handlers(1);
+        drain_deadline = config->drain_seconds;
+        serving_config = config;
+        serving_listeners = listenSockets;
+        if (config->pin_cpus) {
+            pin_to_cpu(config, 0, listenSockets[0]);
+        }
+        return 0;
+    }
+
+    // every listener is already bound, so all shards start serving together
+    install_handlers(1);
+
+    for (int i = 0; i < config->num_shards; i++) {
+        pids[i] = spawn_shard(config, listenSockets, i);
+        if (pids[i] == 0) {
+            return i;
+        }
+    }
+
+    while (!server_stopping()) {
+        int status;
+        pid_t done = waitpid(-1, &status, 0);
+
+        if (done < 0) {
+            if (errno == EINTR) {
+                // every shard keeps its own cache, so each one reports
+                if (report_requested) {
+                    report_requested = 0;
+                    for (int i = 0; i < config->num_shards; i++) {
+                        if (pids[i] > 0) {
+                            kill(pids[i], SIGUSR1);
+                        }
+                    }
+                }
+                continue;
+            }
+            break;
+        }
+
+        // a shard went down on its own, bring it back on the same socket
+        for (int i = 0; i < config->num_shards; i++) {
+            if (pids[i] == done && !server_stopping()) {
+                fprintf(stderr, "SERVER: shard %d exited, restarting\n", i);
+                pids[i] = spawn_shard(config, listenSockets, i);
+                if (pids[i] == 0) {
+                    return i;
+                }
+            }
+        }
+    }
+
+    if (restart_requested) {
+        start_replacement(config, listenSockets);
+    }
+
+    // stop every shard and wait for them to drain before going away
+    for (int i = 0; i < config->num_shards; i++) {
+        if (pids[i] > 0) {
+            kill(pids[i], SIGTERM);
+        }
+    }
+    for (int i = 0; i < config->num_shards; i++) {
+        while (pids[i] > 0 && waitpid(pids[i], NULL, 0) < 0 && errno == EINTR);
+    }
+
+    for (int i = 0; i < config->num_shards; i++) {
+        close(listenSockets[i]);
+    }
+    finish_serving(config);
+    exit(0);
+}
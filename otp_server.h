@@ -0,0 +1,150 @@
+#ifndef OTP_SERVER_H
+#define OTP_SERVER_H
+
+/**
+* Server support shared by enc_server and dec_server
+* Command line options and running several shard processes on the same
+* port. Every shard has its own SO_REUSEPORT listening socket, so the
+* kernel spreads incoming connections between them and no shard has to
+* wait on a shared accept.
+*
+* Pinned shards also prefer memory from their cpu's NUMA node and ask the
+* kernel (SO_INCOMING_CPU) to hand them connections whose packets are
+* processed on that same cpu, so large payloads stay on one node.
+*
+* SIGTERM stops accepting and lets the requests in progress finish, up to
+* a drain deadline. SIGHUP or SIGUSR2 first starts the binary again
+* (picking up a rebuilt one) handing it the listening sockets, then
+* drains like SIGTERM, so no connection is refused during a roll out.
+*
+* Port 0 listens on a port the kernel picks. Once the listeners are up
+* the server prints "SERVER: listening on port N", which is how a test
+* harness knows it is ready and where it is.
+*
+* With -u the server also listens on a unix socket (a path, or "@name" for
+* the abstract namespace) for clients on the same host.
+*
+* With -C each shard keeps the results of recent requests (see otp_cache.h)
+* and SIGUSR1 prints its hit and miss counters. With -K it also keeps the
+* keys clients offer by hash, so a repeated key is only uploaded once.
+*
+* A connection has to get through each stage within its deadline: its
+* hello after it is accepted (-H), the next request while it is kept open
+* (-I), and each request from its first byte to the end of the response
+* (-R). A timer wheel (see otp_timer.h) ticking while a connection is
+* served shuts down the socket of one that stalls past its deadline, so a
+* client that connects and sends nothing can't hold a shard forever.
+*
+* The hello a client opens with (see otp_header.h) names its role and the
+* options it asks for (a shared memory ring, packed or compressed
+* transfers, sizes sent upfront). The reply grants them or refuses the
+* client, and is sent before the request behind the hello is read.
+*
+* -m caps the text and key a request announces, a bigger one is turned
+* down with a CIPHER_SIZE_ERROR, and caps the text a chunked request can
+* build up. -M caps the buffers every shard holds together, past it new
+* buffers spill to temp files (see otp_buffer.h). SIGUSR1 reports what is
+* held now and at the peak, per shard, for the largest connection and in
+* total.
+*
+* -T picks how connections are tuned (see otp_socket.h): latency sends
+* every frame straight away, throughput corks each response and sizes the
+* socket buffers to the request.
+*/
+
+#include <stddef.h>
+#include <netinet/in.h>
+
+#include "otp_header.h"
+#include "otp_cache.h"
+
+#define MAX_SHARDS 64
+#define MAX_CPUS 1024
+
+#define DEFAULT_DRAIN_SECONDS 10
+#define REFUSE_LINGER_MS 1000 // how long a refused client gets to stop sending
+#define PREALLOC_MAX_BYTES (16 * 1024 * 1024) // most a sized request is given before its text arrives
+
+// the deadlines a connection is held to, in seconds, 0 turns one off
+#define DEADLINE_HELLO 0   // from being accepted to the end of the hello
+#define DEADLINE_IDLE 1    // waiting for the next request on a kept connection
+#define DEADLINE_REQUEST 2 // from the start of a request to the end of its response
+#define NUM_DEADLINES 3
+#define DEFAULT_HELLO_SECONDS 5
+#define DEFAULT_IDLE_SECONDS 60
+#define DEFAULT_REQUEST_SECONDS 300
+#define DEFAULT_HUGE_PAGE_MEGABYTES 2 // one huge page, smaller payloads gain nothing from them
+#define LISTEN_FDS_ENV "OTP_LISTEN_FDS" // listening sockets passed to a restarted server
+#define UNIX_FD_ENV "OTP_UNIX_FD"       // and its unix socket listener
+
+struct server_config {
+    int port;
+    int num_shards; // processes serving the port, 1 means no forking
+    int pin_cpus;   // pin shard i to cpus[i % num_cpus]
+    int cpus[MAX_CPUS];
+    int num_cpus;   // 0 means every online cpu in order
+
+    int drain_seconds; // how long requests in progress get after SIGTERM
+    char** argv;       // to start the same command again on a hot restart
+
+    char* unix_path; // also listen here when set
+    int unixSocket;  // shared by every shard, -1 when there is none
+
+    size_t cache_bytes;     // result cache budget for each shard, 0 turns it off
+    size_t key_store_bytes; // and the budget for keys offered by hash
+
+    int deadline_seconds[NUM_DEADLINES]; // indexed by the DEADLINE_ stages
+
+    size_t huge_page_bytes; // payloads this big or bigger go on huge pages, 0 turns it off
+    size_t request_bytes;   // the most text and key one request can have, 0 for no limit
+    size_t memory_bytes;    // buffers all shards can hold before spilling to disk, 0 for no limit
+
+    char* capture_path; // record what clients send here (see otp_capture.h) when set
+
+    int socket_profile; // the SOCKET_ profile connections are tuned for
+};
+
+void parse_server_args(int argc, char* argv[], struct server_config* config);
+int inherit_listeners(struct server_config* config, int* listenSockets);
+void open_unix_listener(struct server_config* config);
+int listening_port(int listenSocket);
+void announce_listening(struct server_config* config, int listenSocket);
+int accept_client(int listenSocket, struct server_config* config, struct sockaddr_in* clientAddress);
+void finish_serving(struct server_config* config);
+// what was wrong with a request, and where
+struct cipher_error {
+    int code;    // one of the CIPHER_ codes
+    long offset; // the first bad char of the text or key, or where the key ran out
+};
+
+// a key offered by its hash in the request header
+struct offered_key {
+    int format;         // the CACHE_ form the handler keeps keys in, -1 if it keeps none
+    uint64_t hash;      // set when the header has HEADER_KEY_HASH
+    const void* cached; // the stored key, when the client sends only the text
+};
+
+#define CIPHER_OK 0
+#define CIPHER_LEN_ERROR 1
+#define CIPHER_CHAR_ERROR 2
+#define CIPHER_SIZE_ERROR 3 // over the request limit (-m), offset is the limit
+
+int check_hello(const struct hello* hello, int role);
+void refuse_client(int connectionSocket);
+void send_error_status(int connectionSocket, const struct cipher_error* error);
+int over_request_limit(uint64_t bytes, struct cipher_error* error);
+int start_request(int connectionSocket, int sized, struct request_header* header, struct cipher_error* error, struct offered_key* offered);
+int recv_request_packed(int connectionSocket, uint8_t** packed, uint32_t* count, uint64_t used, uint32_t most, struct cipher_error* error);
+int recv_request_blocks(int connectionSocket, char** data, uint32_t* length, uint64_t used, uint32_t most, struct cipher_error* error, int (*consume)(char* block, int length, uint32_t offset, void* arg), void* arg);
+uint64_t hash_packed_key(const uint8_t* key, uint32_t count);
+int hash_key_block(char* block, int length, uint32_t offset, void* arg);
+void keep_offered_key(const struct request_header* header, const struct offered_key* offered, uint64_t hash, uint32_t key_len, const void* key, size_t bytes);
+void serve_ring(int connectionSocket, int (*cipher)(char* content, long length, const char* key, struct cipher_error* error));
+int run_shards(struct server_config* config, int* listenSockets);
+int keep_serving();
+int server_stopping();
+int wait_for_request(int connectionSocket);
+void set_deadline(int connectionSocket, int stage);
+void clear_deadline();
+
+#endif
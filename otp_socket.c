@@ -0,0 +1,127 @@
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "otp_socket.h"
+
+static int profile = SOCKET_LATENCY;
+
+// the SOCKET_ profile called name, -1 if there is none
+int socket_profile_named(const char* name) {
+    if (strcmp(name, "latency") == 0) {
+        return SOCKET_LATENCY;
+    }
+    if (strcmp(name, "throughput") == 0) {
+        return SOCKET_THROUGHPUT;
+    }
+    return -1;
+}
+
+void set_socket_profile(int new_profile) {
+    profile = new_profile;
+}
+
+int socket_profile() {
+    return profile;
+}
+
+// set up a connection for the profile as soon as it is connected or accepted
+void tune_socket(int socketFD) {
+    int on = profile == SOCKET_LATENCY;
+    setsockopt(socketFD, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+}
+
+// send what MSG_MORE is holding back now, turning Nagle off pushes it out and
+// tune_socket puts the profile's setting back
+void push_socket(int socketFD) {
+    int on = 1;
+
+    setsockopt(socketFD, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    tune_socket(socketFD);
+}
+
+// grow one of the buffers to size, the kernel reports twice what was set
+static void grow_buffer(int socketFD, int option, size_t size) {
+    int current;
+    socklen_t length = sizeof(current);
+
+    if (size > SOCKET_BUFFER_MAX) {
+        size = SOCKET_BUFFER_MAX;
+    }
+    if (getsockopt(socketFD, SOL_SOCKET, option, &current, &length) < 0 || (size_t) current / 2 >= size) {
+        return;
+    }
+
+    int wanted = size;
+    setsockopt(socketFD, SOL_SOCKET, option, &wanted, sizeof(wanted));
+}
+
+// make room for a request once its sizes are known, never shrinking a buffer.
+// latency connections are left to autotuning, their requests are small
+void size_socket_buffers(int socketFD, size_t sending, size_t receiving) {
+    if (profile != SOCKET_THROUGHPUT) {
+        return;
+    }
+    grow_buffer(socketFD, SO_SNDBUF, sending);
+    grow_buffer(socketFD, SO_RCVBUF, receiving);
+}
+
+// hold back partial segments until uncork_socket, only on throughput connections
+void cork_socket(int socketFD) {
+    int on = 1;
+
+    if (profile == SOCKET_THROUGHPUT) {
+        setsockopt(socketFD, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+    }
+}
+
+// send what is held back, this has to happen before waiting on the other side
+void uncork_socket(int socketFD) {
+    int off = 0;
+
+    if (profile == SOCKET_THROUGHPUT) {
+        setsockopt(socketFD, IPPROTO_TCP, TCP_CORK, &off, sizeof(off));
+    }
+}
+
+// send what is held back and carry on corked
+void flush_socket(int socketFD) {
+    uncork_socket(socketFD);
+    cork_socket(socketFD);
+}
+
+// the length and the data in one write, returns -1 if the other side is gone
+int send_frame_all(int socketFD, const void* data, int length) {
+    struct iovec iov[2] = { { &length, sizeof(length) }, { (void*) data, length } };
+    struct msghdr msg = { 0 };
+
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+
+    while (msg.msg_iovlen > 0) {
+        ssize_t sent = sendmsg(socketFD, &msg, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent < 0) {
+            return -1;
+        }
+
+        // a partial write carries on from where it stopped
+        while (msg.msg_iovlen > 0 && (size_t) sent >= msg.msg_iov->iov_len) {
+            sent -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen > 0) {
+            msg.msg_iov->iov_base = (char*) msg.msg_iov->iov_base + sent;
+            msg.msg_iov->iov_len -= sent;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,47 @@
+#ifndef OTP_SOCKET_H
+#define OTP_SOCKET_H
+
+#include <stddef.h>
+
+/**
+* Socket tuning
+* Every frame is a 4 byte length and its data. Written with two sends, the
+* data of a small frame sits behind Nagle until the length is acked, which
+* a delayed ack can hold up for 40ms, and a big one goes out as an extra
+* tiny segment. send_frame_all writes the two in one sendmsg.
+*
+* How connections are tuned beyond that is a profile, picked with -T on
+* the servers and OTP_SOCKET_PROFILE on the clients:
+*
+* latency (the default) turns Nagle off (TCP_NODELAY), so every frame
+* leaves as soon as it is written. Best for small requests and the legacy
+* chunked transfers, where one is waiting on each response.
+*
+* throughput leaves Nagle on and corks (TCP_CORK) a connection while a
+* request or response is being written, so the frames go out as full
+* segments and the last partial one when it is uncorked. The socket
+* buffers are grown to the sizes a request header announces, up to
+* SOCKET_BUFFER_MAX, so a big transfer isn't held to what autotuning has
+* reached yet. Best for big requests on a link with a long round trip.
+*
+* The TCP options don't apply to unix sockets and failing to set them is
+* not an error, a connection is just left as it was.
+*/
+
+#define SOCKET_LATENCY 0
+#define SOCKET_THROUGHPUT 1
+
+#define SOCKET_BUFFER_MAX (16 * 1024 * 1024) // the kernel caps it lower unless rmem_max/wmem_max allow it
+
+int socket_profile_named(const char* name);
+void set_socket_profile(int profile);
+int socket_profile();
+void tune_socket(int socketFD);
+void push_socket(int socketFD);
+void size_socket_buffers(int socketFD, size_t sending, size_t receiving);
+void cork_socket(int socketFD);
+void uncork_socket(int socketFD);
+void flush_socket(int socketFD);
+int send_frame_all(int socketFD, const void* data, int length);
+
+#endif
@@ -0,0 +1,63 @@
+#include <string.h>
+
+#include "otp_timer.h"
+
+void wheel_init(struct timer_wheel* wheel) {
+    memset(wheel, 0, sizeof(*wheel));
+}
+
+// fire the timer ticks from now, at least on the next tick. arming an armed timer moves it
+void timer_arm(struct timer_wheel* wheel, struct otp_timer* timer, uint64_t ticks) {
+    if (timer->armed) {
+        timer_cancel(wheel, timer);
+    }
+
+    timer->due = wheel->now + (ticks > 0 ? ticks : 1);
+
+    struct otp_timer** slot = &wheel->slots[timer->due % WHEEL_SLOTS];
+    timer->prev = NULL;
+    timer->next = *slot;
+    if (*slot != NULL) {
+        (*slot)->prev = timer;
+    }
+    *slot = timer;
+
+    timer->armed = 1;
+    wheel->armed++;
+}
+
+void timer_cancel(struct timer_wheel* wheel, struct otp_timer* timer) {
+    if (!timer->armed) {
+        return;
+    }
+
+    if (timer->prev != NULL) {
+        timer->prev->next = timer->next;
+    } else {
+        wheel->slots[timer->due % WHEEL_SLOTS] = timer->next;
+    }
+    if (timer->next != NULL) {
+        timer->next->prev = timer->prev;
+    }
+
+    timer->armed = 0;
+    wheel->armed--;
+}
+
+// move the wheel on by ticks (more than one when some were missed), firing what is due
+void wheel_tick(struct timer_wheel* wheel, uint64_t ticks) {
+    while (ticks-- > 0) {
+        wheel->now++;
+
+        struct otp_timer* timer = wheel->slots[wheel->now % WHEEL_SLOTS];
+        while (timer != NULL) {
+            // fire may arm the timer again, so step past it first
+            struct otp_timer* next = timer->next;
+            if (timer->due <= wheel->now) {
+                timer_cancel(wheel, timer);
+                timer->fire(timer);
+            }
+            timer = next;
+        }
+    }
+}
@@ -0,0 +1,42 @@
+#ifndef OTP_TIMER_H
+#define OTP_TIMER_H
+
+#include <stdint.h>
+
+/**
+* Timer wheel
+* A hashed timer wheel: WHEEL_SLOTS lists of timers, a timer due at tick t
+* sits in slot t % WHEEL_SLOTS. Arming and cancelling only link or unlink
+* one timer, and each tick looks at a single slot, firing the timers in it
+* that are due and skipping the ones a full turn or more away. Everything
+* is O(1) however many timers are armed.
+*
+* The wheel doesn't keep time itself; whoever owns it calls wheel_tick
+* every TIMER_TICK_MS. The servers do it from a signal handler, so a
+* timer's fire function has to be async-signal-safe, and arming or
+* cancelling has to happen with the tick signal blocked.
+*/
+
+#define WHEEL_SLOTS 256
+#define TIMER_TICK_MS 100
+
+struct otp_timer {
+    struct otp_timer* prev;
+    struct otp_timer* next;
+    uint64_t due; // the tick it fires on
+    int armed;
+    void (*fire)(struct otp_timer* timer);
+};
+
+struct timer_wheel {
+    struct otp_timer* slots[WHEEL_SLOTS];
+    uint64_t now; // ticks so far
+    int armed;    // timers waiting in the slots
+};
+
+void wheel_init(struct timer_wheel* wheel);
+void timer_arm(struct timer_wheel* wheel, struct otp_timer* timer, uint64_t ticks);
+void timer_cancel(struct timer_wheel* wheel, struct otp_timer* timer);
+void wheel_tick(struct timer_wheel* wheel, uint64_t ticks);
+
+#endif
@@ -0,0 +1,243 @@
+#!/bin/bash
+# Regression harness, the parallel and timed successor to p5testscript
+#
+# Starts enc_server and dec_server on ports the kernel picks, and key_server
+# on a socket of its own, waiting for each to be listening instead of
+# sleeping, then runs every case at once against them. Each case is timed
+# and written to the report as a tab separated line, after a "#" line
+# naming the build:
+#
+#   case  result  wall_ms  bytes  mb_per_s
+#
+# bytes is the plaintext the case put through the servers (0 for the ones
+# that only check an error), so wall_ms and mb_per_s of a case can be
+# compared between reports from different builds. -c does that against an
+# earlier report.
+#
+# usage: ./regress.sh [-o report] [-c baseline] [-n shards]
+# exits 1 if any case failed or the servers didn't start
+
+report=regress-report.tsv
+baseline=
+shards=$(nproc 2>/dev/null || echo 1)
+[ "$shards" -gt 8 ] && shards=8
+
+while getopts "o:c:n:" opt; do
+    case $opt in
+        o) report=$OPTARG ;;
+        c) baseline=$OPTARG ;;
+        n) shards=$OPTARG ;;
+        *) echo "usage: $0 [-o report] [-c baseline] [-n shards]" 1>&2; exit 1 ;;
+    esac
+done
+
+cd "$(dirname "$0")" || exit 1
+work=$(mktemp -d) || exit 1
+pids=
+cases=
+
+cleanup() {
+    [ -n "$pids" ] && kill $pids 2>/dev/null
+    wait 2>/dev/null
+    rm -rf "$work"
+}
+trap cleanup EXIT
+
+# start a server on port 0 and set the variable named $2 to the port it ended up on,
+# once it is listening, anything after that is passed to the server
+start_server() {
+    local server=$1 variable=$2 log=$work/$1.log
+    shift 2
+
+    ./$server -n "$shards" "$@" 0 > "$log" 2>&1 &
+    pids="$pids $!"
+
+    for i in $(seq 100); do
+        local port=$(sed -n 's/^SERVER: listening on port \([0-9]*\)$/\1/p' "$log")
+        if [ -n "$port" ]; then
+            printf -v "$variable" "%s" "$port"
+            return 0
+        fi
+        kill -0 $! 2>/dev/null || break
+        sleep 0.05
+    done
+
+    echo "$server did not start:" 1>&2
+    cat "$log" 1>&2
+    return 1
+}
+
+# start key_server with pools of length $1 on a socket under $work, once it is listening
+start_key_server() {
+    ./key_server -s "$1:2" "$work/keys.sock" > "$work/key_server.log" 2>&1 &
+    pids="$pids $!"
+
+    for i in $(seq 100); do
+        [ -S "$work/keys.sock" ] && return 0
+        kill -0 $! 2>/dev/null || break
+        sleep 0.05
+    done
+
+    echo "key_server did not start:" 1>&2
+    cat "$work/key_server.log" 1>&2
+    return 1
+}
+
+now_ms() {
+    echo $(( $(date +%s%N) / 1000000 ))
+}
+
+# run a case in the background: name bytes command...
+# the command's exit status is the result, its output is kept for a failure
+run_case() {
+    local name=$1 bytes=$2
+    shift 2
+
+    (
+        local start=$(now_ms)
+        "$@" > "$work/$name.out" 2>&1
+        local status=$?
+        local ms=$(( $(now_ms) - start ))
+
+        awk -v name="$name" -v ok="$status" -v ms="$ms" -v bytes="$bytes" 'BEGIN {
+            rate = ms > 0 ? bytes / 1048576 / (ms / 1000) : 0
+            printf "%s\t%s\t%d\t%d\t%.2f\n", name, ok == 0 ? "pass" : "FAIL", ms, bytes, rate
+        }' > "$work/$name.result"
+    ) &
+    cases="$cases $!"
+}
+
+# wait for the cases started so far
+wait_cases() {
+    wait $cases
+    cases=
+}
+
+# the cases, each has its own files under $work
+
+keygen_length() {
+    ./keygen "$1" > "$work/key$1" && [ "$(wc -m < "$work/key$1")" -eq $(( $1 + 1 )) ]
+}
+
+# a key of $1 symbols from the key service is that long and only of the 27 symbols
+served_key() {
+    local key=$work/served$1
+
+    ./keygen -s "$work/keys.sock" "$1" > "$key" || return 1
+    [ "$(wc -m < "$key")" -eq $(( $1 + 1 )) ] || { echo "key length differs"; return 1; }
+    [ "$(head -c "$1" "$key" | tr -d 'A-Z ' | wc -c)" -eq 0 ] || { echo "key has bad characters"; return 1; }
+}
+
+# two pooled clients of a server with a single shard, each leaving its connection idle
+# between requests, neither may be held up until the other's connection times out
+two_pools() {
+    ./otp_libcheck pool "$poolport" "$work/pool_a" & local a=$!
+    ./otp_libcheck pool "$poolport" "$work/pool_b" & local b=$!
+    wait $a && wait $b
+}
+
+short_key() {
+    ./enc_client plaintext1 "$work/key20" "$encport" | grep -qi "key"
+}
+
+bad_chars() {
+    ./enc_client plaintext5 "$work/key70000" "$encport" | grep -qi "invalid character"
+}
+
+# a client sent to the other kind of server is refused and exits non-zero
+wrong_role() {
+    local out
+    out=$(./$1 plaintext1 "$work/key70000" "$2") && return 1
+    echo "$out" | grep -qi "permission"
+}
+
+# encrypt and decrypt a plaintext with the transfer mode in $1 (an environment setting),
+# through the servers' ports unless other endpoints follow the name
+round_trip() {
+    local mode=$1 text=$2 cipher=$work/$3.cipher plain=$work/$3.plain enc=${4:-$encport} dec=${5:-$decport}
+
+    env $mode ./enc_client "$text" "$work/key70000" "$enc" > "$cipher" || return 1
+    [ "$(wc -m < "$cipher")" -eq "$(wc -m < "$text")" ] || { echo "ciphertext length differs"; return 1; }
+    grep -q '[^A-Z ]' "$cipher" && { echo "ciphertext has bad characters"; return 1; }
+
+    env $mode ./dec_client "$cipher" "$work/key70000" "$dec" > "$plain" || return 1
+    cmp "$text" "$plain"
+}
+
+# each client is also given the other role's server, which refuses it once the first request
+# is sent. the request has to go through anyway, either endpoint can be picked first
+mixed_endpoints() {
+    local transfer
+    for transfer in OTP_PACKED=1 OTP_PACKED=0 OTP_COMPRESS=1; do
+        round_trip "$transfer" plaintext4 "mixed_${transfer#OTP_}" "$decport,$encport" "$encport,$decport" || return 1
+    done
+}
+
+start_server enc_server encport -u "$work/enc.sock" || exit 1
+start_server dec_server decport -u "$work/dec.sock" || exit 1
+start_server enc_server poolport -n 1 || exit 1
+start_server enc_server limitport -n 1 -m 1 || exit 1
+start_key_server 1000 || exit 1
+
+# the keys every other case uses come first
+start=$(now_ms)
+run_case keygen_20 0 keygen_length 20
+run_case keygen_70000 0 keygen_length 70000
+wait_cases
+
+run_case short_key 0 short_key
+run_case bad_chars 0 bad_chars
+run_case wrong_role_dec 0 wrong_role dec_client "$encport"
+run_case wrong_role_enc 0 wrong_role enc_client "$decport"
+# one length the pool keeps ready and one longer than it, made on demand
+run_case served_key_pooled 0 served_key 1000
+run_case served_key_unpooled 0 served_key 5000
+run_case two_pools 0 two_pools
+# the asynchronous client library, which only programs embedding libotpclient.a use
+run_case async_library 0 ./otp_libcheck async "$encport" "$decport"
+run_case mixed_endpoints $(( $(wc -c < plaintext4) * 6 )) mixed_endpoints
+# requests that don't announce their sizes, over and under -m
+run_case request_limit 0 ./otp_libcheck limit "$limitport" "$work/limit.out"
+# plaintext5 has a bad character, it is the bad_chars case
+for transfer in packed: chunked:OTP_PACKED=0 compressed:OTP_COMPRESS=1; do
+    label=${transfer%%:*}
+    for i in 1 2 3 4; do
+        run_case "round_trip_${i}_$label" $(( $(wc -c < plaintext$i) * 2 )) round_trip "${transfer#*:}" plaintext$i "rt${i}_$label"
+    done
+done
+# only the unix sockets as endpoints, so a request that can't go through the ring fails
+for i in 1 2 3 4; do
+    run_case "round_trip_${i}_shm" $(( $(wc -c < plaintext$i) * 2 )) round_trip OTP_SHM=1 plaintext$i "rt${i}_shm" "unix:$work/enc.sock" "unix:$work/dec.sock"
+done
+wait_cases
+total=$(( $(now_ms) - start ))
+
+{
+    echo "# build $(git rev-parse --short HEAD 2>/dev/null || echo unknown) $(date -u +%Y-%m-%dT%H:%M:%SZ) shards $shards total_ms $total"
+    cat "$work"/*.result | sort
+} > "$report"
+
+failed=0
+while IFS=$'\t' read -r name result ms bytes rate; do
+    [ "${name:0:1}" = "#" ] && continue
+    printf "%-24s %s %6s ms" "$name" "$result" "$ms"
+    [ "$bytes" -gt 0 ] && printf " %8s MB/s" "$rate"
+    echo
+    if [ "$result" != pass ]; then
+        failed=1
+        sed 's/^/    /' "$work/$name.out"
+    fi
+done < "$report"
+echo "$(grep -c -v '^#' "$report") cases in $total ms, report in $report"
+
+if [ -n "$baseline" ]; then
+    echo "against $baseline ($(head -n 1 "$baseline" | cut -c3-)):"
+    awk -F'\t' '
+        FNR == NR { if ($1 !~ /^#/) old[$1] = $3; next }
+        $1 !~ /^#/ && ($1 in old) {
+            change = old[$1] > 0 ? ($3 - old[$1]) * 100 / old[$1] : 0
+            printf "%-24s %6d ms -> %6d ms %+7.1f%%\n", $1, old[$1], $3, change
+        }' "$baseline" "$report"
+fi
+
+exit $failed